@@ -0,0 +1,316 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  benchmark.cpp
+//  Measure how fast the Emulator runs a fixed set of programs
+//
+//  Created by Chris Marrin on 6/15/24.
+//
+
+// benchmark runs each program in the corpus below without a console, on
+// each engine, and reports instructions and cycles per second of host
+// time. Each is run several times and the fastest is kept, since anything
+// slower is the host getting in the way.
+//
+// Programs which exit are timed to the exit. perf loops forever, so it's
+// run for a fixed number of cycles. BASIC is given a program to type in,
+// which runs and then exits with USR. Input is typed as on a terminal, so
+// newlines become CRs.
+//
+// MHz is the clock rate of a real 6809 which would take as long. Peak RSS
+// is for the whole process, so it's the largest of all the runs.
+//
+// Results can be written as a JSON object, and a previous file given as a
+// baseline to see what a change did to the speed. Each benchmark's entry
+// is on a line of its own, which is how the baseline is read back. When
+// the JSON goes to stdout the table of results goes to stderr, so stdout
+// is only the JSON.
+//
+// Usage: benchmark -d dir -r runs -o jsonfile -b baseline -p percent [name ...]
+//
+//          -d:         root of the repo, where the programs are. Default ..
+//          -r:         number of runs of each, default 3
+//          -o:         write the results as JSON to jsonfile, - for stdout
+//                      with everything else on stderr
+//          -b:         compare with baseline, a file written with -o. Returns
+//                      1 if any benchmark got slower by more than -p percent
+//          -p:         percent MIPS can drop before -b fails, default 5
+//          name:       run just these benchmarks
+
+#include "Batch.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace mc6809;
+
+struct Benchmark
+{
+    const char* name;
+    const char* image;      // s19 file
+    const char* input;      // Typed at the console, or nullptr
+    uint64_t cycles;        // How long to run a program which doesn't exit, or 0
+};
+
+static const Benchmark corpus[ ] = {
+    { "perf",       "test/perf.s19",    nullptr,            200000000 },
+    { "bench09",    "test/bench09.s19", nullptr,            0 },
+    { "clover",     "Clover/perf.s19",  nullptr,            0 },
+    { "basic",      "test/basic.s19",   "bench/primes.bas", 0 },
+};
+
+struct EngineInfo
+{
+    Engine engine;
+    const char* name;
+};
+
+static const EngineInfo engines[ ] = {
+    { Engine::Interpreter,  "interpreter" },
+    { Engine::Threaded,     "threaded" },
+};
+
+struct Result
+{
+    std::string name;
+    const char* engine;
+    BatchResult run;
+    bool ok;
+
+    double mips() const { return double(run.instructions) / run.seconds / 1e6; }
+    double mhz() const { return double(run.cycles) / run.seconds / 1e6; }
+    double cyclesPerNs() const { return double(run.cycles) / run.seconds / 1e9; }
+};
+
+static bool readFile(const std::string& filename, std::string& s)
+{
+    std::ifstream f(filename);
+    if (!f.is_open()) {
+        return false;
+    }
+    std::stringstream stream;
+    stream << f.rdbuf();
+    s = stream.str();
+    return true;
+}
+
+// Where the table of results and the comparison are written. It's stderr
+// when the JSON is written to stdout
+static FILE* report = stdout;
+
+// ru_maxrss is in bytes on macOS and KB on Linux
+static uint64_t peakRSS()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return uint64_t(usage.ru_maxrss);
+#else
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+}
+
+// Run the benchmark runs times on each engine and keep the fastest
+static bool runBenchmark(const std::string& dir, const Benchmark& bench, uint32_t runs, std::vector<Result>& results)
+{
+    BatchJob job;
+    job.name = bench.name;
+    if (!readFile(dir + "/" + bench.image, job.image)) {
+        fprintf(report, "%-10s can't open '%s', skipped\n", bench.name, bench.image);
+        return false;
+    }
+    if (bench.input) {
+        if (!readFile(dir + "/" + bench.input, job.input)) {
+            fprintf(report, "%-10s can't open '%s', skipped\n", bench.name, bench.input);
+            return false;
+        }
+        for (auto& c : job.input) {
+            if (c == '\n') {
+                c = '\r';
+            }
+        }
+    }
+
+    // One thread, so nothing else is competing for the core
+    BatchRunner runner(1);
+    if (bench.cycles) {
+        runner.setMaxCycles(bench.cycles);
+    }
+
+    bool ok = true;
+    for (const auto& engine : engines) {
+        runner.setEngine(engine.engine);
+
+        Result result { bench.name, engine.name, { }, false };
+        for (uint32_t i = 0; i < runs; ++i) {
+            BatchResult run = runner.run({ job })[0];
+            if (i == 0 || run.seconds < result.run.seconds) {
+                result.run = std::move(run);
+            }
+        }
+
+        // A program run for a fixed number of cycles should still be
+        // going at the end
+        const BatchResult& run = result.run;
+        result.ok = bench.cycles ? (run.status == BatchStatus::Timeout)
+                                 : (run.status == BatchStatus::Exited && run.exitCode == 0);
+
+        fprintf(report, "%-10s %-12s %12llu insts %12llu cycles %8.3fs %9.2f MIPS %9.2f MHz %7.3f cycles/ns",
+               result.name.c_str(), result.engine, (unsigned long long) run.instructions,
+               (unsigned long long) run.cycles, run.seconds, result.mips(), result.mhz(), result.cyclesPerNs());
+        if (!result.ok) {
+            fprintf(report, " *** %s, code %d", BatchRunner::statusToString(run.status), run.exitCode);
+        }
+        fprintf(report, "\n");
+
+        ok = ok && result.ok;
+        results.push_back(std::move(result));
+    }
+    return ok;
+}
+
+static void writeJSON(FILE* f, const std::vector<Result>& results, uint32_t runs)
+{
+    fprintf(f, "{\n    \"runs\": %d,\n    \"peakRSS\": %llu,\n    \"benchmarks\": [\n", runs, (unsigned long long) peakRSS());
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        fprintf(f, "        { \"name\": \"%s\", \"engine\": \"%s\", \"status\": \"%s\", \"exitCode\": %d, "
+                   "\"instructions\": %llu, \"cycles\": %llu, \"seconds\": %.6f, "
+                   "\"mips\": %.3f, \"mhz\": %.3f, \"cyclesPerNs\": %.6f }%s\n",
+                r.name.c_str(), r.engine, BatchRunner::statusToString(r.run.status), r.run.exitCode,
+                (unsigned long long) r.run.instructions, (unsigned long long) r.run.cycles, r.run.seconds,
+                r.mips(), r.mhz(), r.cyclesPerNs(), (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(f, "    ]\n}\n");
+}
+
+// Value of "key": in a line of JSON written by writeJSON
+static std::string jsonValue(const std::string& line, const char* key)
+{
+    std::string tag = std::string("\"") + key + "\": ";
+    size_t pos = line.find(tag);
+    if (pos == std::string::npos) {
+        return "";
+    }
+    pos += tag.size();
+    if (line[pos] == '"') {
+        pos += 1;
+        return line.substr(pos, line.find('"', pos) - pos);
+    }
+    return line.substr(pos, line.find_first_of(",}", pos) - pos);
+}
+
+// Returns false if the baseline can't be read. ok is false if anything is
+// slower than the baseline by more than percent
+static bool compare(const char* filename, const std::vector<Result>& results, double percent, bool& ok)
+{
+    std::ifstream f(filename);
+    if (!f.is_open()) {
+        return false;
+    }
+
+    // MIPS of each benchmark on each engine
+    std::map<std::string, double> baseline;
+    std::string line;
+    while (std::getline(f, line)) {
+        std::string name = jsonValue(line, "name");
+        if (!name.empty()) {
+            baseline[name + "/" + jsonValue(line, "engine")] = atof(jsonValue(line, "mips").c_str());
+        }
+    }
+
+    fprintf(report, "\nCompared with %s:\n", filename);
+    ok = true;
+    for (const auto& it : results) {
+        std::string key = it.name + "/" + it.engine;
+        auto base = baseline.find(key);
+        if (base == baseline.end() || base->second == 0) {
+            fprintf(report, "%-24s %9.2f MIPS, not in baseline\n", key.c_str(), it.mips());
+            continue;
+        }
+        double change = (it.mips() - base->second) / base->second * 100;
+        bool slower = change < -percent;
+        fprintf(report, "%-24s %9.2f MIPS, was %9.2f, %+6.1f%%%s\n", key.c_str(), it.mips(), base->second, change,
+               slower ? " *** slower" : "");
+        ok = ok && !slower;
+    }
+    return true;
+}
+
+int main(int argc, char * const argv[])
+{
+    std::string dir = "..";
+    uint32_t runs = 3;
+    const char* jsonFile = nullptr;
+    const char* baselineFile = nullptr;
+    double percent = 5;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:r:o:b:p:")) != -1) {
+        switch (c) {
+            case 'd': dir = optarg; break;
+            case 'r': runs = std::max(1, atoi(optarg)); break;
+            case 'o': jsonFile = optarg; break;
+            case 'b': baselineFile = optarg; break;
+            case 'p': percent = atof(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-d dir] [-r runs] [-o jsonfile] [-b baseline] [-p percent] [name ...]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    bool jsonToStdout = jsonFile && strcmp(jsonFile, "-") == 0;
+    if (jsonToStdout) {
+        report = stderr;
+    }
+
+    std::vector<Result> results;
+    bool ok = true;
+    for (const auto& bench : corpus) {
+        bool selected = optind >= argc;
+        for (int i = optind; i < argc; ++i) {
+            selected = selected || strcmp(argv[i], bench.name) == 0;
+        }
+        if (selected) {
+            ok = runBenchmark(dir, bench, runs, results) && ok;
+        }
+    }
+
+    fprintf(report, "Peak RSS %.1f MB\n", double(peakRSS()) / (1024 * 1024));
+
+    if (jsonFile) {
+        FILE* f = jsonToStdout ? stdout : fopen(jsonFile, "w");
+        if (!f) {
+            fprintf(stderr, "Can't create '%s'\n", jsonFile);
+            exit(EXIT_FAILURE);
+        }
+        writeJSON(f, results, runs);
+        if (f != stdout) {
+            fclose(f);
+        }
+    }
+
+    if (baselineFile) {
+        bool asFast;
+        if (!compare(baselineFile, results, percent, asFast)) {
+            fprintf(stderr, "Can't open baseline '%s'\n", baselineFile);
+            exit(EXIT_FAILURE);
+        }
+        ok = ok && asFast;
+    }
+    return ok ? 0 : 1;
+}
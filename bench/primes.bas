@@ -0,0 +1,14 @@
+10 C=0
+20 N=2
+30 D=2
+40 IF D*D>N GOTO 80
+50 IF N-N/D*D=0 GOTO 90
+60 D=D+1
+70 GOTO 40
+80 C=C+1
+90 N=N+1
+100 IF N<2000 GOTO 30
+110 PRINT C
+120 X=USR(-1010,0)
+130 REM COUNT THE PRIMES BELOW 2000. USR(-1010) IS EXIT AT $FC0E
+RUN
@@ -0,0 +1,186 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Assembler.cpp
+//  Assemble a program with lwasm in this process
+//
+//  Created by Chris Marrin on 6/24/24.
+//
+
+#include "Assembler.h"
+
+#ifdef ASSEMBLER
+
+#include "../lwtools/lwasm/liblwasm.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+
+using namespace mc6809;
+
+static std::mutex assemblerMutex;
+
+bool Assembler::assemble(Emulator& emu, const char* name, const char* source, size_t size)
+{
+    _emu = &emu;
+    _image = nullptr;
+    bool ok = run(name, source, size);
+
+    // Discard any decoded instructions from the memory written
+    if (_size) {
+        uint32_t span = _high - _low;
+        if (span > 0xffff) {
+            emu.invalidateDecodeCache();
+        } else {
+            emu.invalidateDecodeCache(uint16_t(_low), uint16_t(span));
+        }
+    }
+    return ok;
+}
+
+bool Assembler::assemble(std::string& image, const char* name, const char* source, size_t size)
+{
+    _emu = nullptr;
+    _image = &image;
+    image.clear();
+    if (!run(name, source, size)) {
+        return false;
+    }
+
+    // DECB postamble
+    image += char(0xff);
+    image += char(0);
+    image += char(0);
+    image += char(_startAddr >> 8);
+    image += char(_startAddr);
+    return true;
+}
+
+bool Assembler::run(const char* name, const char* source, size_t size)
+{
+    _outOfRange = false;
+    _startAddr = 0;
+    _size = 0;
+    _low = 0;
+    _high = 0;
+    _symbols.clear();
+    _errors.clear();
+
+    std::vector<const char*> includeDirs;
+    for (const auto& it : _includeDirs) {
+        includeDirs.push_back(it.c_str());
+    }
+    includeDirs.push_back(nullptr);
+
+    lwasm_lib_options_t options = { };
+    options.name = name;
+    options.source = source;
+    options.size = int(size);
+    options.include_dirs = includeDirs.data();
+    options.ctx = this;
+    options.emit = _emu ? emitRAM : emitImage;
+    options.symbol = symbol;
+    options.error = error;
+
+    int execAddr;
+    int errors;
+    {
+        std::lock_guard<std::mutex> lock(assemblerMutex);
+        errors = lwasm_lib_assemble(&options, &execAddr);
+    }
+
+    if (errors || _outOfRange) {
+        return false;
+    }
+    if (execAddr >= 0) {
+        _startAddr = uint16_t(execAddr);
+    }
+    return true;
+}
+
+void Assembler::emitRAM(void* ctx, int addr, const unsigned char* data, int size)
+{
+    Assembler* self = static_cast<Assembler*>(ctx);
+    if (uint32_t(addr) + uint32_t(size) > self->_emu->ramSize()) {
+        if (!self->_outOfRange) {
+            char buf[80];
+            snprintf(buf, sizeof(buf), "$%x-$%x is outside of RAM\n", addr, addr + size - 1);
+            self->_errors += buf;
+            self->_outOfRange = true;
+        }
+        return;
+    }
+    memcpy(self->_emu->getAddr(uint16_t(addr)), data, size);
+    self->emitted(addr, size);
+}
+
+void Assembler::emitImage(void* ctx, int addr, const unsigned char* data, int size)
+{
+    Assembler* self = static_cast<Assembler*>(ctx);
+    std::string& image = *self->_image;
+
+    // Add to the last block if this follows it, otherwise start a new one.
+    // A block is $00, a 16 bit length and address and the data
+    size_t block = self->_block;
+    uint32_t length = image.empty() ? 0 : ((uint8_t(image[block + 1]) << 8) | uint8_t(image[block + 2]));
+    if (image.empty() || uint32_t(addr) != self->_next || length + size > 0xffff) {
+        block = image.size();
+        length = 0;
+        image += char(0);
+        image += char(0);
+        image += char(0);
+        image += char(addr >> 8);
+        image += char(addr);
+        self->_block = block;
+    }
+    length += size;
+    image[block + 1] = char(length >> 8);
+    image[block + 2] = char(length);
+    image.append(reinterpret_cast<const char*>(data), size);
+    self->_next = uint32_t(addr + size);
+    self->emitted(addr, size);
+}
+
+void Assembler::symbol(void* ctx, const char* name, int value)
+{
+    static_cast<Assembler*>(ctx)->_symbols.push_back({ name, uint16_t(value) });
+}
+
+void Assembler::error(void* ctx, const char* file, int line, int warning, const char* message)
+{
+    char buf[40];
+    if (line) {
+        snprintf(buf, sizeof(buf), "(%d)", line);
+    } else {
+        buf[0] = '\0';
+    }
+
+    std::string& errors = static_cast<Assembler*>(ctx)->_errors;
+    errors += file;
+    errors += buf;
+    errors += warning ? " : WARNING : " : " : ERROR : ";
+    errors += message;
+    errors += "\n";
+}
+
+void Assembler::emitted(int addr, int size)
+{
+    if (_size == 0) {
+        _startAddr = uint16_t(addr);
+        _low = uint32_t(addr);
+        _high = uint32_t(addr + size);
+    } else {
+        _low = std::min(_low, uint32_t(addr));
+        _high = std::max(_high, uint32_t(addr + size));
+    }
+    _size += size;
+}
+
+#endif
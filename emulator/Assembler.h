@@ -0,0 +1,101 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Assembler.h
+//  Assemble a program with lwasm in this process
+//
+//  Created by Chris Marrin on 6/24/24.
+//
+
+#pragma once
+
+#include "MC6809.h"
+
+#ifdef ASSEMBLER
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace mc6809 {
+
+// Assembler runs lwasm's passes on source in memory, through the interface
+// in lwtools/lwasm/liblwasm.h, and puts the code straight into the
+// emulator's RAM or into a DECB image for BatchRunner. It's the same as
+// "lwasm -f srec" followed by loading the s-records, without starting
+// lwasm or writing and reading the .s19 and .lst files. The symbols take
+// the place of the listing for the Profiler.
+//
+// lwasm keeps some of its state in globals so assemblies are run one at
+// a time, and it doesn't free the memory it uses for each one.
+class Assembler
+{
+  public:
+    struct Symbol
+    {
+        std::string name;
+        uint16_t value;
+    };
+
+    // Where include files are looked for after the source's directory,
+    // like lwasm -I
+    void addIncludeDir(const std::string& dir) { _includeDirs.push_back(dir); }
+
+    // name is the source's path, used in errors and to find includes.
+    // Returns false if there were errors or the code isn't all in RAM.
+    // Nothing is stored if there were errors
+    bool assemble(Emulator&, const char* name, const char* source, size_t size);
+
+    // Assemble into a DECB image, which Loader can load
+    bool assemble(std::string& image, const char* name, const char* source, size_t size);
+
+    // Address given with END, or the first byte of code if there isn't one
+    uint16_t startAddr() const { return _startAddr; }
+
+    // Bytes of code
+    uint32_t size() const { return _size; }
+
+    // Labels and EQUs, in name order
+    const std::vector<Symbol>& symbols() const { return _symbols; }
+
+    // Errors and warnings, a line each in lwasm's format
+    const std::string& errors() const { return _errors; }
+
+  private:
+    bool run(const char* name, const char* source, size_t size);
+
+    static void emitRAM(void* ctx, int addr, const unsigned char* data, int size);
+    static void emitImage(void* ctx, int addr, const unsigned char* data, int size);
+    static void symbol(void* ctx, const char* name, int value);
+    static void error(void* ctx, const char* file, int line, int warning, const char* message);
+
+    void emitted(int addr, int size);
+
+    std::vector<std::string> _includeDirs;
+
+    // Where emitRAM and emitImage put the code
+    Emulator* _emu = nullptr;
+    std::string* _image = nullptr;
+
+    // Offset of the last DECB block in _image and the address after it
+    size_t _block = 0;
+    uint32_t _next = 0;
+
+    bool _outOfRange = false;
+    uint16_t _startAddr = 0;
+    uint32_t _size = 0;
+    uint32_t _low = 0;
+    uint32_t _high = 0;
+    std::vector<Symbol> _symbols;
+    std::string _errors;
+};
+
+}
+
+#endif
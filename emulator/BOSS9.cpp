@@ -13,253 +13,548 @@
 //  Created by Chris Marrin on 5/4/24.
 //
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdlib>
 #include <cctype>
+#include <cstring>
+#include <type_traits>
+
+#ifndef ARDUINO
+#include <chrono>
+#include <thread>
+#endif
 
 #include "BOSS9.h"
-#include "Format.h"
+#include "Formatter.h"
+#include "InputLog.h"
 #include "MC6809.h"
 
 #ifdef ARDUINO
 // Clock function for timing
 static inline float getClock() { return float(millis()) / 1000; }
+static inline uint32_t getMicros() { return micros(); }
 #else
 static inline float getClock() { return float(clock()) / CLOCKS_PER_SEC; }
+static inline uint32_t getMicros()
+{
+    return uint32_t(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+#endif
+
+// Wait until getMicros() reaches target. Sleeps can wake up late by more
+// than a paced slice, so sleep most of the way and spin the rest
+static void waitUntil(uint32_t target)
+{
+#ifdef ARDUINO
+    int32_t left = int32_t(target - getMicros());
+    if (left > 0) {
+        delayMicroseconds(left);
+    }
+#else
+    static constexpr int32_t SpinTime = 200;
+    int32_t left = int32_t(target - getMicros());
+    if (left > SpinTime) {
+        std::this_thread::sleep_for(std::chrono::microseconds(left - SpinTime));
+    }
+    while (int32_t(target - getMicros()) > 0) { }
 #endif
+}
 
 using namespace mc6809;
 
-// Args start at U+6 (3 pointers:self, retaddr, prevU)
-// _nextAddr and _initialAddr are relative to arg start
-class VarArg
+// Formatted output to the console
+class ConsoleSink : public FormatSink
 {
   public:
-    VarArg(BOSS9Base* boss9, uint16_t lastArgOffset, fmt::Type lastArgType)
-        : _boss9(boss9)
-    {
-        initialize(lastArgOffset, lastArgType);
-    }
+    ConsoleSink(const BOSS9Base& boss9) : _boss9(boss9) { }
     
-    VarArg(BOSS9Base* boss9)
-        : _boss9(boss9)
-    {
-        initialize();
-    }
+    virtual void write(const char* buf, uint16_t size) override { _boss9.output(buf, size); }
     
-    // Type returned is always ArgUNativeType. Use reinterpret_cast to convert to the proper type
-    uint16_t arg(uint8_t bytes)
-    {
-        uint16_t argAddr = _nextAddr;
-        _nextAddr += bytes;
-        return _boss9->emulator().getArg(argAddr, bytes);
-    }
-
-    void initialize()
-    {
-        _nextAddr = 0;
-        _initialAddr = _nextAddr;
-    }
+  private:
+    const BOSS9Base& _boss9;
+};
 
-    void initialize(uint16_t lastArgOffset, fmt::Type lastArgType)
+// Formatted output to a buffer of size bytes in the emulator's memory.
+// It's cut off to leave room for the null
+class GuestBufferSink : public FormatSink
+{
+  public:
+    GuestBufferSink(Emulator& emu, uint16_t buf, uint16_t size)
+        : _emu(emu)
+        , _buf(buf)
+        , _size(size)
+    { }
+    
+    virtual void write(const char* buf, uint16_t size) override
     {
-        // All vararg params are 2 bytes
-        _nextAddr = lastArgOffset + 2;
-        _initialAddr = _nextAddr;
+        for (uint16_t i = 0; i < size && uint32_t(_index) + 1 < _size; ++i) {
+            _emu.store8(_buf + _index++, buf[i]);
+        }
     }
     
-    void reset() { _nextAddr = _initialAddr; }
-    
-    void putChar(uint16_t addr, uint8_t c) { _boss9->emulator().store8(addr, c); }
-    
-    uint16_t getAbs(uint16_t addr, uint8_t size)
+    void end()
     {
-        if (size == 1) {
-            return _boss9->emulator().load8(addr);
+        if (_size) {
+            _emu.store8(_buf + _index, '\0');
         }
-        return _boss9->emulator().load16(addr);
     }
     
-    BOSS9Base* boss9() const { return _boss9; }
-    
   private:
-    uint16_t _nextAddr = 0;
-    uint16_t _initialAddr = 0;
-    BOSS9Base* _boss9 = nullptr;
+    Emulator& _emu;
+    uint16_t _buf;
+    uint16_t _size;
+    uint16_t _index = 0;
 };
-class InterpPrintArgs : public fmt::FormatterArgs
-{
-  public:
-    InterpPrintArgs(uint16_t fmt, VarArg& args)
-        : _fmt(fmt)
-        , _args(&args)
-    { }
-        
-    virtual ~InterpPrintArgs() { }
-    virtual uint8_t getChar(uint32_t i) const override { return getStringChar(uintptr_t(_fmt + i)); }
-    virtual void putChar(uint8_t c) override { _args->boss9()->putc(c); }
-    virtual intptr_t getArg(fmt::Type type) override
-    {
-        // varargs are always the same size
-        uint16_t v = _args->arg(2);
-        return (type == fmt::Type::i) ? int16_t(v) : v;
-    }
 
-    // The interpreter keeps strings in ROM. The p pointer is actually an offset in the rom
-    virtual uint8_t getStringChar(uintptr_t p) const override
+struct BOSS9Base::SysCallTable
+{
+    constexpr SysCallTable()
     {
-        return _args->boss9()->emulator().load8(p);
+        set(Func::putc, &BOSS9Base::sysPutc);
+        set(Func::puts, &BOSS9Base::sysPuts);
+        set(Func::getc, &BOSS9Base::sysGetc);
+        set(Func::peekc, &BOSS9Base::sysPeekc);
+        set(Func::exit, &BOSS9Base::sysExit);
+        set(Func::mon, &BOSS9Base::sysMon);
+        set(Func::ldStart, &BOSS9Base::sysLdStart);
+        set(Func::ldLine, &BOSS9Base::sysLdLine);
+        set(Func::ldEnd, &BOSS9Base::sysLdEnd);
+        set(Func::printf, &BOSS9Base::sysPrintf);
+        set(Func::format, &BOSS9Base::sysFormat);
+        set(Func::switch1, &BOSS9Base::sysSwitch<1>);
+        set(Func::switch2, &BOSS9Base::sysSwitch<2>);
+        set(Func::idiv8, &BOSS9Base::sysDiv<Func::idiv8, int8_t, false>);
+        set(Func::idiv16, &BOSS9Base::sysDiv<Func::idiv16, int16_t, false>);
+        set(Func::udiv8, &BOSS9Base::sysDiv<Func::udiv8, uint8_t, false>);
+        set(Func::udiv16, &BOSS9Base::sysDiv<Func::udiv16, uint16_t, false>);
+        set(Func::imod8, &BOSS9Base::sysDiv<Func::imod8, int8_t, true>);
+        set(Func::imod16, &BOSS9Base::sysDiv<Func::imod16, int16_t, true>);
+        set(Func::umod8, &BOSS9Base::sysDiv<Func::umod8, uint8_t, true>);
+        set(Func::umod16, &BOSS9Base::sysDiv<Func::umod16, uint16_t, true>);
+        set(Func::imul16, &BOSS9Base::sysMul16<Func::imul16, int16_t>);
+        set(Func::umul16, &BOSS9Base::sysMul16<Func::umul16, uint16_t>);
+        set(Func::idiv32, &BOSS9Base::sysDiv32<Func::idiv32, int16_t>);
+        set(Func::udiv32, &BOSS9Base::sysDiv32<Func::udiv32, uint16_t>);
+        set(Func::add32, &BOSS9Base::sysArith32<Func::add32>);
+        set(Func::sub32, &BOSS9Base::sysArith32<Func::sub32>);
+        set(Func::cmp32, &BOSS9Base::sysArith32<Func::cmp32>);
+        set(Func::lsl32, &BOSS9Base::sysShift32<Func::lsl32>);
+        set(Func::lsr32, &BOSS9Base::sysShift32<Func::lsr32>);
+        set(Func::asr32, &BOSS9Base::sysShift32<Func::asr32>);
     }
     
-    VarArg* args() { return _args; }
+    constexpr void set(Func func, SysCall call) { calls[(uint16_t(func) - SystemAddrStart) / 2] = call; }
+    
+    // Calls not in the table are nullptr
+    SysCall calls[NumSysCalls] = { };
+};
 
-  private:
-    uint16_t _fmt;
-    VarArg* _args;
+// Built at compile time, so it's in ROM on the Arduino
+const BOSS9Base::SysCallTable BOSS9Base::_sysCalls;
+
+// Cycles for each math helper, in Func order. These are about what a
+// plain 6809 routine takes: a shift and subtract loop for the divides,
+// 4 MULs for the multiplies and a byte at a time for the 32 bit ops.
+// Shifts are per bit.
+static constexpr uint16_t DefaultMathCycles[NumMathFuncs] = {
+    130, 300, 120, 280,     // idiv8, idiv16, udiv8, udiv16
+    130, 300, 120, 280,     // imod8, imod16, umod8, umod16
+    110, 90,                // imul16, umul16
+    600, 560,               // idiv32, udiv32
+    40, 40, 40,             // add32, sub32, cmp32
+    30, 30, 30,             // lsl32, lsr32, asr32
 };
 
-class InterpFormatArgs : public InterpPrintArgs
+BOSS9Base::BOSS9Base(uint8_t* ram, uint32_t size)
+    : _emu(ram, size, this)
 {
-  public:
-    InterpFormatArgs(uint16_t s, uint16_t n, uint16_t fmt, VarArg& args)
-        : InterpPrintArgs(fmt, args)
-        , _buf(s)
-        , _size(n)
-        , _index(0)
-    { }
-        
-    virtual ~InterpFormatArgs() { }
+    memcpy(_mathCycles, DefaultMathCycles, sizeof(_mathCycles));
+}
 
-    virtual void putChar(uint8_t c) override
-    {
-        if (_index < _size - 1) {
-            args()->putChar(_buf + _index++, c);
+bool BOSS9Base::setMathCycles(Func func, uint16_t cycles)
+{
+    uint16_t i = (uint16_t(func) - uint16_t(Func::idiv8)) / 2;
+    if (uint16_t(func) < uint16_t(Func::idiv8) || i >= NumMathFuncs) {
+        return false;
+    }
+    _mathCycles[i] = cycles;
+    return true;
+}
+
+uint16_t BOSS9Base::mathCycles(Func func) const
+{
+    uint16_t i = (uint16_t(func) - uint16_t(Func::idiv8)) / 2;
+    return (uint16_t(func) < uint16_t(Func::idiv8) || i >= NumMathFuncs) ? 0 : _mathCycles[i];
+}
+
+bool BOSS9Base::call(Func func)
+{
+    uint16_t addr = uint16_t(func);
+    SysCall handler = (addr & 1) ? nullptr : _sysCalls.calls[(addr - SystemAddrStart) / 2];
+    if (!handler) {
+        printF("\n*** unknown system call at addr $%04x\n\n", addr);
+        enterMonitor();
+        return false;
+    }
+    return (this->*handler)();
+}
+
+bool BOSS9Base::sysPutc()
+{
+    output(emulator().getReg(Reg::A));
+    return true;
+}
+
+bool BOSS9Base::sysPuts()
+{
+    puts(reinterpret_cast<const char*>(emulator().getAddr(emulator().getReg(Reg::X))));
+    return true;
+}
+
+bool BOSS9Base::sysGetc()
+{
+    emulator().setReg(Reg::A, programInput(false));
+    return true;
+}
+
+bool BOSS9Base::sysPeekc()
+{
+    emulator().setReg(Reg::A, programInput(true));
+    return true;
+}
+
+bool BOSS9Base::sysExit()
+{
+    _exited = true;
+    _exitCode = int32_t(emulator().getReg(Reg::A));
+    
+    // If we're running a timing test, show the time
+    if (_startTime > 0) {
+        float t = getClock() - _startTime;
+        const char* units;
+        if (t >= 1) {
+            units = "s";
+        } else if (t >= 0.001) {
+            t *= 1000;
+            units = "ms";
+        } else {
+            t *= 1000000;
+            units = "us";
         }
+            
+        printF("Finished timing test. Test took %.2f%s to run\n", t, units);
+        _startTime = 0;
+    } else {
+        printF("Program exited with code %d\n", _exitCode);
     }
+    flushOutput();
+    enterMonitor();
+    emulator().setReg(Reg::PC, _startAddr);
+    return false;
+}
 
-    virtual void end() override { putChar('\0'); }
+bool BOSS9Base::sysMon()
+{
+    enterMonitor();
+    return false;
+}
 
-  private:
-    uint16_t _buf;
-    uint16_t _size;
-    uint16_t _index;
-};
+bool BOSS9Base::sysLdStart()
+{
+    emulator().loadStart();
+    return true;
+}
+
+bool BOSS9Base::sysLdLine()
+{
+    // X has pointer to data.
+    // Return bool success in A, bool finished in B
+    const char* s = reinterpret_cast<const char*>(emulator().getAddr(emulator().getReg(Reg::X)));
+    bool finished;
+    bool result = emulator().loadLine(s, finished);
+    emulator().setReg(Reg::A, result);
+    emulator().setReg(Reg::B, finished);
+    return true;
+}
 
-static inline int32_t
-printf(uint16_t fmt, VarArg& args)
+bool BOSS9Base::sysLdEnd()
 {
-    InterpPrintArgs f(fmt, args);
-    return fmt::doprintf(&f);
+    emulator().loadEnd();
+    return true;
 }
 
-static inline int32_t
-format(uint16_t s, uint16_t n, uint16_t fmt, VarArg& args)
+// TOS: fmt, varargs
+bool BOSS9Base::sysPrintf()
 {
-    InterpFormatArgs f(s, n, fmt, args);
-    return fmt::doprintf(&f);
+    ConsoleSink sink(*this);
+    Formatter(sink).format(emulator(), emulator().getArg(0, 2), emulator().getReg(Reg::S) + 2);
+    return true;
 }
 
-bool BOSS9Base::call(Func func)
+// TOS: buf, size, fmt, varargs
+bool BOSS9Base::sysFormat()
 {
-    switch (func) {
-        case Func::putc:
-            putc(emulator().getReg(Reg::A));
-            break;
-        case Func::puts: {
-            const char* s = reinterpret_cast<const char*>(emulator().getAddr(emulator().getReg(Reg::X)));
-            puts(s);
-            break;
+    GuestBufferSink sink(emulator(), emulator().getArg(0, 2), emulator().getArg(2, 2));
+    Formatter(sink).format(emulator(), emulator().getArg(4, 2), emulator().getReg(Reg::S) + 6);
+    sink.end();
+    return true;
+}
+
+// TOS: N, table, value. Each entry is a value of the given size followed
+// by an addr. Entries are sorted by signed value.
+template<uint8_t bytes>
+bool BOSS9Base::sysSwitch()
+{
+    static constexpr uint8_t EntrySize = bytes + 2;
+    
+    Emulator& emu = emulator();
+    uint16_t n = emu.getArg(0, 2);
+    uint16_t table = emu.getArg(2, 2);
+    uint16_t v = emu.getArg(4, bytes);
+    int16_t value = (bytes == 1) ? int8_t(v) : int16_t(v);
+    
+    uint16_t lo = 0;
+    uint16_t hi = n;
+    while (lo < hi) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        uint16_t entry = table + mid * EntrySize;
+        uint16_t e = (bytes == 1) ? emu.load8(entry) : emu.load16(entry);
+        int16_t entryValue = (bytes == 1) ? int8_t(e) : int16_t(e);
+        if (entryValue == value) {
+            emu.setReg(Reg::X, emu.load16(entry + bytes));
+            return true;
         }
-        case Func::getc: {
-            emulator().setReg(Reg::A, getc());
-            break;
+        if (entryValue < value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        case Func::exit: {
-            // If we're running a timing test, show the time
-            if (_startTime > 0) {
-                float t = getClock() - _startTime;
-                const char* units;
-                if (t >= 1) {
-                    units = "s";
-                } else if (t >= 0.001) {
-                    t *= 1000;
-                    units = "ms";
-                } else {
-                    t *= 1000000;
-                    units = "us";
-                }
-                    
-                printF("Finished timing test. Test took %.2f%s to run\n", t, units);
-                _startTime = 0;
-            } else {
-                printF("Program exited with code %d\n", int32_t(emulator().getReg(Reg::A)));
-            }
-            enterMonitor();
-            emulator().setReg(Reg::PC, _startAddr);
-            return false;
+    }
+    
+    // Not found, the default follows the table
+    emu.setReg(Reg::X, table + n * EntrySize);
+    return true;
+}
+
+void BOSS9Base::chargeMath(Func func, uint32_t count)
+{
+    emulator().addCycles(_mathCycles[(uint16_t(func) - uint16_t(Func::idiv8)) / 2] * count);
+}
+
+void BOSS9Base::setFlags(bool n, bool z, bool v, bool c)
+{
+    uint8_t cc = emulator().getReg(Reg::CC) & 0xf0;
+    emulator().setReg(Reg::CC, cc | (n << 3) | (z << 2) | (v << 1) | c);
+}
+
+uint32_t BOSS9Base::load32(uint16_t addr)
+{
+    return (uint32_t(emulator().load16(addr)) << 16) | emulator().load16(addr + 2);
+}
+
+void BOSS9Base::store32(uint16_t addr, uint32_t v)
+{
+    emulator().store16(addr, uint16_t(v >> 16));
+    emulator().store16(addr + 2, uint16_t(v));
+}
+
+// TOS: dividend, divisor. Return quotient or remainder in A or D
+template<Func func, typename T, bool remainder>
+bool BOSS9Base::sysDiv()
+{
+    static constexpr uint8_t bytes = sizeof(T);
+    chargeMath(func);
+    
+    T dividend = T(emulator().getArg(0, bytes));
+    T divisor = T(emulator().getArg(bytes, bytes));
+    T result = 0;
+    if (divisor != 0) {
+        result = remainder ? T(dividend % divisor) : T(dividend / divisor);
+    }
+    emulator().setReg((bytes == 1) ? Reg::A : Reg::D, uint16_t(result));
+    // N is the top bit of the result, so it's also set for unsigned results
+    setFlags(result & (T(1) << (bytes * 8 - 1)), result == 0, false, divisor == 0);
+    return true;
+}
+
+// TOS: a, b. Return the 32 bit product in D and X
+template<Func func, typename T>
+bool BOSS9Base::sysMul16()
+{
+    using Wide = std::conditional_t<std::is_signed_v<T>, int32_t, uint32_t>;
+    chargeMath(func);
+    
+    T a = T(emulator().getArg(0, 2));
+    T b = T(emulator().getArg(2, 2));
+    uint32_t product = uint32_t(Wide(a) * Wide(b));
+    emulator().setReg(Reg::D, uint16_t(product >> 16));
+    emulator().setReg(Reg::X, uint16_t(product));
+    setFlags(product & 0x80000000, product == 0, false, false);
+    return true;
+}
+
+// TOS: pointer to the 32 bit dividend, divisor. The quotient replaces the
+// dividend and the remainder is returned in D. The math is done in 64
+// bits so the most negative dividend divided by -1 is defined.
+template<Func func, typename T>
+bool BOSS9Base::sysDiv32()
+{
+    using Wide = std::conditional_t<std::is_signed_v<T>, int64_t, uint64_t>;
+    chargeMath(func);
+    
+    uint16_t addr = emulator().getArg(0, 2);
+    T divisor = T(emulator().getArg(2, 2));
+    uint32_t v = load32(addr);
+    Wide dividend = std::is_signed_v<T> ? Wide(int32_t(v)) : Wide(v);
+    
+    uint32_t quotient = 0;
+    uint16_t rem = 0;
+    if (divisor != 0) {
+        quotient = uint32_t(dividend / Wide(divisor));
+        rem = uint16_t(dividend % Wide(divisor));
+    }
+    store32(addr, quotient);
+    emulator().setReg(Reg::D, rem);
+    setFlags(quotient & 0x80000000, quotient == 0, false, divisor == 0);
+    return true;
+}
+
+// TOS: pointer to a, pointer to b. Flags are what a 32 bit ADD, SUB or
+// CMP would set
+template<Func func>
+bool BOSS9Base::sysArith32()
+{
+    chargeMath(func);
+    
+    uint16_t addr = emulator().getArg(0, 2);
+    uint32_t a = load32(addr);
+    uint32_t b = load32(emulator().getArg(2, 2));
+    uint32_t r;
+    bool v, c;
+    if constexpr (func == Func::add32) {
+        r = a + b;
+        v = ((a ^ r) & (b ^ r)) >> 31;
+        c = r < a;
+    } else {
+        r = a - b;
+        v = ((a ^ b) & (a ^ r)) >> 31;
+        c = a < b;
+    }
+    if constexpr (func != Func::cmp32) {
+        store32(addr, r);
+    }
+    setFlags(r & 0x80000000, r == 0, v, c);
+    return true;
+}
+
+// TOS: pointer to a, count. Shift a bit at a time, like the 6809 would,
+// so C is the last bit shifted out. It's left alone if count is 0. V is
+// N ^ C after LSL and left alone after LSR and ASR.
+template<Func func>
+bool BOSS9Base::sysShift32()
+{
+    uint16_t addr = emulator().getArg(0, 2);
+    uint8_t count = uint8_t(emulator().getArg(2, 1));
+    chargeMath(func, count);
+    
+    uint32_t a = load32(addr);
+    uint8_t cc = emulator().getReg(Reg::CC);
+    bool c = cc & 0x01;
+    bool v = cc & 0x02;
+    for (uint8_t i = 0; i < count; ++i) {
+        if constexpr (func == Func::lsl32) {
+            c = a & 0x80000000;
+            a <<= 1;
+        } else {
+            c = a & 0x01;
+            a = (func == Func::asr32) ? ((a >> 1) | (a & 0x80000000)) : (a >> 1);
         }
-        case Func::mon:
-            enterMonitor();
-            return false;
-        case Func::ldStart:
-            emulator().loadStart();
-            break;
-        case Func::ldLine: {
-            // X has pointer to data.
-            // Return bool success in A, bool finished in B
-            const char* s = reinterpret_cast<const char*>(emulator().getAddr(emulator().getReg(Reg::X)));
-            bool finished;
-            bool result = emulator().loadLine(s, finished);
-            emulator().setReg(Reg::A, result);
-            emulator().setReg(Reg::B, finished);
-            break;
+    }
+    if constexpr (func == Func::lsl32) {
+        v = count ? (bool(a & 0x80000000) != c) : v;
+    }
+    store32(addr, a);
+    setFlags(a & 0x80000000, a == 0, v, c);
+    return true;
+}
+
+void BOSS9Base::output(const char* buf, uint32_t size) const
+{
+    while (size) {
+        uint32_t n = std::min<uint32_t>(size, OutputBufferSize - _outputSize);
+        memcpy(_outputBuffer + _outputSize, buf, n);
+        _outputSize += n;
+        buf += n;
+        size -= n;
+        if (_outputSize == OutputBufferSize) {
+            flushOutput();
         }
-        case Func::ldEnd:
-            emulator().loadEnd();
-            break;
-        case Func::printf: {
-            VarArg va(this, 0, fmt::Type::str);
-            uint16_t fmt = emulator().getArg(0, 2);
-            printf(fmt, va);
-            break;
+    }
+}
+
+void BOSS9Base::vprintF(const char* fmt, va_list args) const
+{
+    ConsoleSink sink(*this);
+    Formatter(sink).vformat(fmt, args);
+}
+
+void BOSS9Base::flushOutput() const
+{
+    if (_outputRate == 0) {
+        if (_outputSize) {
+            write(_outputBuffer, _outputSize);
+            _outputSize = 0;
         }
-        case Func::format: {
-            VarArg va(this, 4, fmt::Type::str);
-            uint16_t s = emulator().getArg(0, 2);
-            uint16_t n = emulator().getArg(2, 2);
-            uint16_t fmt = emulator().getArg(4, 2);
-            format(s, n, fmt, va);
-            break;
+        return;
+    }
+    
+    // Send 10ms worth at a time, each after the one before it has had
+    // time to go out. Nothing sent takes longer than a full buffer, so a
+    // longer wait means _outputDone is from before the clock wrapped
+    uint32_t chunk = std::max<uint32_t>(1, _outputRate / 100);
+    for (uint16_t i = 0; i < _outputSize; ) {
+        uint16_t size = uint16_t(std::min<uint32_t>(chunk, _outputSize - i));
+        uint32_t now = getMicros();
+        int32_t wait = int32_t(_outputDone - now);
+        if (wait > 0 && uint64_t(wait) <= uint64_t(OutputBufferSize) * 1000000 / _outputRate) {
+            waitUntil(_outputDone);
+        } else {
+            _outputDone = now;
         }
-        case Func::switch1:
-        case Func::switch2:
-            emulator().setReg(Reg::X, 0xFC0E); // This is exit for now
-            break;
-        case Func::idiv8 :
-        case Func::idiv16:
-        case Func::udiv8 :
-        case Func::udiv16: {
-            // TOS: dividend, divisor. Return quotient on A/D
-            bool is16Bit = func == Func::idiv16 || func == Func::udiv16;
-            uint8_t bytes = is16Bit ? 2 : 1;
-            
-            uint16_t dividend = emulator().getArg(0, bytes);
-            uint16_t divisor = emulator().getArg(bytes, bytes);
-            
-            uint16_t quotient = 0;
-            switch (func) {
-                default: break;
-                case Func::idiv8 : quotient = uint16_t(int8_t(dividend) / int8_t(divisor)); break;
-                case Func::idiv16: quotient = uint16_t(int16_t(dividend) / int16_t(divisor)); break;
-                case Func::udiv8 : quotient = uint16_t(uint8_t(dividend) / uint8_t(divisor)); break;
-                case Func::udiv16: quotient = uint16_t(uint16_t(dividend) / uint16_t(divisor)); break;
-            }
-            emulator().setReg(is16Bit ? Reg::D : Reg::A, quotient);
-            break;
+        write(_outputBuffer + i, size);
+        _outputDone += uint32_t(uint64_t(size) * 1000000 / _outputRate);
+        i += size;
+    }
+    _outputSize = 0;
+}
+
+uint8_t BOSS9Base::programInput(bool peek)
+{
+#ifdef INPUT_LOG
+    if (_inputLog && _inputLog->replaying()) {
+        return _inputLog->next(emulator().cycles(), peek);
+    }
+#endif
+
+    uint8_t value;
+    if (peek) {
+        // Keep the char for the next getc
+        if (_pendingChar == 0) {
+            int c = pollInput();
+            _pendingChar = (c > 0) ? c : 0;
         }
-        default: return false;
+        value = _pendingChar != 0;
+    } else {
+        value = uint8_t(nextChar());
     }
-    return true;
+
+#ifdef INPUT_LOG
+    if (_inputLog) {
+        _inputLog->add(emulator().cycles(), peek, value);
+    }
+#endif
+    return value;
 }
 
 static Reg regsToPrint[ ] = { Reg::A, Reg::B, Reg::D, Reg::X, Reg::Y,
@@ -277,7 +572,7 @@ void BOSS9Base::getCommand()
     promptIfNeeded();
     
     while (true) {
-        int c = getc();
+        int c = nextChar();
         if (c <= 0) {
             break;
         }
@@ -301,8 +596,8 @@ void BOSS9Base::getCommand()
         if (c == 0x08 || c == 0x7f) {
             // backspace
             if (_echoBS) {
-                putc(' ');
-                putc(0x08);
+                output(' ');
+                output(0x08);
             }
             if (_cursor != 0) {
                 _cursor -= 1;
@@ -427,12 +722,62 @@ bool BOSS9Base::toNum(m8r::string& s, uint32_t& num)
     return true;
 }
 
-void BOSS9Base::showBreakpoint(uint8_t i) const
+bool BOSS9Base::toReg(m8r::string s, Reg& reg)
+{
+    m8r::string testRegStr = s.tolower();
+    for (Reg it : regsToPrint) {
+        if (testRegStr == m8r::string(DisplayInst::regToString(it)).tolower()) {
+            reg = it;
+            return true;
+        }
+    }
+    printF("%s is not a valid register\n", s.c_str());
+    return false;
+}
+
+void BOSS9Base::showBreakpoint(uint16_t i) const
 {
     BreakpointEntry entry;
-    if (emulator().breakpoint(i, entry)) {
-        printF("    Breakpoint[%d] -> $%04x (%sabled)\n", i, entry.addr, (entry.status == BPStatus::Enabled) ? "en" : "dis");
+    if (!emulator().breakpoint(i, entry)) {
+        return;
     }
+    
+    const char* type = "Breakpoint";
+    switch (entry.type) {
+        case BPType::Exec: break;
+        case BPType::Read: type = "Read watchpoint"; break;
+        case BPType::Write: type = "Write watchpoint"; break;
+        case BPType::Access: type = "Watchpoint"; break;
+    }
+    printF("    %s[%d] -> $%04x (%sabled)", type, i, entry.addr, (entry.status == BPStatus::Enabled) ? "en" : "dis");
+    if (entry.condReg != Reg::None) {
+        printF(" if %s=$%x", DisplayInst::regToString(entry.condReg), entry.condValue);
+    }
+    if (entry.hitCount) {
+        printF(" after %d hits (%d so far)", entry.hitCount, entry.hits);
+    }
+    printF("\n");
+}
+
+bool BOSS9Base::setBreakpoint(m8r::string& addrStr, BPType type)
+{
+    uint32_t addr;
+    if (!toNum(addrStr, addr)) {
+        return false;
+    }
+    
+    if (addr > 65535) {
+        return false;
+    }
+
+    uint16_t breakpointNum;
+    if (!emulator().setBreakpoint(addr, breakpointNum, type)) {
+        printF("can't set breakpoint\n");
+        return false;
+    }
+    
+    showBreakpoint(breakpointNum);
+    return true;
 }
 
 bool BOSS9Base::executeCommand(m8r::string cmdElements[3])
@@ -456,6 +801,13 @@ bool BOSS9Base::executeCommand(m8r::string cmdElements[3])
             printF("\tbe n    - enable brkpt <n>\n");
             printF("\tbd      - disable all brkpts\n");
             printF("\tbd n    - disable brkpt <n>\n");
+            printF("\tbh n c  - stop on hit <c> of brkpt <n>\n");
+            printF("\tbh n    - remove hit count from brkpt <n>\n");
+            printF("\tbi n r=v- stop brkpt <n> only if reg r is v\n");
+            printF("\tbi n    - remove condition from brkpt <n>\n");
+            printF("\tww a    - set watchpt on writes to addr a\n");
+            printF("\twr a    - set watchpt on reads of addr a\n");
+            printF("\twa a    - set watchpt on reads or writes\n");
             printF("\tn       - next, if at func step over\n");
             printF("\ts       - step, if at func step in\n");
             printF("\to       - step out of cur func\n");
@@ -469,7 +821,20 @@ bool BOSS9Base::executeCommand(m8r::string cmdElements[3])
             printF("\treg r   - show reg r\n");
             printF("\treg r v - set reg r to v\n");
             printF("\tcycles  - show cycles since start of run\n");
+#ifdef SNAPSHOTS
+            printF("\tss      - save snapshot of machine\n");
+            printF("\tsr      - restore saved snapshot\n");
+            printF("\trec     - record history for stepping back\n");
+            printF("\trec off - stop recording history\n");
+            printF("\tsb      - step back 1 inst\n");
+            printF("\tsb n    - step back n insts\n");
+            printF("\trc      - continue back to prev brkpt\n");
+            printF("\tlw a    - show last write to addr a\n");
+            printF("\tlw a n  - show last n writes to addr a\n");
+#endif
             printF("\ttime    - run program and report time taken\n");
+            printF("\tclk     - show clock rate\n");
+            printF("\tclk k   - run at k kHz, 0 for full speed\n");
 
             return true;
         }
@@ -536,12 +901,9 @@ bool BOSS9Base::executeCommand(m8r::string cmdElements[3])
             // Show breakpoints
             bool haveBreakpoints = false;
         
-            for (auto i = 0; i < NumBreakpoints; ++i) {
-                BreakpointEntry entry;
-                if (emulator().breakpoint(i, entry)) {
-                    showBreakpoint(i);
-                    haveBreakpoints = true;
-                }
+            for (uint16_t i = 0; i < emulator().numBreakpoints(); ++i) {
+                showBreakpoint(i);
+                haveBreakpoints = true;
             }
             if (!haveBreakpoints) {
                 printF("    No breakpoints\n");
@@ -550,18 +912,63 @@ bool BOSS9Base::executeCommand(m8r::string cmdElements[3])
         }
         
         // Set breakpoint
+        return setBreakpoint(cmdElements[1], BPType::Exec);
+    }
+    
+    // Set watchpoint
+    if (cmdElements[0] == "ww" || cmdElements[0] == "wr" || cmdElements[0] == "wa") {
+        if (cmdElements[1].empty() || !cmdElements[2].empty()) {
+            return false;
+        }
+        
+        BPType type = (cmdElements[0] == "ww") ? BPType::Write : ((cmdElements[0] == "wr") ? BPType::Read : BPType::Access);
+        return setBreakpoint(cmdElements[1], type);
+    }
+    
+    // Set hit count
+    if (cmdElements[0] == "bh") {
         uint32_t num;
+        uint32_t count = 0;
         if (!toNum(cmdElements[1], num)) {
             return false;
         }
+        if (!cmdElements[2].empty() && !toNum(cmdElements[2], count)) {
+            return false;
+        }
         
-        uint8_t breakpointNum;
-        if (!emulator().setBreakpoint(num, breakpointNum)) {
-            printF("too many breakpoints\n");
+        if (!emulator().setBreakpointHitCount(num, count)) {
+            printF("invalid breakpoint index\n");
+            return false;
+        }
+        showBreakpoint(num);
+        return true;
+    }
+    
+    // Set or remove condition
+    if (cmdElements[0] == "bi") {
+        uint32_t num;
+        if (!toNum(cmdElements[1], num)) {
             return false;
         }
         
-        showBreakpoint(breakpointNum);
+        Reg reg = Reg::None;
+        uint32_t value = 0;
+        if (!cmdElements[2].empty()) {
+            m8r::vector<m8r::string> cond = cmdElements[2].split("=");
+            if (cond.size() != 2) {
+                printF("condition must be r=v\n");
+                return false;
+            }
+            if (!toReg(cond[0], reg) || !toNum(cond[1], value)) {
+                return false;
+            }
+        }
+        
+        if (!emulator().setBreakpointCondition(num, reg, value)) {
+            printF("invalid breakpoint index\n");
+            return false;
+        }
+        showBreakpoint(num);
         return true;
     }
     
@@ -782,6 +1189,98 @@ bool BOSS9Base::executeCommand(m8r::string cmdElements[3])
         return true;
     }
 
+#ifdef SNAPSHOTS
+    // save or restore snapshot
+    if (cmdElements[0] == "ss") {
+        emulator().takeSnapshot(_snapshot);
+        printF("Snapshot taken at addr $%04x, %d cycles\n", emulator().getReg(Reg::PC), emulator().cycles());
+        return true;
+    }
+    
+    if (cmdElements[0] == "sr") {
+        if (!emulator().restoreSnapshot(_snapshot)) {
+            printF("no snapshot\n");
+            return false;
+        }
+        printF("Snapshot restored at addr $%04x, %d cycles\n", emulator().getReg(Reg::PC), emulator().cycles());
+        return true;
+    }
+    
+    // record execution history
+    if (cmdElements[0] == "rec") {
+        if (cmdElements[1] == "off") {
+            emulator().stopHistory();
+            printF("Stopped recording\n");
+            return true;
+        }
+        if (!cmdElements[1].empty()) {
+            return false;
+        }
+        emulator().startHistory();
+        printF("Recording execution history\n");
+        return true;
+    }
+    
+    // step back
+    if (cmdElements[0] == "sb") {
+        uint32_t count = 1;
+        if (!cmdElements[1].empty() && !toNum(cmdElements[1], count)) {
+            return false;
+        }
+        if (!emulator().recordingHistory()) {
+            printF("not recording, use rec\n");
+            return false;
+        }
+        uint64_t steps = emulator().stepBack(count);
+        if (steps < count) {
+            printF("*** reached start of history after %d instructions\n", uint32_t(steps));
+        }
+        return true;
+    }
+    
+    // reverse continue
+    if (cmdElements[0] == "rc") {
+        if (!emulator().recordingHistory()) {
+            printF("not recording, use rec\n");
+            return false;
+        }
+        if (emulator().reverseContinue()) {
+            printF("\n*** hit breakpoint at addr $%04x going back\n\n", emulator().getReg(Reg::PC));
+        } else {
+            printF("*** reached start of history\n");
+        }
+        return true;
+    }
+    
+    // last writes to addr
+    if (cmdElements[0] == "lw") {
+        uint32_t addr;
+        uint32_t count = 1;
+        if (!toNum(cmdElements[1], addr)) {
+            return false;
+        }
+        if (!cmdElements[2].empty() && !toNum(cmdElements[2], count)) {
+            return false;
+        }
+        
+        WriteInfo info;
+        uint32_t i = 0;
+        for ( ; i < count; ++i) {
+            if (!emulator().lastWrite(addr, info)) {
+                break;
+            }
+            m8r::string s;
+            DisplayInst::instToString(emulator(), s, info.pc);
+            printF("    $%02x -> $%02x, %d insts ago at cycle %d by %s", info.oldValue, info.newValue,
+                   uint32_t(info.instsAgo), info.cycles, s.c_str());
+        }
+        if (i == 0) {
+            printF("no writes to $%04x in history\n", addr);
+        }
+        return true;
+    }
+#endif
+
     // show cycles
     if(cmdElements[0] == "cycles") {
         uint32_t cycles = emulator().cycles();
@@ -789,6 +1288,23 @@ bool BOSS9Base::executeCommand(m8r::string cmdElements[3])
         return true;
     }
     
+    // clock rate
+    if(cmdElements[0] == "clk") {
+        if (!cmdElements[1].empty()) {
+            uint32_t khz;
+            if (!toNum(cmdElements[1], khz)) {
+                return false;
+            }
+            setClockRate(khz * 1000);
+        }
+        if (_clockRate) {
+            printF("Running at %d kHz\n", _clockRate / 1000);
+        } else {
+            printF("Running at full speed\n");
+        }
+        return true;
+    }
+    
     // run timing test
     if(cmdElements[0] == "time") {
         _startTime = getClock();
@@ -816,6 +1332,7 @@ bool BOSS9Base::startExecution(uint16_t addr, bool startInMonitor)
     }
     emulator().setReg(Reg::PC, addr);
     _startAddr = addr;
+    _exited = false;
     
     promptIfNeeded();
     return true;
@@ -828,11 +1345,20 @@ bool BOSS9Base::continueExecution()
         return true;
     }
     
-    // See if we got an ESC
-    int c = getc();
-    if (checkEscape(c)) {
-        printF("*** Stopped at $%04x\n", emulator().getReg(Reg::PC));
-        return true;
+    // Send what the last slice wrote
+    flushOutput();
+    
+    // See if we got an ESC. Any other char is kept for the program. If it
+    // hasn't read the last one yet leave the rest waiting
+    if (_pendingChar == 0) {
+        int c = getc();
+        if (checkEscape(c)) {
+            printF("*** Stopped at $%04x\n", emulator().getReg(Reg::PC));
+            return true;
+        }
+        if (c > 0) {
+            _pendingChar = c;
+        }
     }
     
     // At this point the RunState is anything but Cmd. if its Running
@@ -844,9 +1370,97 @@ bool BOSS9Base::continueExecution()
     // to change the state to Running after execute() so we run normally
     // the next time through. The other states are for stepping through
     // the code which execute() will deal with.
+    //
+    // When paced, wait for the wall clock to catch up and then run
+    // 1/PaceSlicesPerSecond of emulated time, or up to the continueUntil
+    // deadline if that comes first.
+    bool paced = _clockRate && _runState == RunState::Running && emulator().policy() != Policy::Throughput;
+    bool hadDeadline = emulator().haveCycleDeadline();
+    uint32_t deadline = emulator().cycleDeadline();
+    if (paced) {
+        pace();
+        uint32_t sliceEnd = emulator().cycles() + _clockRate / PaceSlicesPerSecond;
+        if (!hadDeadline || int32_t(sliceEnd - deadline) < 0) {
+            emulator().setCycleDeadline(sliceEnd);
+        }
+    }
+    
+    uint32_t start = _sliceTime ? getMicros() : 0;
     bool retval = emulator().execute(_runState);
     if (_runState == RunState::Continuing) {
         _runState = RunState::Running;
     }
+    
+    // Slices which ended early say nothing about the speed
+    if (_sliceTime && retval && _runState == RunState::Running &&
+            !emulator().waitingForInterrupt() && !emulator().deadlineReached()) {
+        adaptSlice(getMicros() - start);
+    }
+    
+    if (paced) {
+        if (hadDeadline) {
+            emulator().setCycleDeadline(deadline);
+        } else {
+            emulator().clearCycleDeadline();
+        }
+    }
     return retval;
 }
+
+bool BOSS9Base::continueUntil(uint32_t cycles)
+{
+    emulator().setCycleDeadline(cycles);
+    
+    bool retval = true;
+    while (retval && !inMonitor() && !emulator().deadlineReached()) {
+        // Stop if time isn't moving, because cycles aren't being counted
+        // or we're waiting for an interrupt nothing will send
+        uint32_t start = emulator().cycles();
+        retval = continueExecution();
+        if (emulator().cycles() == start) {
+            break;
+        }
+    }
+    
+    emulator().clearCycleDeadline();
+    return retval;
+}
+
+void BOSS9Base::pace()
+{
+    uint32_t now = getMicros();
+    uint32_t cycles = emulator().cycles();
+    if (!_pacing) {
+        _paceMicros = now;
+        _paceCycles = cycles;
+        _pacing = true;
+        return;
+    }
+    
+    // Move the base along by the whole microseconds run so far. What's
+    // left over is counted next time so the clock doesn't drift
+    uint32_t us = uint32_t(uint64_t(cycles - _paceCycles) * 1000000 / _clockRate);
+    _paceMicros += us;
+    _paceCycles += uint32_t(uint64_t(us) * _clockRate / 1000000);
+    
+    int32_t ahead = int32_t(_paceMicros - now);
+    if (ahead > 0) {
+        waitUntil(_paceMicros);
+    } else if (-ahead > int32_t(MaxPaceLag)) {
+        // The host can't keep up or we were stopped in the monitor. Start
+        // again from here rather than rushing to catch up
+        _paceMicros = now;
+        _paceCycles = cycles;
+    }
+}
+
+void BOSS9Base::adaptSlice(uint32_t elapsed)
+{
+    // Scale toward the target time, but at most double or halve it each
+    // time so one slow slice (the host was busy) doesn't throw it off
+    uint64_t insts = emulator().sliceInsts();
+    uint64_t target = elapsed ? (insts * _sliceTime / elapsed) : (insts * 2);
+    target = std::min(std::max(target, insts / 2), insts * 2);
+    target = std::min<uint64_t>(std::max<uint64_t>(target, MinInstructionsPerContinue), MaxInstructionsPerContinue);
+    emulator().setSliceInsts(uint32_t(target));
+}
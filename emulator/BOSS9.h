@@ -24,8 +24,15 @@ namespace mc6809 {
 static constexpr const char* MainPromptString = "BOSS9> ";
 static constexpr const char* LoadingPromptString = "Loading> ";
 static constexpr uint16_t CmdBufSize = 100;
+static constexpr uint16_t OutputBufferSize = 256;
+static constexpr uint32_t PaceSlicesPerSecond = 1000; // A paced slice runs 1ms of emulated time
+static constexpr uint32_t MaxPaceLag = 50000; // us behind the clock before giving up on catching up
 
 class Emulator;
+class InputLog;
+
+// Each word from SystemAddrStart is a possible system call
+static constexpr uint16_t NumSysCalls = (0x10000 - SystemAddrStart) / 2;
 
 // These must match BOSS9.inc
 enum class Func : uint16_t {
@@ -56,27 +63,75 @@ enum class Func : uint16_t {
 
     switch1     = 0xFC40,   // TOS -> N, Table, Value
     switch2     = 0xFC42,   // Table is a list of N value/addr pairs
-                            //Binary search table looking for value
-                            //when found return addr in X. if not
-                            //found return Table + N * (<1/2> + 2)
-    idiv8       = 0xFC44,
-    idiv16      = 0xFC46,
+                            // sorted by signed value. Binary search table
+                            // looking for value, when found return addr
+                            // in X. If not found return Table + N * (<1/2> + 2)
+
+    // Math helpers. 32 bit values are in memory, high byte first. Divides
+    // and multiplies set N and Z for the result. Divides by 0 set C and
+    // return 0
+    idiv8       = 0xFC44,   // TOS: dividend, divisor. Return quotient in A
+    idiv16      = 0xFC46,   // TOS: dividend, divisor. Return quotient in D
     udiv8       = 0xFC48,
     udiv16      = 0xFC4a,
+    imod8       = 0xFC4c,   // TOS: dividend, divisor. Return remainder in A
+    imod16      = 0xFC4e,   // TOS: dividend, divisor. Return remainder in D
+    umod8       = 0xFC50,
+    umod16      = 0xFC52,
+    imul16      = 0xFC54,   // TOS: a, b. Return a * b, high word in D, low in X
+    umul16      = 0xFC56,
+    idiv32      = 0xFC58,   // TOS: pointer to dividend, 16 bit divisor. Quotient
+                            // replaces the dividend, return remainder in D
+    udiv32      = 0xFC5a,
+    add32       = 0xFC5c,   // TOS: pointer to a, pointer to b. a = a + b, set NZVC
+    sub32       = 0xFC5e,   // TOS: pointer to a, pointer to b. a = a - b, set NZVC
+    cmp32       = 0xFC60,   // TOS: pointer to a, pointer to b. Set NZVC for a - b
+    lsl32       = 0xFC62,   // TOS: pointer to a, 8 bit count. Shift a, set NZC
+    lsr32       = 0xFC64,
+    asr32       = 0xFC66,
 };
 
+static constexpr uint16_t NumMathFuncs = (uint16_t(Func::asr32) - uint16_t(Func::idiv8)) / 2 + 1;
+
 class BOSS9Base
 {
   public:
-    BOSS9Base(uint8_t* ram) : _emu(ram, this) { }
+    BOSS9Base(uint8_t* ram, uint32_t size);
     
     virtual ~BOSS9Base() { }
-        
+    
+    // Run a system call. It gets its args from the registers or from
+    // the stack with Emulator::getArg. Returns false if the program
+    // should stop running, because it exited or entered the monitor
     bool call(Func);
     
     bool startExecution(uint16_t addr, bool startInMonitor = false);
     bool continueExecution();
     
+    // Run until the cycle count reaches cycles, the program stops or it
+    // enters the monitor. Needs cycle counting
+    bool continueUntil(uint32_t cycles);
+    
+    // Change the slice length so the console is checked about every
+    // sliceTime microseconds. 0 keeps the emulator's slice length
+    void setSliceTime(uint32_t us) { _sliceTime = us; }
+    
+    // Run at hz emulated cycles per second of wall time. 0 runs as fast
+    // as the host allows (turbo). Needs cycle counting
+    void setClockRate(uint32_t hz)
+    {
+        _clockRate = hz;
+        _pacing = false;
+    }
+    uint32_t clockRate() const { return _clockRate; }
+    
+    // Emulated cycles a math helper takes, on top of the JSR. Shifts take
+    // this many per bit. The defaults are about what the same routine in
+    // 6809 code would take, so timing doesn't change much when code uses
+    // the helpers. Returns false if func isn't a math helper
+    bool setMathCycles(Func func, uint16_t cycles);
+    uint16_t mathCycles(Func func) const;
+    
     void enterMonitor()
     {
         _runState = RunState::Cmd;
@@ -84,29 +139,63 @@ class BOSS9Base
         _needInstPrint = true;
     }
     
+    bool inMonitor() const { return _runState == RunState::Cmd || _runState == RunState::Loading; }
+    
+    // True once the program calls exit, until it's started again
+    bool exited() const { return _exited; }
+    int32_t exitCode() const { return _exitCode; }
+    
     Emulator& emulator() { return _emu; }
     const Emulator& emulator() const { return _emu; }
     
+#ifdef INPUT_LOG
+    // Record the program's console input to the log or replay it from
+    // there. Pass nullptr to use the console
+    void setInputLog(InputLog* log) { _inputLog = log; }
+#endif
+    
     virtual void putc(char c) const = 0;
-
-    void puts(const char* s) const
+    
+    // Console output is buffered and sent with write() when the buffer
+    // fills, before the console is read, when the program exits and at
+    // the start of each run slice. Override write() to send it all at
+    // once, otherwise it goes a char at a time to putc().
+    virtual void write(const char* buf, uint32_t size) const
     {
-        while (*s) {
-            putc(*s++);
+        for (uint32_t i = 0; i < size; ++i) {
+            putc(buf[i]);
         }
     }
+    
+    void output(char c) const
+    {
+        _outputBuffer[_outputSize++] = c;
+        if (_outputSize == OutputBufferSize) {
+            flushOutput();
+        }
+    }
+    
+    void output(const char* buf, uint32_t size) const;
+    void flushOutput() const;
+    
+    // Limit console output to bytesPerSecond, 0 for no limit. Output
+    // waits for the bytes before it to go out at that rate, which also
+    // holds up the program
+    void setOutputRate(uint32_t bytesPerSecond) { _outputRate = bytesPerSecond; }
+    uint32_t outputRate() const { return _outputRate; }
+
+    void puts(const char* s) const { output(s, uint32_t(strlen(s))); }
 
     void printF(const char* fmt, ...) const
     {
         va_list args;
         va_start(args, fmt);
         vprintF(fmt, args);
+        va_end(args);
     }
 
-    void vprintF(const char* fmt, va_list args) const
-    {
-        puts(m8r::string::vformat(fmt, args).c_str());
-    }
+    // Formatted straight into the output buffer, without allocating
+    void vprintF(const char* fmt, va_list args) const;
 
   protected:
     // Methods to override
@@ -116,6 +205,38 @@ class BOSS9Base
     bool _echoBS = false; // If true when backspace received, sends <space><backspace> to erase char
     
   private:
+    // System call handlers, indexed by (addr - SystemAddrStart) / 2
+    using SysCall = bool (BOSS9Base::*)();
+    struct SysCallTable;
+    static const SysCallTable _sysCalls;
+    
+    bool sysPutc();
+    bool sysPuts();
+    bool sysGetc();
+    bool sysPeekc();
+    bool sysExit();
+    bool sysMon();
+    bool sysLdStart();
+    bool sysLdLine();
+    bool sysLdEnd();
+    bool sysPrintf();
+    bool sysFormat();
+    template<uint8_t bytes> bool sysSwitch();
+    template<Func func, typename T, bool remainder> bool sysDiv();
+    template<Func func, typename T> bool sysMul16();
+    template<Func func, typename T> bool sysDiv32();
+    template<Func func> bool sysArith32();
+    template<Func func> bool sysShift32();
+    
+    // Charge the math helper's cycles. count is for shifts
+    void chargeMath(Func func, uint32_t count = 1);
+    
+    // Set N, Z, V and C, leaving the rest of CC alone
+    void setFlags(bool n, bool z, bool v, bool c);
+    
+    uint32_t load32(uint16_t addr);
+    void store32(uint16_t addr, uint32_t v);
+    
     void promptIfNeeded()
     {
         if (_needPrompt) {
@@ -143,11 +264,34 @@ class BOSS9Base
     void processCommand();
     bool executeCommand(m8r::string _cmdElements[3]);
 
-    void showBreakpoint(uint8_t i) const;
+    void showBreakpoint(uint16_t i) const;
+    bool setBreakpoint(m8r::string& addrStr, BPType);
     
     bool checkEscape(int c);
     
+    void adaptSlice(uint32_t elapsed);
+    void pace();
+    
+    // Output goes out before each read so prompts are seen
+    int pollInput()
+    {
+        flushOutput();
+        return getc();
+    }
+    
+    // Char from the console, starting with one read while looking for ESC
+    int nextChar()
+    {
+        int c = _pendingChar;
+        _pendingChar = 0;
+        return c ? c : pollInput();
+    }
+    
+    // Result of the program's getc or peekc call
+    uint8_t programInput(bool peek);
+    
     bool toNum(m8r::string& s, uint32_t& num);
+    bool toReg(m8r::string s, Reg& reg);
 
     bool _needPrompt = false;
     bool _needInstPrint = false;
@@ -159,15 +303,41 @@ class BOSS9Base
     
     RunState _runState = RunState::Cmd;
     
+    int _pendingChar = 0;
+    bool _exited = false;
+    int32_t _exitCode = 0;
+    
     Emulator _emu;
     
     float _startTime = 0;
+    
+    uint32_t _sliceTime = 0;
+    
+    uint16_t _mathCycles[NumMathFuncs];
+    
+    mutable char _outputBuffer[OutputBufferSize];
+    mutable uint16_t _outputSize = 0;
+    uint32_t _outputRate = 0;
+    mutable uint32_t _outputDone = 0; // When the output so far has gone out at _outputRate
+    
+    uint32_t _clockRate = 0;
+    bool _pacing = false; // _paceMicros and _paceCycles are set
+    uint32_t _paceMicros = 0; // Wall time when the cycle count should be _paceCycles
+    uint32_t _paceCycles = 0;
+    
+#ifdef INPUT_LOG
+    InputLog* _inputLog = nullptr;
+#endif
+    
+#ifdef SNAPSHOTS
+    Snapshot _snapshot;
+#endif
 };
 
 template<uint32_t size> class BOSS9 : public BOSS9Base
 {
   public:
-    BOSS9() : BOSS9Base(_ram) { }
+    BOSS9() : BOSS9Base(_ram, size) { }
     
     ~BOSS9() { }
     
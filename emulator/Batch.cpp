@@ -0,0 +1,223 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Batch.cpp
+//  Run many programs at once
+//
+//  Created by Chris Marrin on 6/10/24.
+//
+
+#include "Batch.h"
+
+#ifdef BATCH
+
+#include "BOSS9.h"
+#include "Loader.h"
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace mc6809;
+
+static constexpr uint32_t MemorySize = 65536;
+
+// BOSS9 with the console connected to strings
+class BatchBOSS9 : public BOSS9<MemorySize>
+{
+  public:
+    BatchBOSS9(const std::string& input) : _input(input) { }
+
+    std::string& output() { return _output; }
+
+  protected:
+    virtual void putc(char c) const override { _output += c; }
+    virtual void write(const char* buf, uint32_t size) const override { _output.append(buf, size); }
+
+    virtual int getc() override
+    {
+        return (_inputPos < _input.size()) ? uint8_t(_input[_inputPos++]) : 0;
+    }
+
+    virtual bool handleRunLoop() override { return true; }
+
+  private:
+    mutable std::string _output;
+    const std::string& _input;
+    size_t _inputPos = 0;
+};
+
+// Job indexes waiting to run on one thread. The owner takes from the back
+// and other threads steal from the front.
+class WorkQueue
+{
+  public:
+    void push(size_t job) { _jobs.push_back(job); }
+
+    bool pop(size_t& job)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_jobs.empty()) {
+            return false;
+        }
+        job = _jobs.back();
+        _jobs.pop_back();
+        return true;
+    }
+
+    bool steal(size_t& job)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_jobs.empty()) {
+            return false;
+        }
+        job = _jobs.front();
+        _jobs.pop_front();
+        return true;
+    }
+
+  private:
+    std::mutex _mutex;
+    std::deque<size_t> _jobs;
+};
+
+BatchRunner::BatchRunner(uint32_t threads)
+    : _threads(threads)
+{
+    if (_threads == 0) {
+        _threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+const char* BatchRunner::statusToString(BatchStatus status)
+{
+    switch (status) {
+        case BatchStatus::Exited:       return "exited";
+        case BatchStatus::Stopped:      return "stopped";
+        case BatchStatus::Error:        return "error";
+        case BatchStatus::Timeout:      return "timeout";
+        case BatchStatus::Waiting:      return "waiting";
+        case BatchStatus::LoadError:    return "load error";
+    }
+    return "unknown";
+}
+
+std::vector<BatchResult> BatchRunner::run(const std::vector<BatchJob>& jobs)
+{
+    std::vector<BatchResult> results(jobs.size());
+    uint32_t threads = uint32_t(std::min<size_t>(_threads, jobs.size()));
+    if (threads == 0) {
+        return results;
+    }
+
+    // Deal the jobs out like cards so each thread starts with a mix. No
+    // jobs are added once the threads start, so a thread is done when
+    // every queue is empty.
+    std::vector<WorkQueue> queues(threads);
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        queues[i % threads].push(i);
+    }
+
+    auto worker = [&](uint32_t self) {
+        size_t job;
+        while (true) {
+            bool found = queues[self].pop(job);
+            for (uint32_t i = 1; !found && i < threads; ++i) {
+                found = queues[(self + i) % threads].steal(job);
+            }
+            if (!found) {
+                break;
+            }
+
+            // Each job has its own slot so results need no lock
+            results[job] = runJob(jobs[job]);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (uint32_t i = 1; i < threads; ++i) {
+        pool.emplace_back(worker, i);
+    }
+    worker(0);
+
+    for (auto& it : pool) {
+        it.join();
+    }
+    return results;
+}
+
+BatchResult BatchRunner::runJob(const BatchJob& job) const
+{
+    BatchResult result;
+    result.name = job.name;
+
+    auto start = std::chrono::steady_clock::now();
+
+    // BOSS9 holds the RAM, which is too big for a thread's stack
+    std::unique_ptr<BatchBOSS9> boss9 = std::make_unique<BatchBOSS9>(job.input);
+    Emulator& emu = boss9->emulator();
+    memset(emu.getAddr(0), 0, MemorySize);
+    emu.setStack(DefaultStack);
+    emu.setPolicy(_policy);
+    emu.setEngine(_engine);
+
+    Loader loader(emu);
+    if (_rawAddrSet) {
+        loader.setRawAddr(_rawAddr);
+    }
+    if (!loader.load(job.image.data(), job.image.size())) {
+        result.output = std::string("Error: ") + loader.error() + "\n";
+        return result;
+    }
+    uint16_t startAddr = loader.startAddr();
+
+    boss9->startExecution(startAddr);
+
+    // Cycles are only 32 bits, so add up each slice in case they wrap.
+    // Policy::Throughput doesn't count cycles, so the limit is on
+    // instructions instead or a program which never exits would never stop
+    bool countCycles = _policy != Policy::Throughput;
+    result.status = BatchStatus::Timeout;
+    while ((countCycles ? result.cycles : emu.instructions()) < _maxCycles) {
+        uint32_t cycles = emu.cycles();
+        bool running = boss9->continueExecution();
+        result.cycles += uint32_t(emu.cycles() - cycles);
+
+        if (boss9->exited()) {
+            result.status = BatchStatus::Exited;
+            result.exitCode = boss9->exitCode();
+            break;
+        }
+        if (emu.error() != Emulator::Error::None) {
+            result.status = BatchStatus::Error;
+            break;
+        }
+        if (boss9->inMonitor() || !running) {
+            result.status = BatchStatus::Stopped;
+            break;
+        }
+
+        // Nothing is scheduled to end a SYNC or CWAI and no console input
+        // is coming, so the program would wait forever
+        if (emu.waitingForInterrupt()) {
+            result.status = BatchStatus::Waiting;
+            break;
+        }
+    }
+
+    boss9->flushOutput();
+    result.instructions = emu.instructions();
+    result.output = std::move(boss9->output());
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Batch.h
+//  Run many programs at once
+//
+//  Created by Chris Marrin on 6/10/24.
+//
+
+#pragma once
+
+#include "MC6809.h"
+
+#ifdef BATCH
+
+#include <string>
+#include <vector>
+
+namespace mc6809 {
+
+// A program to run. image is the program in any format Loader knows and
+// input is what getc returns, one char at a time. When it runs out getc
+// returns 0 (no char).
+struct BatchJob
+{
+    std::string name;
+    std::string image;
+    std::string input;
+};
+
+// Waiting is a program stopped in SYNC or CWAI with nothing to end it
+enum class BatchStatus { Exited, Stopped, Error, Timeout, Waiting, LoadError };
+
+struct BatchResult
+{
+    std::string name;
+    std::string output;     // Everything written with putc
+    BatchStatus status = BatchStatus::LoadError;
+    int32_t exitCode = 0;   // Value of A at exit, if status is Exited
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    double seconds = 0;
+};
+
+// BatchRunner runs each job in its own BOSS9 instance on a pool of threads
+// and collects the results. Jobs are dealt out to the threads up front and
+// a thread which runs out of work takes jobs from the others, so a few
+// long running jobs don't hold up the rest.
+//
+// A job finishes when the program exits, enters the monitor (with the mon
+// call, an ESC or an illegal instruction), waits in SYNC or CWAI with
+// nothing to end the wait or runs for maxCycles. With Policy::Throughput
+// cycles aren't counted, so maxCycles is the number of instructions
+// instead.
+class BatchRunner
+{
+public:
+    static constexpr uint64_t DefaultMaxCycles = 1000000000;
+    static constexpr uint16_t DefaultStack = 0xe000;
+
+    // Use a thread per core if threads is 0
+    BatchRunner(uint32_t threads = 0);
+
+    void setMaxCycles(uint64_t cycles) { _maxCycles = cycles; }
+    void setPolicy(Policy policy) { _policy = policy; }
+    void setEngine(Engine engine) { _engine = engine; }
+    
+    // Where raw images are loaded, see Loader
+    void setRawAddr(uint16_t addr)
+    {
+        _rawAddr = addr;
+        _rawAddrSet = true;
+    }
+
+    uint32_t threads() const { return _threads; }
+
+    // Results are in the same order as jobs
+    std::vector<BatchResult> run(const std::vector<BatchJob>& jobs);
+
+    static const char* statusToString(BatchStatus);
+
+private:
+    BatchResult runJob(const BatchJob&) const;
+
+    uint32_t _threads;
+    uint64_t _maxCycles = DefaultMaxCycles;
+    Policy _policy = Policy::Instrumented;
+    Engine _engine = Engine::Interpreter;
+    uint16_t _rawAddr = 0;
+    bool _rawAddrSet = false;
+};
+
+}
+
+#endif
@@ -121,13 +121,13 @@ uint16_t
 DisplayInst::instToString(const Emulator& engine, m8r::string& s, uint16_t addr)
 {
     uint16_t instAddr = addr;
-    const Opcode* opcode = engine.opcode(engine.load8(addr++));
+    const Opcode* opcode = engine.opcode(engine.fetch8(addr++));
     Op prevOp = Op::NOP;
     Op op = opcode->op;
     
     if (op == Op::Page2 || op == Op::Page3) {
         prevOp = op;
-        opcode = engine.opcode(engine.load8(addr++));
+        opcode = engine.opcode(engine.fetch8(addr++));
         op = opcode->op;
         if (op == Op::SUB16) {
             op = Op::CMP16;
@@ -151,41 +151,41 @@ DisplayInst::instToString(const Emulator& engine, m8r::string& s, uint16_t addr)
         case Adr::Inherent:
             break;
         case Adr::Direct:
-            ea = engine.load8(addr++);
+            ea = engine.fetch8(addr++);
             break;
         case Adr::Extended:
-            ea = engine.load16(addr);
+            ea = engine.fetch16(addr);
             addr += 2;
             break;
         case Adr::Immed8:
-            value = engine.load8(addr++);
+            value = engine.fetch8(addr++);
             break;
         case Adr::Immed16:
-            value = engine.load16(addr);
+            value = engine.fetch16(addr);
             addr += 2;
             break;
             
         case Adr::RelL:
-            relAddr = int16_t(engine.load16(addr));
+            relAddr = int16_t(engine.fetch16(addr));
             addr += 2;
             longBranch = "l";
             break;
         case Adr::Rel:
-            relAddr = int8_t(engine.load8(addr++));
+            relAddr = int8_t(engine.fetch8(addr++));
             break;
       case Adr::RelP:
             if (prevOp == Op::Page2) {
-                relAddr = int16_t(engine.load16(addr));
+                relAddr = int16_t(engine.fetch16(addr));
                 addr += 2;
                 longBranch = "l";
                 addrMode = Adr::RelL;
             } else {
-                relAddr = int8_t(engine.load8(addr++));
+                relAddr = int8_t(engine.fetch8(addr++));
                 addrMode = Adr::Rel;
             }
             break;
         case Adr::Indexed: {
-            uint8_t postbyte = engine.load8(addr++);
+            uint8_t postbyte = engine.fetch8(addr++);
             
             // Load value of RR reg in ea
             switch (RR(postbyte & 0b01100000)) {
@@ -204,8 +204,8 @@ DisplayInst::instToString(const Emulator& engine, m8r::string& s, uint16_t addr)
             } else {
                 switch(IdxMode(postbyte & IdxModeMask)) {
                     case IdxMode::ConstRegNoOff   : offset = 0; break;
-                    case IdxMode::ConstReg8Off    : offset = int8_t(engine.load8(addr)); addr += 1; break;
-                    case IdxMode::ConstReg16Off   : offset = int16_t(engine.load16(addr)); addr += 2; break;
+                    case IdxMode::ConstReg8Off    : offset = int8_t(engine.fetch8(addr)); addr += 1; break;
+                    case IdxMode::ConstReg16Off   : offset = int16_t(engine.fetch16(addr)); addr += 2; break;
                     case IdxMode::AccAOffReg      : offsetReg = "A"; break;
                     case IdxMode::AccBOffReg      : offsetReg = "B"; break;
                     case IdxMode::AccDOffReg      : offsetReg = "D"; break;
@@ -213,10 +213,10 @@ DisplayInst::instToString(const Emulator& engine, m8r::string& s, uint16_t addr)
                     case IdxMode::Inc2Reg         : autoInc = 2; break;
                     case IdxMode::Dec1Reg         : autoInc = -1; break;
                     case IdxMode::Dec2Reg         : autoInc = -2; break;
-                    case IdxMode::ConstPC8Off     : offset = int8_t(engine.load8(addr)); addr += 1; indexReg = "PC"; break;
-                    case IdxMode::ConstPC16Off    : offset = engine.getReg(Reg::PC) + int16_t(engine.load16(addr)); addr += 2; indexReg = "PC"; break;
+                    case IdxMode::ConstPC8Off     : offset = int8_t(engine.fetch8(addr)); addr += 1; indexReg = "PC"; break;
+                    case IdxMode::ConstPC16Off    : offset = engine.getReg(Reg::PC) + int16_t(engine.fetch16(addr)); addr += 2; indexReg = "PC"; break;
                     case IdxMode::Extended:
-                        offset = engine.load16(addr);
+                        offset = engine.fetch16(addr);
                         addr += 2;
                         indexReg = nullptr;
                         break;
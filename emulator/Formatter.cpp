@@ -0,0 +1,450 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Formatter.cpp
+//  printf style formatting without allocating
+//
+//  Created by Chris Marrin on 6/18/24.
+//
+
+#include "Formatter.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <type_traits>
+
+#include "MC6809.h"
+
+using namespace mc6809;
+
+enum class Length : uint8_t { Default, hh, h, l, ll, j, z, t, L };
+
+struct Formatter::Spec
+{
+    bool left = false;      // -
+    bool plus = false;      // +
+    bool space = false;     // space
+    bool zero = false;      // 0
+    bool alt = false;       // #
+    int32_t width = 0;
+    int32_t precision = -1; // -1 if there isn't one
+    Length length = Length::Default;
+    char conv = '\0';
+};
+
+// A string in the emulator's memory. It's read a page at a time, except
+// for devices and watched pages, which go through load8. A string which
+// goes all the way around memory without a null ends there
+class GuestChars
+{
+  public:
+    GuestChars(Emulator& emu, uint16_t addr) : _emu(&emu), _addr(addr) { }
+
+    char next()
+    {
+        if (_p != _end) {
+            return char(*_p++);
+        }
+        if (_left == 0) {
+            return '\0';
+        }
+
+        uint16_t size;
+        _p = _emu->readSpan(_addr, size);
+        if (!_p) {
+            _end = nullptr;
+            _left -= 1;
+            return char(_emu->load8(_addr++));
+        }
+        size = uint16_t(std::min(uint32_t(size), _left));
+        _end = _p + size;
+        _addr += size;
+        _left -= size;
+        return char(*_p++);
+    }
+
+  private:
+    Emulator* _emu;
+    uint16_t _addr;
+    uint32_t _left = 0x10000;
+    const uint8_t* _p = nullptr;
+    const uint8_t* _end = nullptr;
+};
+
+// The program's varargs, 2 bytes each
+class GuestArgs
+{
+  public:
+    GuestArgs(Emulator& emu, uint16_t addr) : _emu(emu), _addr(addr) { }
+
+    int32_t intArg() { return int16_t(next()); }
+
+    int64_t signedArg(Length length)
+    {
+        uint16_t v = next();
+        return (length == Length::hh) ? int8_t(v) : int16_t(v);
+    }
+
+    uint64_t unsignedArg(Length length)
+    {
+        uint16_t v = next();
+        return (length == Length::hh) ? uint8_t(v) : v;
+    }
+
+    uint64_t pointerArg() { return next(); }
+    GuestChars stringArg() { return GuestChars(_emu, next()); }
+
+    // There are no floating point args
+    int32_t floatArg(const char*, bool, int32_t, int32_t, char*, uint32_t) { return -1; }
+
+  private:
+    uint16_t next()
+    {
+        uint16_t v = _emu.load16(_addr);
+        _addr += 2;
+        return v;
+    }
+
+    Emulator& _emu;
+    uint16_t _addr;
+};
+
+class HostChars
+{
+  public:
+    HostChars(const char* s) : _s(s) { }
+
+    char next() { return *_s ? *_s++ : '\0'; }
+
+  private:
+    const char* _s;
+};
+
+class HostArgs
+{
+  public:
+    HostArgs(va_list args) { va_copy(_args, args); }
+    ~HostArgs() { va_end(_args); }
+
+    int32_t intArg() { return va_arg(_args, int); }
+
+    int64_t signedArg(Length length)
+    {
+        switch (length) {
+            case Length::hh: return static_cast<signed char>(va_arg(_args, int));
+            case Length::h: return short(va_arg(_args, int));
+            case Length::l: return va_arg(_args, long);
+            case Length::ll: return va_arg(_args, long long);
+            case Length::j: return va_arg(_args, intmax_t);
+            case Length::z: return va_arg(_args, std::make_signed<size_t>::type);
+            case Length::t: return va_arg(_args, ptrdiff_t);
+            default: return va_arg(_args, int);
+        }
+    }
+
+    uint64_t unsignedArg(Length length)
+    {
+        switch (length) {
+            case Length::hh: return static_cast<unsigned char>(va_arg(_args, unsigned));
+            case Length::h: return static_cast<unsigned short>(va_arg(_args, unsigned));
+            case Length::l: return va_arg(_args, unsigned long);
+            case Length::ll: return va_arg(_args, unsigned long long);
+            case Length::j: return va_arg(_args, uintmax_t);
+            case Length::z: return va_arg(_args, size_t);
+            case Length::t: return std::make_unsigned<ptrdiff_t>::type(va_arg(_args, ptrdiff_t));
+            default: return va_arg(_args, unsigned);
+        }
+    }
+
+    uint64_t pointerArg() { return uintptr_t(va_arg(_args, void*)); }
+
+    HostChars stringArg()
+    {
+        const char* s = va_arg(_args, const char*);
+        return HostChars(s ? s : "(null)");
+    }
+
+    // fmt takes width and precision as args. Values too long for buf are
+    // cut off
+    int32_t floatArg(const char* fmt, bool isLong, int32_t width, int32_t precision, char* buf, uint32_t size)
+    {
+        int n = isLong ? snprintf(buf, size, fmt, width, precision, va_arg(_args, long double))
+                       : snprintf(buf, size, fmt, width, precision, va_arg(_args, double));
+        return std::min(n, int(size) - 1);
+    }
+
+  private:
+    va_list _args;
+};
+
+int32_t Formatter::format(Emulator& emu, uint16_t fmt, uint16_t args)
+{
+    GuestChars chars(emu, fmt);
+    GuestArgs guestArgs(emu, args);
+    return doFormat(chars, guestArgs);
+}
+
+int32_t Formatter::vformat(const char* fmt, va_list args)
+{
+    HostChars chars(fmt);
+    HostArgs hostArgs(args);
+    return doFormat(chars, hostArgs);
+}
+
+template<typename Chars, typename Args>
+int32_t Formatter::doFormat(Chars& fmt, Args& args)
+{
+    _count = 0;
+
+    for (char c = fmt.next(); c != '\0'; c = fmt.next()) {
+        if (c != '%') {
+            put(c);
+            continue;
+        }
+
+        Spec spec;
+        for (c = fmt.next(); ; c = fmt.next()) {
+            if (c == '-') {
+                spec.left = true;
+            } else if (c == '+') {
+                spec.plus = true;
+            } else if (c == ' ') {
+                spec.space = true;
+            } else if (c == '0') {
+                spec.zero = true;
+            } else if (c == '#') {
+                spec.alt = true;
+            } else {
+                break;
+            }
+        }
+
+        // A negative width from an arg is left justified
+        if (c == '*') {
+            spec.width = args.intArg();
+            if (spec.width < 0) {
+                spec.left = true;
+                spec.width = -spec.width;
+            }
+            c = fmt.next();
+        } else {
+            for ( ; c >= '0' && c <= '9'; c = fmt.next()) {
+                spec.width = spec.width * 10 + (c - '0');
+            }
+        }
+
+        // A negative precision from an arg is the same as none
+        if (c == '.') {
+            spec.precision = 0;
+            c = fmt.next();
+            if (c == '*') {
+                spec.precision = std::max(args.intArg(), -1);
+                c = fmt.next();
+            } else {
+                for ( ; c >= '0' && c <= '9'; c = fmt.next()) {
+                    spec.precision = spec.precision * 10 + (c - '0');
+                }
+            }
+        }
+
+        if (c == 'h') {
+            c = fmt.next();
+            spec.length = Length::h;
+            if (c == 'h') {
+                c = fmt.next();
+                spec.length = Length::hh;
+            }
+        } else if (c == 'l') {
+            c = fmt.next();
+            spec.length = Length::l;
+            if (c == 'l') {
+                c = fmt.next();
+                spec.length = Length::ll;
+            }
+        } else if (c == 'j' || c == 'z' || c == 't' || c == 'L') {
+            spec.length = (c == 'j') ? Length::j : (c == 'z') ? Length::z : (c == 't') ? Length::t : Length::L;
+            c = fmt.next();
+        }
+
+        spec.conv = c;
+        switch (c) {
+            case '\0':
+                flush();
+                return _count;
+            case 'd':
+            case 'i': {
+                int64_t v = args.signedArg(spec.length);
+                putInt((v < 0) ? -uint64_t(v) : uint64_t(v), v < 0, spec);
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                putInt(args.unsignedArg(spec.length), false, spec);
+                break;
+            case 'p':
+                spec.alt = true;
+                spec.conv = 'x';
+                putInt(args.pointerArg(), false, spec);
+                break;
+            case 'c': {
+                char ch = char(args.intArg());
+                putPadded(&ch, 1, spec);
+                break;
+            }
+            case 's':
+                putString(args.stringArg(), spec);
+                break;
+            case '%':
+                put('%');
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+                // Let the C library do floating point. Flags go in the
+                // format, width and precision are passed with *
+                char floatFmt[12];
+                char* p = floatFmt;
+                *p++ = '%';
+                if (spec.left) *p++ = '-';
+                if (spec.plus) *p++ = '+';
+                if (spec.space) *p++ = ' ';
+                if (spec.zero) *p++ = '0';
+                if (spec.alt) *p++ = '#';
+                *p++ = '*';
+                *p++ = '.';
+                *p++ = '*';
+                if (spec.length == Length::L) *p++ = 'L';
+                *p++ = c;
+                *p = '\0';
+
+                char buf[64];
+                int32_t size = args.floatArg(floatFmt, spec.length == Length::L, spec.width, spec.precision, buf, sizeof(buf));
+                if (size >= 0) {
+                    for (int32_t i = 0; i < size; ++i) {
+                        put(buf[i]);
+                    }
+                    break;
+                }
+                put('%');
+                put(c);
+                break;
+            }
+            default:
+                put('%');
+                put(c);
+                break;
+        }
+    }
+
+    flush();
+    return _count;
+}
+
+template<typename Chars>
+void Formatter::putString(Chars s, const Spec& spec)
+{
+    uint32_t max = (spec.precision < 0) ? UINT32_MAX : uint32_t(spec.precision);
+
+    // Padding on the left needs the length first
+    int32_t size = 0;
+    if (spec.width) {
+        for (Chars t = s; uint32_t(size) < max && t.next() != '\0'; ++size) { }
+    }
+
+    if (!spec.left) {
+        pad(' ', spec.width - size);
+    }
+    for (uint32_t i = 0; i < max; ++i) {
+        char c = s.next();
+        if (c == '\0') {
+            break;
+        }
+        put(c);
+    }
+    if (spec.left) {
+        pad(' ', spec.width - size);
+    }
+}
+
+void Formatter::putInt(uint64_t value, bool negative, const Spec& spec)
+{
+    // Digits are filled in from the end. 64 bits is 22 octal digits
+    char digits[24];
+    int32_t numDigits = 0;
+    uint32_t base = (spec.conv == 'o') ? 8 : (spec.conv == 'x' || spec.conv == 'X') ? 16 : 10;
+    const char* digitChars = (spec.conv == 'X') ? "0123456789ABCDEF" : "0123456789abcdef";
+    for (uint64_t v = value; v; v /= base) {
+        digits[sizeof(digits) - ++numDigits] = digitChars[v % base];
+    }
+
+    // Precision is the minimum number of digits, so 0 with a precision of
+    // 0 has none. # makes octal start with 0
+    int32_t zeros = std::max(((spec.precision < 0) ? 1 : spec.precision) - numDigits, 0);
+    if (spec.conv == 'o' && spec.alt && zeros == 0 && (numDigits == 0 || digits[sizeof(digits) - numDigits] != '0')) {
+        zeros = 1;
+    }
+
+    char prefix[2];
+    int32_t prefixSize = 0;
+    if (spec.conv == 'd' || spec.conv == 'i') {
+        if (negative) {
+            prefix[prefixSize++] = '-';
+        } else if (spec.plus) {
+            prefix[prefixSize++] = '+';
+        } else if (spec.space) {
+            prefix[prefixSize++] = ' ';
+        }
+    } else if ((spec.conv == 'x' || spec.conv == 'X') && spec.alt && value) {
+        prefix[prefixSize++] = '0';
+        prefix[prefixSize++] = spec.conv;
+    }
+
+    // 0 flag pads with zeros after the prefix, unless there's a precision
+    int32_t padding = spec.width - (prefixSize + zeros + numDigits);
+    if (spec.zero && !spec.left && spec.precision < 0 && padding > 0) {
+        zeros += padding;
+        padding = 0;
+    }
+
+    if (!spec.left) {
+        pad(' ', padding);
+    }
+    for (int32_t i = 0; i < prefixSize; ++i) {
+        put(prefix[i]);
+    }
+    pad('0', zeros);
+    for (int32_t i = numDigits; i > 0; --i) {
+        put(digits[sizeof(digits) - i]);
+    }
+    if (spec.left) {
+        pad(' ', padding);
+    }
+}
+
+void Formatter::putPadded(const char* s, uint32_t size, const Spec& spec)
+{
+    int32_t padding = spec.width - int32_t(size);
+    if (!spec.left) {
+        pad(' ', padding);
+    }
+    for (uint32_t i = 0; i < size; ++i) {
+        put(s[i]);
+    }
+    if (spec.left) {
+        pad(' ', padding);
+    }
+}
+
+void Formatter::pad(char c, int32_t count)
+{
+    for (int32_t i = 0; i < count; ++i) {
+        put(c);
+    }
+}
@@ -0,0 +1,92 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Formatter.h
+//  printf style formatting without allocating
+//
+//  Created by Chris Marrin on 6/18/24.
+//
+
+#pragma once
+
+#include <cstdarg>
+#include <cstdint>
+
+namespace mc6809 {
+
+class Emulator;
+
+static constexpr uint16_t FormatChunkSize = 64;
+
+// Where formatted output goes. It's sent in chunks of up to FormatChunkSize
+class FormatSink
+{
+  public:
+    virtual ~FormatSink() { }
+    virtual void write(const char* buf, uint16_t size) = 0;
+};
+
+// Formatter handles the printf and format system calls and the host's
+// messages. The format string is read a page at a time straight from the
+// emulator's memory, or from the host string, and output is collected in
+// a buffer on the stack and sent to the sink when it fills and at the
+// end, so nothing is allocated.
+//
+// Flags, width, precision (including *) and the d, i, u, o, x, X, c, s,
+// p and % conversions are supported. The program's varargs are all 2
+// bytes, so h and l are ignored for them, but hh truncates to 8 bits.
+// Host messages also have the full set of lengths and the floating
+// point conversions. Anything else is output as is.
+//
+// Both return the number of chars formatted, including any the sink
+// didn't have room for
+class Formatter
+{
+  public:
+    Formatter(FormatSink& sink) : _sink(sink) { }
+    
+    // fmt and args are addresses in the emulator's memory. args is the
+    // first vararg
+    int32_t format(Emulator&, uint16_t fmt, uint16_t args);
+
+    int32_t vformat(const char* fmt, va_list args);
+
+  private:
+    struct Spec;
+    
+    template<typename Chars, typename Args> int32_t doFormat(Chars& fmt, Args&);
+    template<typename Chars> void putString(Chars s, const Spec&);
+    void putInt(uint64_t value, bool negative, const Spec&);
+    void putPadded(const char* s, uint32_t size, const Spec&);
+    void pad(char c, int32_t count);
+
+    void put(char c)
+    {
+        _buf[_size++] = c;
+        if (_size == FormatChunkSize) {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        if (_size) {
+            _sink.write(_buf, _size);
+            _count += _size;
+            _size = 0;
+        }
+    }
+
+    FormatSink& _sink;
+    char _buf[FormatChunkSize];
+    uint16_t _size = 0;
+    int32_t _count = 0;
+};
+
+}
@@ -0,0 +1,126 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  History.cpp
+//  Execution history for reverse execution
+//
+//  Created by Chris Marrin on 6/8/24.
+//
+
+#include "History.h"
+
+#ifdef SNAPSHOTS
+
+using namespace mc6809;
+
+History::History(uint32_t maxInsts, uint32_t maxWrites)
+{
+    _insts.resize(maxInsts);
+    _writes.resize(maxWrites);
+}
+
+HistoryInst& History::addInst()
+{
+    if (_instHead - _instTail >= _insts.size()) {
+        dropFirst();
+    }
+    HistoryInst& inst = _insts[_instHead & (_insts.size() - 1)];
+    inst.firstWrite = _writeHead;
+    _instHead += 1;
+    return inst;
+}
+
+void History::addWrite(uint16_t addr, uint8_t oldValue, uint8_t newValue)
+{
+    // Keep at least the instruction making this write
+    while (_writeHead - _writeTail >= _writes.size() && _instHead - _instTail > 1) {
+        dropFirst();
+    }
+    if (_writeHead - _writeTail >= _writes.size()) {
+        _writeTail += 1;
+    }
+    _writes[_writeHead & (_writes.size() - 1)] = { addr, oldValue, newValue };
+    _writeHead += 1;
+}
+
+void History::dropFirst()
+{
+    _instTail += 1;
+    _writeTail = (_instTail < _instHead) ? inst(_instTail).firstWrite : _writeHead;
+
+    while (!_checkpoints.empty() && _checkpoints.front().index < _instTail) {
+        _checkpoints.pop_front();
+    }
+}
+
+Snapshot& History::addCheckpoint(uint64_t index)
+{
+    _checkpoints.push_back({ index, std::make_unique<Snapshot>() });
+    return *_checkpoints.back().snapshot;
+}
+
+const Snapshot* History::checkpoint(uint64_t index, uint64_t& checkpointIndex) const
+{
+    for (const auto& it : _checkpoints) {
+        if (it.index >= index) {
+            checkpointIndex = it.index;
+            return it.snapshot.get();
+        }
+    }
+    return nullptr;
+}
+
+void History::truncate(uint64_t index)
+{
+    if (index >= _instHead) {
+        return;
+    }
+    if (index < _instTail) {
+        index = _instTail;
+    }
+
+    _writeHead = (index < _instHead) ? inst(index).firstWrite : _writeHead;
+    _instHead = index;
+
+    // A checkpoint at index is still the current state
+    while (!_checkpoints.empty() && _checkpoints.back().index > index) {
+        _checkpoints.pop_back();
+    }
+}
+
+bool History::findWrite(uint16_t addr, uint64_t before, uint64_t& writeIndex) const
+{
+    // Writes before the first instruction may have been overwritten
+    uint64_t start = (_instTail < _instHead) ? inst(_instTail).firstWrite : _writeHead;
+    for (uint64_t i = before; i > start; --i) {
+        if (write(i - 1).addr == addr) {
+            writeIndex = i - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t History::instForWrite(uint64_t writeIndex) const
+{
+    // Last instruction whose first write is at or before writeIndex
+    uint64_t lo = _instTail;
+    uint64_t hi = _instHead;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (inst(mid).firstWrite <= writeIndex) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+#endif
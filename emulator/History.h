@@ -0,0 +1,120 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  History.h
+//  Execution history for reverse execution
+//
+//  Created by Chris Marrin on 6/8/24.
+//
+
+#pragma once
+
+#include "MC6809.h"
+
+#ifdef SNAPSHOTS
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace mc6809 {
+
+// Machine state before an instruction ran. Its RAM writes are the ones
+// from firstWrite up to the next instruction's firstWrite. Writes made
+// while taking an interrupt belong to the instruction before it.
+struct HistoryInst
+{
+    uint64_t firstWrite;
+    uint32_t cycles;
+    uint16_t pc;
+    uint16_t d;
+    uint16_t x;
+    uint16_t y;
+    uint16_t u;
+    uint16_t s;
+    uint8_t dp;
+    uint8_t cc;
+};
+
+struct HistoryWrite
+{
+    uint16_t addr;
+    uint8_t oldValue;
+    uint8_t newValue;
+};
+
+// History is an undo log of the most recent instructions and the RAM
+// writes they made, plus a Snapshot every CheckpointInterval instructions.
+// Instructions and writes are numbered from the start of recording. When
+// either log fills the oldest instructions are dropped.
+//
+// The Emulator fills it in and uses it to step back. Going back a long way
+// restores the nearest checkpoint after the target and undoes from there.
+class History
+{
+public:
+    static constexpr uint32_t DefaultMaxInsts = 1 << 20; // Must be a power of 2
+    static constexpr uint32_t DefaultMaxWrites = 1 << 21; // Must be a power of 2
+    static constexpr uint32_t CheckpointInterval = 1 << 16;
+
+    History(uint32_t maxInsts = DefaultMaxInsts, uint32_t maxWrites = DefaultMaxWrites);
+
+    // Instructions first() up to end() are in the log
+    uint64_t first() const { return _instTail; }
+    uint64_t end() const { return _instHead; }
+    uint64_t writeEnd() const { return _writeHead; }
+
+    const HistoryInst& inst(uint64_t i) const { return _insts[i & (_insts.size() - 1)]; }
+    const HistoryWrite& write(uint64_t i) const { return _writes[i & (_writes.size() - 1)]; }
+
+    // Writes made by instruction i
+    uint64_t writesStart(uint64_t i) const { return inst(i).firstWrite; }
+    uint64_t writesEnd(uint64_t i) const { return (i + 1 < _instHead) ? inst(i + 1).firstWrite : _writeHead; }
+
+    HistoryInst& addInst();
+    void addWrite(uint16_t addr, uint8_t oldValue, uint8_t newValue);
+
+    // Snapshot of the state before instruction index. Must be called before
+    // addInst() for that instruction
+    Snapshot& addCheckpoint(uint64_t index);
+
+    // The earliest checkpoint at or after index, or nullptr
+    const Snapshot* checkpoint(uint64_t index, uint64_t& checkpointIndex) const;
+
+    // Forget instruction index and everything after it
+    void truncate(uint64_t index);
+
+    // Search back from write before - 1 for a write to addr. Returns false
+    // if there is none
+    bool findWrite(uint16_t addr, uint64_t before, uint64_t& writeIndex) const;
+
+    // Instruction that made the write
+    uint64_t instForWrite(uint64_t writeIndex) const;
+
+private:
+    void dropFirst();
+
+    struct Checkpoint
+    {
+        uint64_t index;
+        std::unique_ptr<Snapshot> snapshot;
+    };
+
+    std::vector<HistoryInst> _insts;
+    std::vector<HistoryWrite> _writes;
+    std::deque<Checkpoint> _checkpoints; // Ordered by index
+    uint64_t _instHead = 0;
+    uint64_t _instTail = 0;
+    uint64_t _writeHead = 0;
+    uint64_t _writeTail = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,117 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  InputLog.cpp
+//  Record and replay console input
+//
+//  Created by Chris Marrin on 6/12/24.
+//
+
+#include "InputLog.h"
+
+#ifdef INPUT_LOG
+
+#include <cstring>
+
+using namespace mc6809;
+
+static constexpr const char* InputLogHeader = "6809 input log 1\n";
+
+bool InputLog::record(const char* filename)
+{
+    close();
+
+    _file = fopen(filename, "w");
+    if (!_file) {
+        return false;
+    }
+    fputs(InputLogHeader, _file);
+    _empty = 0;
+    _count = 0;
+    return true;
+}
+
+bool InputLog::replay(const char* filename)
+{
+    close();
+
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        return false;
+    }
+
+    char line[80];
+    if (!fgets(line, sizeof(line), f) || strcmp(line, InputLogHeader) != 0) {
+        fclose(f);
+        return false;
+    }
+
+    _events.clear();
+    while (fgets(line, sizeof(line), f)) {
+        unsigned empty, cycles, value;
+        char func;
+        if (sscanf(line, "%u %u %c %x", &empty, &cycles, &func, &value) != 4) {
+            continue;
+        }
+        _events.push_back({ empty, cycles, func == 'p', uint8_t(value) });
+    }
+    fclose(f);
+
+    _replaying = true;
+    _next = 0;
+    _empty = _events.empty() ? 0 : _events[0].empty;
+    _diverged = false;
+    _divergedCycles = 0;
+    return true;
+}
+
+void InputLog::close()
+{
+    if (_file) {
+        fclose(_file);
+        _file = nullptr;
+    }
+    _replaying = false;
+    _events.clear();
+}
+
+void InputLog::add(uint32_t cycles, bool peek, uint8_t value)
+{
+    if (!_file) {
+        return;
+    }
+    if (value == 0) {
+        _empty += 1;
+        return;
+    }
+    fprintf(_file, "%u %u %c %02x\n", _empty, cycles, peek ? 'p' : 'g', value);
+    _empty = 0;
+    _count += 1;
+}
+
+uint8_t InputLog::next(uint32_t cycles, bool peek)
+{
+    if (_next >= _events.size()) {
+        return 0;
+    }
+    if (_empty) {
+        _empty -= 1;
+        return 0;
+    }
+
+    const Event& event = _events[_next++];
+    if (!_diverged && (event.cycles != cycles || event.peek != peek)) {
+        _diverged = true;
+        _divergedCycles = cycles;
+    }
+    _empty = (_next < _events.size()) ? _events[_next].empty : 0;
+    return event.value;
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  InputLog.h
+//  Record and replay console input
+//
+//  Created by Chris Marrin on 6/12/24.
+//
+
+#pragma once
+
+#include "MC6809.h"
+
+#ifdef INPUT_LOG
+
+#include <cstdio>
+#include <vector>
+
+namespace mc6809 {
+
+// InputLog records what each getc and peekc call returned to the program
+// and can feed it back, so a run that read the console can be repeated
+// exactly, at full speed and without a terminal.
+//
+// Calls which found no char aren't logged one at a time. Each logged
+// event has the number of empty results before it, so replay returns 0
+// that many times and then the char. Events also have the cycle count
+// when they were read. Replay uses it to check the run is following the
+// same path, so if the program or emulator changed it's caught right
+// away rather than when the output looks wrong.
+//
+// The file is text, one event per line:
+//
+//      <empty calls before> <cycles> <g or p> <value in hex>
+//
+// so a log can be edited, or written by hand to drive a benchmark.
+class InputLog
+{
+public:
+    InputLog() { }
+    ~InputLog() { close(); }
+
+    // Start recording to filename. Returns false if it can't be created
+    bool record(const char* filename);
+
+    // Read filename to replay. Returns false if it can't be read or
+    // isn't an input log
+    bool replay(const char* filename);
+
+    // Finish recording or replaying
+    void close();
+
+    bool recording() const { return _file != nullptr; }
+    bool replaying() const { return _replaying; }
+
+    // Add the result of a getc or peekc call
+    void add(uint32_t cycles, bool peek, uint8_t value);
+
+    // Result for the next getc or peekc call. Returns 0 once every event
+    // has been replayed
+    uint8_t next(uint32_t cycles, bool peek);
+
+    // Replay has given the program all the input
+    bool finished() const { return _replaying && _next >= _events.size(); }
+
+    // An event was read at a different cycle count or by a different
+    // call than when it was recorded
+    bool diverged() const { return _diverged; }
+    uint32_t divergedCycles() const { return _divergedCycles; }
+
+    size_t count() const { return _replaying ? _events.size() : _count; }
+
+private:
+    struct Event
+    {
+        uint32_t empty;
+        uint32_t cycles;
+        bool peek;
+        uint8_t value;
+    };
+
+    FILE* _file = nullptr;
+    uint32_t _empty = 0; // Empty calls since the last event, or left to replay before the next
+    size_t _count = 0;
+
+    bool _replaying = false;
+    std::vector<Event> _events;
+    size_t _next = 0;
+    bool _diverged = false;
+    uint32_t _divergedCycles = 0;
+};
+
+}
+
+#endif
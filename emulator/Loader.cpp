@@ -0,0 +1,503 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Loader.cpp
+//  Load a whole program image into the emulator
+//
+//  Created by Chris Marrin on 6/20/24.
+//
+
+#include "Loader.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+
+#ifdef MAPPED_FILES
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace mc6809;
+
+// Value of each hex digit. Anything else is 0x100, so a pair with a bad
+// digit decodes to more than 0xff
+struct HexTable
+{
+    constexpr HexTable() : value()
+    {
+        for (uint16_t i = 0; i < 256; ++i) {
+            value[i] = 0x100;
+        }
+        for (uint16_t i = 0; i < 10; ++i) {
+            value['0' + i] = i;
+        }
+        for (uint16_t i = 0; i < 6; ++i) {
+            value['A' + i] = 10 + i;
+            value['a' + i] = 10 + i;
+        }
+    }
+
+    uint16_t value[256];
+};
+
+static constexpr HexTable hexTable;
+
+static inline uint16_t hexByte(const char* p)
+{
+    return (hexTable.value[uint8_t(p[0])] << 4) | hexTable.value[uint8_t(p[1])];
+}
+
+// Decode size bytes of hex into dst, or just add them up if dst is
+// nullptr. Returns the decoded bytes or'ed together, which has bits above
+// 0xff if there were any bad digits, so they're checked once at the end
+static inline uint16_t decodeHex(const char* hex, uint8_t* dst, uint32_t size, uint8_t& sum)
+{
+    uint16_t bad = 0;
+    for (uint32_t i = 0; i < size; ++i, hex += 2) {
+        uint16_t b = hexByte(hex);
+        bad |= b;
+        sum += uint8_t(b);
+        if (dst) {
+            dst[i] = uint8_t(b);
+        }
+    }
+    return bad;
+}
+
+static inline uint16_t get16(const uint8_t* p)
+{
+    return (uint16_t(p[0]) << 8) | uint16_t(p[1]);
+}
+
+ImageFormat Loader::findFormat(const char* data, size_t size)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    if (size >= 2 && p[0] == 'S' && p[1] >= '0' && p[1] <= '9') {
+        return ImageFormat::SRecord;
+    }
+    if (size >= 2 && p[0] == ':' && hexTable.value[p[1]] <= 0xf) {
+        return ImageFormat::IntelHex;
+    }
+    if (size >= 7 && memcmp(p, "LWOBJ", 5) == 0) {
+        return ImageFormat::Object;
+    }
+    if (size >= 9 && p[0] == 0x55 && p[8] == 0xaa && size == 9 + size_t(get16(p + 4))) {
+        return ImageFormat::Dragon;
+    }
+
+    // DECB blocks have to end exactly at the postamble at the end
+    for (size_t i = 0; i + 5 <= size; i += 5 + get16(p + i + 1)) {
+        if (p[i] == 0xff) {
+            if (i + 5 == size && get16(p + i + 1) == 0) {
+                return ImageFormat::DECB;
+            }
+            break;
+        }
+        if (p[i] != 0x00) {
+            break;
+        }
+    }
+    return ImageFormat::Raw;
+}
+
+const char* Loader::formatToString(ImageFormat format)
+{
+    switch (format) {
+        case ImageFormat::Auto: return "auto";
+        case ImageFormat::SRecord: return "s-record";
+        case ImageFormat::IntelHex: return "Intel hex";
+        case ImageFormat::DECB: return "DECB";
+        case ImageFormat::Dragon: return "Dragon";
+        case ImageFormat::Raw: return "raw";
+        case ImageFormat::Object: return "lwasm object";
+    }
+    return "unknown";
+}
+
+bool Loader::load(const char* data, size_t size, ImageFormat format)
+{
+    _format = (format == ImageFormat::Auto) ? findFormat(data, size) : format;
+    _line = 0;
+    _startAddr = 0;
+    _startAddrSet = false;
+    _size = 0;
+    _base = 0;
+    _written = false;
+    _error[0] = '\0';
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    bool ok = false;
+    switch (_format) {
+        case ImageFormat::Auto: break;
+        case ImageFormat::SRecord:
+        case ImageFormat::IntelHex: ok = loadLines(data, data + size); break;
+        case ImageFormat::DECB: ok = loadDECB(bytes, bytes + size); break;
+        case ImageFormat::Dragon: ok = loadDragon(bytes, bytes + size); break;
+        case ImageFormat::Raw: ok = loadRaw(bytes, bytes + size); break;
+        case ImageFormat::Object: ok = fail("lwasm object files need to be linked with lwlink"); break;
+    }
+
+    // Discard any decoded instructions from the memory written
+    if (_written) {
+        uint32_t span = _high - _low;
+        if (span > 0xffff) {
+            _emu.invalidateDecodeCache();
+        } else {
+            _emu.invalidateDecodeCache(uint16_t(_low), uint16_t(span));
+        }
+    }
+    return ok;
+}
+
+#ifdef MAPPED_FILES
+bool Loader::loadFile(const char* filename, ImageFormat format)
+{
+    _line = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return fail("can't open '%s'", filename);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return fail("can't read '%s'", filename);
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return fail("'%s' is empty", filename);
+    }
+
+    void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return fail("can't map '%s'", filename);
+    }
+
+    bool ok = load(static_cast<const char*>(data), size_t(st.st_size), format);
+    munmap(data, size_t(st.st_size));
+    return ok;
+}
+#endif
+
+bool Loader::loadLines(const char* data, const char* end)
+{
+    // A null ends the image, for callers who pass a C string with its null
+    const char* null = static_cast<const char*>(memchr(data, '\0', end - data));
+    if (null) {
+        end = null;
+    }
+
+    uint32_t records = 0;
+    bool finished = false;
+    for (const char* p = data; !finished && p < end; ) {
+        const char* eol = p;
+        while (eol < end && *eol != '\n' && *eol != '\r') {
+            ++eol;
+        }
+
+        _line += 1;
+        if (eol > p) {
+            bool ok;
+            if (_format == ImageFormat::SRecord) {
+                ok = loadSRecord(p, eol);
+            } else {
+                // Nothing after the end record is loaded
+                ok = loadIntelHex(p, eol);
+                finished = p[7] == '0' && p[8] == '1';
+            }
+            if (!ok) {
+                return false;
+            }
+            records += 1;
+        }
+
+        // CRLF is one line ending
+        if (eol < end && *eol == '\r') {
+            ++eol;
+        }
+        if (eol < end && *eol == '\n') {
+            ++eol;
+        }
+        p = eol;
+    }
+
+    if (records == 0) {
+        _line = 0;
+        return fail("no records");
+    }
+    return true;
+}
+
+bool Loader::loadSRecord(const char* p, const char* end)
+{
+    size_t length = end - p;
+    if (p[0] != 'S') {
+        return fail("doesn't start with an 'S'");
+    }
+    if (length < 4) {
+        return fail("record is too short");
+    }
+
+    uint8_t addrSize;
+    switch (p[1]) {
+        case '0': case '1': case '5': case '9': addrSize = 2; break;
+        case '2': case '6': case '8': addrSize = 3; break;
+        case '3': case '7': addrSize = 4; break;
+        default: return fail("unrecognized record S%c", p[1]);
+    }
+
+    // count is the number of bytes after it: the address, data and checksum
+    uint16_t count = hexByte(p + 2);
+    if (count > 0xff) {
+        return fail("bad count '%c%c'", p[2], p[3]);
+    }
+    if (count < addrSize + 1) {
+        return fail("count of %d is too small for an S%c record", count, p[1]);
+    }
+    if (length < 4 + size_t(count) * 2) {
+        return fail("count is %d but the record has %d bytes", count, int32_t(length - 4) / 2);
+    }
+
+    const char* hex = p + 4;
+    uint8_t sum = uint8_t(count);
+    uint32_t addr = 0;
+    uint16_t bad = 0;
+    for (uint8_t i = 0; i < addrSize; ++i, hex += 2) {
+        uint16_t b = hexByte(hex);
+        bad |= b;
+        sum += uint8_t(b);
+        addr = (addr << 8) | uint8_t(b);
+    }
+
+    uint32_t dataSize = count - addrSize - 1;
+    bool isData = p[1] >= '1' && p[1] <= '3';
+    uint8_t* dst = nullptr;
+    if (isData && bad <= 0xff) {
+        dst = reserve(addr, dataSize);
+        if (!dst) {
+            return false;
+        }
+    }
+    bad |= decodeHex(hex, dst, dataSize, sum);
+    hex += dataSize * 2;
+
+    uint16_t checksum = hexByte(hex);
+    bad |= checksum;
+    if (bad > 0xff) {
+        for (const char* s = p + 4; ; ++s) {
+            if (hexTable.value[uint8_t(*s)] > 0xf) {
+                return fail("expecting hex digit, found '%c'", *s);
+            }
+        }
+    }
+    if (checksum != uint8_t(~sum)) {
+        return fail("found checksum $%02x, expecting $%02x", checksum, uint8_t(~sum));
+    }
+
+    if (isData) {
+        loaded(addr, dataSize);
+    } else if (p[1] >= '7') {
+        if (addr > 0xffff) {
+            return fail("start address $%x is outside of memory", addr);
+        }
+        _startAddr = uint16_t(addr);
+        _startAddrSet = true;
+    }
+    return true;
+}
+
+// :<count><address><type><data><checksum>. The checksum makes the sum of
+// all the bytes 0. lwasm always writes ff as the checksum of the end
+// record, with the start address in its address field, so its checksum
+// isn't checked and a non-zero address is used as the start address if
+// there wasn't a start address record
+bool Loader::loadIntelHex(const char* p, const char* end)
+{
+    size_t length = end - p;
+    if (p[0] != ':') {
+        return fail("doesn't start with a ':'");
+    }
+    if (length < 11) {
+        return fail("record is too short");
+    }
+
+    uint8_t sum = 0;
+    uint8_t header[4];
+    uint16_t bad = decodeHex(p + 1, header, 4, sum);
+    if (bad > 0xff) {
+        return fail("bad hex digit in '%.9s'", p);
+    }
+
+    uint8_t count = header[0];
+    uint32_t addr = get16(header + 1);
+    uint8_t type = header[3];
+    if (length < 11 + size_t(count) * 2) {
+        return fail("count is %d but the record has %d bytes", count, int32_t(length - 11) / 2);
+    }
+
+    const char* hex = p + 9;
+    uint8_t* dst = nullptr;
+    uint8_t data[4];
+    if (type == 0x00) {
+        dst = reserve(_base + addr, count);
+        if (!dst) {
+            return false;
+        }
+    } else if (type >= 0x02 && type <= 0x05) {
+        if (count != ((type & 1) ? 4 : 2)) {
+            return fail("record type %02x needs %d bytes", type, (type & 1) ? 4 : 2);
+        }
+        dst = data;
+    } else if (type != 0x01) {
+        return fail("unrecognized record type %02x", type);
+    }
+
+    bad |= decodeHex(hex, dst, count, sum);
+    hex += count * 2;
+    uint16_t checksum = hexByte(hex);
+    bad |= checksum;
+    if (bad > 0xff) {
+        for (const char* s = p + 1; ; ++s) {
+            if (hexTable.value[uint8_t(*s)] > 0xf) {
+                return fail("expecting hex digit, found '%c'", *s);
+            }
+        }
+    }
+    if (type != 0x01 && checksum != uint8_t(-sum)) {
+        return fail("found checksum $%02x, expecting $%02x", checksum, uint8_t(-sum));
+    }
+
+    uint32_t start = 0;
+    switch (type) {
+        case 0x00: loaded(_base + addr, count); return true;
+        case 0x01:
+            if (_startAddrSet || addr == 0) {
+                return true;
+            }
+            start = addr;
+            break;
+        case 0x02: _base = uint32_t(get16(data)) << 4; return true;
+        case 0x03: start = (uint32_t(get16(data)) << 4) + get16(data + 2); break;
+        case 0x04: _base = uint32_t(get16(data)) << 16; return true;
+        case 0x05: start = (uint32_t(get16(data)) << 16) | get16(data + 2); break;
+    }
+
+    if (start > 0xffff) {
+        return fail("start address $%x is outside of memory", start);
+    }
+    _startAddr = uint16_t(start);
+    _startAddrSet = true;
+    return true;
+}
+
+bool Loader::loadDECB(const uint8_t* data, const uint8_t* end)
+{
+    for (const uint8_t* p = data; ; ) {
+        if (end - p < 5) {
+            return fail("image ends without a postamble at offset %d", int32_t(p - data));
+        }
+        uint16_t size = get16(p + 1);
+        uint16_t addr = get16(p + 3);
+        if (p[0] == 0xff) {
+            _startAddr = addr;
+            _startAddrSet = true;
+            return true;
+        }
+        if (p[0] != 0x00) {
+            return fail("expecting a block at offset %d, found $%02x", int32_t(p - data), p[0]);
+        }
+        p += 5;
+        if (end - p < size) {
+            return fail("block at $%04x is %d bytes but only %d are left", addr, size, int32_t(end - p));
+        }
+
+        uint8_t* dst = reserve(addr, size);
+        if (!dst) {
+            return false;
+        }
+        memcpy(dst, p, size);
+        loaded(addr, size);
+        p += size;
+    }
+}
+
+bool Loader::loadDragon(const uint8_t* data, const uint8_t* end)
+{
+    if (end - data < 9 || data[0] != 0x55 || data[8] != 0xaa) {
+        return fail("not a Dragon binary");
+    }
+    uint16_t addr = get16(data + 2);
+    uint16_t size = get16(data + 4);
+    if (end - data - 9 < size) {
+        return fail("image is %d bytes but only %d are left", size, int32_t(end - data - 9));
+    }
+
+    uint8_t* dst = reserve(addr, size);
+    if (!dst) {
+        return false;
+    }
+    memcpy(dst, data + 9, size);
+    loaded(addr, size);
+    _startAddr = get16(data + 6);
+    _startAddrSet = true;
+    return true;
+}
+
+bool Loader::loadRaw(const uint8_t* data, const uint8_t* end)
+{
+    if (!_rawAddrSet) {
+        return fail("image isn't a known format and has no load address");
+    }
+    uint32_t size = uint32_t(end - data);
+    uint8_t* dst = reserve(_rawAddr, size);
+    if (!dst) {
+        return false;
+    }
+    memcpy(dst, data, size);
+    loaded(_rawAddr, size);
+    return true;
+}
+
+uint8_t* Loader::reserve(uint32_t addr, uint32_t size)
+{
+    // Written so a record near the top of a 32 bit address space can't wrap
+    uint32_t ramSize = _emu.ramSize();
+    if (addr >= ramSize || size > ramSize - addr) {
+        fail("$%x-$%llx is outside of RAM", addr, (unsigned long long) addr + size - 1);
+        return nullptr;
+    }
+    _low = _written ? std::min(_low, addr) : addr;
+    _high = _written ? std::max(_high, addr + size) : addr + size;
+    _written = true;
+    return _emu.getAddr(uint16_t(addr));
+}
+
+void Loader::loaded(uint32_t addr, uint32_t size)
+{
+    if (_size == 0 && !_startAddrSet) {
+        _startAddr = uint16_t(addr);
+    }
+    _size += size;
+}
+
+bool Loader::fail(const char* fmt, ...)
+{
+    int n = _line ? snprintf(_error, ErrorSize, "line %u: ", _line) : 0;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(_error + n, ErrorSize - n, fmt, args);
+    va_end(args);
+    return false;
+}
@@ -0,0 +1,132 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Loader.h
+//  Load a whole program image into the emulator
+//
+//  Created by Chris Marrin on 6/20/24.
+//
+
+#pragma once
+
+#include "MC6809.h"
+
+#include <cstddef>
+
+namespace mc6809 {
+
+enum class ImageFormat { Auto, SRecord, IntelHex, DECB, Dragon, Raw, Object };
+
+// Loader puts a whole program image into the emulator's memory in one
+// pass. The format is found from the first bytes of the image:
+//
+//      SRecord     Starts with S and a digit. S1, S2 and S3 records are
+//                  data with 16, 24 and 32 bit addresses, and S9, S8 and
+//                  S7 give the start address. S0 headers and S5 and S6
+//                  counts are checked and skipped
+//      IntelHex    Starts with ':'. Data, extended segment and linear
+//                  address, start address and end records are handled
+//      DECB        Blocks of $00, length, address and data, ending with
+//                  $ff, 0, 0 and the start address. Found by following
+//                  the blocks to the end of the image
+//      Dragon      Dragon DOS binary (lwasm -f dragon). A 9 byte header
+//                  of $55, type, address, length, start and $aa, then
+//                  the data
+//      Object      lwasm object file (-f obj). These need to be linked
+//                  with lwlink first, so they're an error
+//      Raw         Anything else, such as lwasm -f raw or -f abs. There
+//                  is no address, so it's loaded and started at the
+//                  address given with setRawAddr
+//
+// Hex is decoded with a table, two digits at a time, straight into RAM,
+// with no copy of the line or the data. Each record's count and checksum
+// are checked, binary blocks must fit in the image and everything must
+// be inside RAM. Hex records end with LF, CRLF or CR and blank lines are
+// ignored. Without a start address, the program starts at the first data
+// loaded.
+//
+// The line at a time loadLine in Emulator is still used by the monitor
+// and the ldLine system call.
+class Loader
+{
+  public:
+    static constexpr uint16_t ErrorSize = 80;
+
+    Loader(Emulator& emu) : _emu(emu) { }
+
+    // Address to load raw images at. Without it they're an error
+    void setRawAddr(uint16_t addr)
+    {
+        _rawAddr = addr;
+        _rawAddrSet = true;
+    }
+
+    // Returns false on the first error, with error() saying what and
+    // where. Memory written before the error, including by the bad
+    // record, stays written
+    bool load(const char* data, size_t size, ImageFormat = ImageFormat::Auto);
+
+#ifdef MAPPED_FILES
+    // Map the file into memory rather than reading it and load it
+    bool loadFile(const char* filename, ImageFormat = ImageFormat::Auto);
+#endif
+
+    static ImageFormat findFormat(const char* data, size_t size);
+    static const char* formatToString(ImageFormat);
+
+    // Format of the last image loaded
+    ImageFormat format() const { return _format; }
+
+    uint16_t startAddr() const { return _startAddr; }
+
+    // Bytes of data loaded
+    uint32_t size() const { return _size; }
+
+    const char* error() const { return _error; }
+
+  private:
+    // Text formats, a record per line
+    bool loadLines(const char* data, const char* end);
+    bool loadSRecord(const char* p, const char* end);
+    bool loadIntelHex(const char* p, const char* end);
+
+    bool loadDECB(const uint8_t* data, const uint8_t* end);
+    bool loadDragon(const uint8_t* data, const uint8_t* end);
+    bool loadRaw(const uint8_t* data, const uint8_t* end);
+
+    // Where to put size bytes at addr, or nullptr if it's not all in RAM
+    uint8_t* reserve(uint32_t addr, uint32_t size);
+
+    // size bytes at addr were loaded
+    void loaded(uint32_t addr, uint32_t size);
+
+    bool fail(const char* fmt, ...);
+
+    Emulator& _emu;
+    ImageFormat _format = ImageFormat::Auto;
+    uint16_t _rawAddr = 0;
+    bool _rawAddrSet = false;
+    uint32_t _line = 0;
+    uint16_t _startAddr = 0;
+    bool _startAddrSet = false;
+    uint32_t _size = 0;
+
+    // Intel hex address from the last extended segment or linear
+    // address record
+    uint32_t _base = 0;
+
+    // Range written, to discard decoded instructions once at the end
+    bool _written = false;
+    uint32_t _low = 0;
+    uint32_t _high = 0;
+
+    char _error[ErrorSize] = { };
+};
+
+}
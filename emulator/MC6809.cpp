@@ -15,14 +15,16 @@
 
 #include "MC6809.h"
 #include "BOSS9.h"
+#include "History.h"
+#include "Profiler.h"
+#include "Tracer.h"
+
+#include <array>
+#include <utility>
 
 using namespace mc6809;
 
-#ifdef COMPUTE_CYCLES
 static_assert (sizeof(Opcode) == 4, "Opcode is wrong size");
-#else
-static_assert (sizeof(Opcode) == 3, "Opcode is wrong size");
-#endif
 
 static constexpr Opcode opcodeTable[ ] = {
     /*00*/  	{ Op::NEG	  , Reg::M8   , Left::LdSt, Right::None , Adr::Direct	, CY(6) },
@@ -190,7 +192,7 @@ static constexpr Opcode opcodeTable[ ] = {
     /*99*/  	{ Op::ADC	  , Reg::A    , Left::LdSt, Right::Ld8  , Adr::Direct	, CY(4) },
     /*9A*/  	{ Op::OR	  , Reg::A    , Left::LdSt, Right::Ld8  , Adr::Direct	, CY(4) },
     /*9B*/  	{ Op::ADD8	  , Reg::A    , Left::LdSt, Right::Ld8  , Adr::Direct	, CY(4) },
-    /*9C*/  	{ Op::CMP16	  , Reg::X    , Left::Ld  , Right::Ld8  , Adr::Direct	, CY(6) },
+    /*9C*/  	{ Op::CMP16	  , Reg::XYS  , Left::Ld  , Right::Ld16 , Adr::Direct	, CY(6) },
     /*9D*/  	{ Op::JSR	  , Reg::None , Left::None, Right::None , Adr::Direct	, CY(7) },
     /*9E*/  	{ Op::LD16	  , Reg::XY   , Left::St  , Right::Ld16 , Adr::Direct	, CY(5) },
     /*9F*/  	{ Op::ST16	  , Reg::XY   , Left::Ld  , Right::St16 , Adr::Direct	, CY(5) },
@@ -310,7 +312,7 @@ static inline uint16_t concat(uint8_t a, uint8_t b)
 
 void SRecordInfo::ParseError(unsigned linenum, const char *fmt, va_list args)
 {
-    if (linenum == 0) {
+    if (linenum != 0) {
         _boss9->printF("Error: line %d: ", linenum);
     } else {
         _boss9->printF("Error: ");
@@ -341,529 +343,1094 @@ uint16_t Emulator::loadEnd()
     return sRecInfo.startAddr();
 }
 
-bool Emulator::execute(RunState runState)
+bool SRecordInfo::Data(const SRecordData *sRecData)
 {
-    bool isStepping = runState != RunState::Running;
-    
-    uint32_t instructionsToExecute = InstructionsToExecutePerContinue;
-    bool firstTime = true;
+    // Written so a record near the top of a 32 bit address space can't wrap
+    if (sRecData->m_addr >= _ramSize || sRecData->m_dataLen > _ramSize - sRecData->m_addr) {
+        _boss9->printF("Error: line %d: $%x-$%llx is outside of RAM\n", sRecData->m_lineNum,
+                       sRecData->m_addr, (unsigned long long) sRecData->m_addr + sRecData->m_dataLen - 1);
+        return false;
+    }
     
-    while(true) {
-        if (_haveBreakpoints) {
-            // if runState is not Running we need to ignore a breakpoint at the
-            // PC upon entry. Continuing and all the stepping states need to
-            // execute the first instruction they encounter
-            if (!firstTime || runState == RunState::Running) {
-                if (atBreakpoint(_pc)) {
-                    _boss9->printF("\n*** hit breakpoint at addr $%04x\n\n", _pc);
-                    _boss9->call(Func::mon);
-                    return true;
-                }
-            }
-            
-            firstTime = false;
-        }
-        
-#ifdef TRACE
-        _traceBuffer[_traceBufferIndex++] = _pc;
-        if (_traceBufferIndex >= TraceBufferSize) {
-            _traceBufferIndex = 0;
-        }
-#endif
-        
-        uint16_t ea = 0;
-        uint8_t opIndex = next8();
-        
-        const Opcode* opcode = &(opcodeTable[opIndex]);
+    // If the start addr has not been set, set it to the start of the first record.
+    // The StartAddress function can change this at the end
+    if (!_startAddrSet) {
+        _startAddr = sRecData->m_addr;
+    }
+    memcpy(_ram + sRecData->m_addr, sRecData->m_data, sRecData->m_dataLen);
+    _boss9->emulator().invalidateDecodeCache(sRecData->m_addr, sRecData->m_dataLen);
+    return true;
+}
 
-        AddCy(opcode->cycles);
+void Emulator::invalidateDecodeCache()
+{
+#ifdef SNAPSHOTS
+    markDirty(0, 65536);
+#endif
 
-#ifdef COMPUTE_CYCLES
-        bool longBranch = false;
-        bool branchTaken = false;
-#define SBT branchTaken = true
-#else
-#define SBT
+#ifdef DECODE_CACHE
+    for (uint32_t i = 0; i < DecodeCacheSize; ++i) {
+        _decodeCache[i].addr = i + 1;
+    }
+    memset(_codeBytes, 0, sizeof(_codeBytes));
+    flushBlocks();
 #endif
-                
-        // Handle address modes
-        // If this is an addressing mode that produces a 16 bit effective address
-        // it will be placed in ea. If it's immediate or branch relative then the
-        // 8 or 16 bit value is placed in _right
-        //
-        // NOTE: gcc seems to have a problem with emum class and bitfields. It
-        // tries to cast the value to an int, which can't be done implicitly with
-        // enum class. Moving the value into a bare variable solves the problem.
-        //
-        Adr adr = opcode->adr;
-        
-        switch(adr) {
-            case Adr::None:
-            case Adr::Inherent:
-                break;
-            case Adr::Direct:
-                ea = concat(_dp, next8());
-                break;
-            case Adr::Extended:
-                ea = next16();
-                break;
-            case Adr::Immed8:
-                _right = next8();
-                break;
-            case Adr::Immed16:
-                _right = next16();
-                break;
-                
-            // All the relative addressing modes need to be sign extended to 32 bits
-            case Adr::RelL:
-#ifdef COMPUTE_CYCLES
-                _cycles += 2;
-                longBranch = true;
+}
+
+void Emulator::invalidateDecodeCache(uint16_t addr, uint16_t size)
+{
+#ifdef SNAPSHOTS
+    markDirty(addr, size);
 #endif
-                _right = int16_t(next16());
-                break;
-            case Adr::Rel:
-                _right = int8_t(next8());
-                break;
-          case Adr::RelP:
-                if (_prevOp == Op::Page2) {
-#ifdef COMPUTE_CYCLES
-                    _cycles += 2;
-                    longBranch = true;
+
+#ifdef DECODE_CACHE
+    if (size >= DecodeCacheSize) {
+        invalidateDecodeCache();
+        return;
+    }
+    
+    flushBlocks(addr, size);
+    
+    // An instruction starting up to MaxInstSize - 1 bytes before addr
+    // might overlap it. i is the offset from the first candidate, so an
+    // instruction at i overlaps if it extends past MaxInstSize - 1.
+    uint16_t first = addr - (MaxInstSize - 1);
+    for (uint16_t i = 0; i < size + MaxInstSize - 1; ++i) {
+        uint16_t instAddr = first + i;
+        DecodedInst& inst = _decodeCache[instAddr & (DecodeCacheSize - 1)];
+        if (inst.addr == instAddr && i + inst.size > MaxInstSize - 1) {
+            inst.addr = instAddr + 1;
+        }
+    }
+    
+    // Nothing decoded covers these bytes now
+    for (uint16_t i = 0; i < size; ++i) {
+        clearCode(addr + i);
+    }
+#else
+    (void) addr;
+    (void) size;
 #endif
-                    _right = int16_t(next16());
-                } else {
-                    _right = int8_t(next8());
+}
+
+// postbyte here is the register, indirect bit and mode. The 5 bit offset
+// mode is decoded as ConstReg8Off and the PC relative modes as Extended.
+template<uint8_t postbyte>
+uint16_t Emulator::indexedEA(Emulator& e, const DecodedInst& inst)
+{
+    uint16_t ea = 0;
+    uint16_t* reg = nullptr;
+    
+    // Load value of RR reg in ea
+    switch (RR(postbyte & 0b01100000)) {
+        case RR::X: reg = &e._x; break;
+        case RR::Y: reg = &e._y; break;
+        case RR::U: reg = &e._u; break;
+        case RR::S: reg = &e._s; break;
+    }
+    
+    switch(IdxMode(postbyte & IdxModeMask)) {
+        case IdxMode::ConstRegNoOff   : ea = *reg; break;
+        case IdxMode::ConstReg8Off    :
+        case IdxMode::ConstReg16Off   : ea = *reg + inst.operand; break;
+        case IdxMode::AccAOffReg      : ea = *reg + int8_t(e._a); break;
+        case IdxMode::AccBOffReg      : ea = *reg + int8_t(e._b); break;
+        case IdxMode::AccDOffReg      : ea = *reg + int16_t(e._d); break;
+        case IdxMode::Inc1Reg         : ea = *reg; (*reg) += 1; break;
+        case IdxMode::Inc2Reg         : ea = *reg; (*reg) += 2; break;
+        case IdxMode::Dec1Reg         : (*reg) -= 1; ea = *reg; break;
+        case IdxMode::Dec2Reg         : (*reg) -= 2; ea = *reg; break;
+        default                       : ea = inst.operand; break;
+    }
+    
+    if (postbyte & IndexedIndMask) {
+        // indirect from ea
+        ea = e.load16(ea);
+    }
+    return ea;
+}
+
+template<uint16_t code>
+bool Emulator::exec(Emulator& e, const DecodedInst& inst, uint16_t& ea)
+{
+    return e.execOp<code>(inst, ea);
+}
+
+template<size_t... I>
+static constexpr std::array<EAFunc, sizeof...(I)> makeIndexedEATable(std::index_sequence<I...>)
+{
+    return { &Emulator::indexedEA<uint8_t(I)>... };
+}
+
+template<size_t... I>
+static constexpr std::array<ExecFunc, sizeof...(I)> makeExecTable(std::index_sequence<I...>)
+{
+    return { &Emulator::exec<uint16_t(I)>... };
+}
+
+// Indexed by the low 7 bits of the normalized postbyte
+static constexpr auto indexedEATable = makeIndexedEATable(std::make_index_sequence<128>());
+
+// Indexed by page * 256 + opcode, where page is 0 for no prefix, 1 for
+// Page2 and 2 for Page3
+static constexpr auto execTable = makeExecTable(std::make_index_sequence<3 * 256>());
+
+static constexpr uint16_t execIndex(Op page, uint8_t opIndex)
+{
+    return ((page == Op::Page2) ? 256 : ((page == Op::Page3) ? 512 : 0)) + opIndex;
+}
+
+// Page2 and Page3 select a different register for some opcodes (see the
+// table in MC6809.h). Reg::None means there is no register on that page,
+// so nothing is loaded or stored.
+static constexpr Reg pageReg(Reg reg, Op page)
+{
+    switch(reg) {
+        default:        return reg;
+        case Reg::DDU:  return (page == Op::Page3) ? Reg::U : Reg::D;
+        case Reg::XYS:  return (page == Op::Page2) ? Reg::Y : ((page == Op::Page3) ? Reg::S : Reg::X);
+        case Reg::XY:   return (page == Op::Page2) ? Reg::Y : ((page == Op::Page3) ? Reg::None : Reg::X);
+        case Reg::US:   return (page == Op::Page2) ? Reg::S : ((page == Op::Page3) ? Reg::None : Reg::U);
+    }
+}
+
+// The exec handler for each opcode on each page. The table entry, the
+// page and the register are constants so the addressing mode, operand
+// loads, the switch, flag updates and the store all reduce to just what
+// that opcode needs. Only indexed mode needs a call, to the EA handler
+// the decoder picked for the postbyte.
+template<uint16_t code>
+bool Emulator::execOp(const DecodedInst& inst, uint16_t& ea)
+{
+    constexpr const Opcode* opcode = &opcodeTable[code & 0xff];
+    constexpr Op op = opcode->op;
+    constexpr Op page = (code >= 512) ? Op::Page3 : ((code >= 256) ? Op::Page2 : Op::NOP);
+    constexpr Reg reg = pageReg(opcode->reg, page);
+    
+    // Handle address modes
+    // If this is an addressing mode that produces a 16 bit effective address
+    // it will be placed in ea. If it's immediate or branch relative then the
+    // 8 or 16 bit value is placed in _right. The decoder has already sign
+    // extended relative offsets.
+    switch(opcode->adr) {
+        case Adr::None:
+        case Adr::Inherent:
+            break;
+        case Adr::Direct:
+            ea = concat(_dp, inst.operand);
+            break;
+        case Adr::Extended:
+            ea = inst.operand;
+            break;
+        case Adr::Immed8:
+        case Adr::Immed16:
+        case Adr::Rel:
+        case Adr::RelL:
+        case Adr::RelP:
+            _right = inst.operand;
+            break;
+        case Adr::Indexed:
+            ea = inst.ea(*this, inst);
+            break;
+    }
+    
+    // Get left operand
+    if (opcode->left == Left::Ld || opcode->left == Left::LdSt) {
+        if (opcode->reg == Reg::M8) {
+            _left = load8(ea);
+        } else if (opcode->reg == Reg::M16) {
+            _left = load16(ea);
+        } else {
+            _left = getReg(reg);
+        }
+    }
+    
+    // Get right operand
+    if (opcode->right == Right::Ld8) {
+        _right = load8(ea);
+    } else if (opcode->right == Right::Ld16) {
+        _right = load16(ea);
+    }
+            
+    // Perform operation. op is a constant so this reduces to a single case
+    switch(op) {
+        case Op::ILL:
+            _error = Error::Illegal;
+            _boss9->call(Func::mon);
+            return false;
+        case Op::Page2:
+        case Op::Page3:
+            // The decoder only returns a prefix on its own when it's followed
+            // by another one. Only the last one counts so this is a no-op.
+            break;
+
+        case Op::BHS:
+        case Op::BCC: if (!flagC()) _pc += _right;                   break;
+        case Op::BLO:
+        case Op::BCS: if (flagC()) _pc += _right;                    break;
+        case Op::BEQ: if (flagZ()) _pc += _right;                    break;
+        case Op::BGE: if (!NxorV()) _pc += _right;                   break;
+        case Op::BGT: if (!(NxorV() || flagZ())) _pc += _right;      break;
+        case Op::BHI: if (!flagC() && !flagZ()) _pc += _right;       break;
+        case Op::BLE: if (NxorV() || flagZ()) _pc += _right;         break;
+        case Op::BLS: if (flagC() || flagZ()) _pc += _right;         break;
+        case Op::BLT: if (NxorV()) _pc += _right;                    break;
+        case Op::BMI: if (flagN()) _pc += _right;                    break;
+        case Op::BNE: if (!flagZ()) _pc += _right;                   break;
+        case Op::BPL: if (!flagN()) _pc += _right;                   break;
+        case Op::BRA: _pc += _right;                                 break;
+        case Op::BRN: break;
+        case Op::BVC: if (!flagV()) _pc += _right;                   break;
+        case Op::BVS: if (flagV()) _pc += _right;                    break;
+        case Op::BSR:
+            push16(_s, _pc);
+            _pc += _right;
+            _subroutineDepth += 1;
+            break;
+
+        case Op::ABX:
+            _x = _x + uint16_t(_b);
+            break;
+        case Op::ADC:
+            _result = _left + _right + (flagC() ? 1 : 0);
+            HNZVC8();
+            break;
+        case Op::ADD8:
+            _result = _left + _right;
+            HNZVC8();
+            break;
+        case Op::ADD16:
+            _result = _left + _right;
+            xNZVC16();
+            break;
+        case Op::AND:
+            _result = _left & _right;
+            xNZ0x8();
+            break;
+        case Op::ANDCC:
+            ccByte() &= _right;
+            break;
+        case Op::ASL:
+            _result = _left << 1;
+            xNZxx8();
+            cc().V = (((_left & 0x40) >> 6) ^ ((_left & 0x80) >> 7)) != 0;
+            cc().C = _left & 0x80;
+            break;
+        case Op::ASR:
+            _result = _left >> 1;
+            if (_left & 0x80) {
+                _result |= 0x80;
+            }
+            xNZxx8();
+            cc().C = _left & 0x01;
+            break;
+        case Op::BIT:
+            _result = _left & _right;
+            xNZ0x8();
+            break;
+        case Op::CLR:
+            _result = 0;
+            cc().N = false;
+            cc().Z = true;
+            cc().V = false;
+            cc().C = false;
+            break;
+        case Op::CMP8:
+        case Op::SUB8:
+            _result = _left - _right;
+            xNZVC8();
+            break;
+        case Op::CMP16:
+        case Op::SUB16:
+            _result = _left - _right;
+            xNZVC16();
+            
+            // We need to do setReg here because if we're on an altPage these
+            // are actually CMP16 and not SUB16
+            if (page == Op::NOP && op == Op::SUB16) {
+                setReg(reg, _result);
+            }
+            break;
+        case Op::COM:
+            _result = ~_left;
+            xNZ018();
+            break;
+        case Op::CWAI:
+            ccByte() &= _right;
+            pushEntireState();
+            _wait = Wait::Cwai;
+            if (!waitForInterrupt()) {
+                return false;
+            }
+            break;
+        case Op::DAA: {
+            _result = _a;
+            uint8_t LSN = _result & 0x0f;
+            uint8_t MSN = (_result & 0xf0) >> 4;
+            
+            // LSN
+            if (cc().H || LSN > 9) {
+                _result += 6;
+            }
+            
+            // MSN. C is set by a carry but never cleared
+            bool carry = cc().C;
+            if (carry || (MSN > 9) || (MSN > 8 && LSN > 9)) {
+                _result += 0x60;
+            }
+            xNZ0C8();
+            if (carry) {
+                cc().C = true;
+            }
+            _a = _result;
+            break;
+        }
+        case Op::DEC:
+            _result = _left - 1;
+            xNZxx8();
+            cc().V = _left == 0x80;
+            break;
+        case Op::EOR:
+            _result = _left ^ _right;
+            xNZ0x8();
+            break;
+        case Op::EXG: {
+            uint16_t r1 = getReg(Reg(_right & 0xf));
+            uint16_t r2 = getReg(Reg(_right >> 4));
+            setReg(Reg(_right & 0xf), r2);
+            setReg(Reg(_right >> 4), r1);
+            break;
+        }
+        case Op::INC:
+            _result = _left + 1;
+            xNZxx8();
+            cc().V = _left == 0x7f;
+            break;
+        case Op::JMP:
+        case Op::JSR:
+            if (ea >= SystemAddrStart) {
+                // System call. It runs natively and nothing is pushed, so
+                // its args are at S
+                if (!_boss9->call(Func(ea))) {
+                    return false;
                 }
-                break;
-            case Adr::Indexed: {
-                uint8_t postbyte = next8();
-                uint16_t* reg = nullptr;
-                
-                // Load value of RR reg in ea
-                switch (RR(postbyte & 0b01100000)) {
-                    case RR::X: reg = &_x; break;
-                    case RR::Y: reg = &_y; break;
-                    case RR::U: reg = &_u; break;
-                    case RR::S: reg = &_s; break;
+            } else {
+                if (op == Op::JSR) {
+                    push16(_s, _pc);
+                    _subroutineDepth += 1;
                 }
-                
-                if ((postbyte & 0x80) == 0) {
-                    // Constant offset direct (5 bit signed)
-                    AddCy(1);
-                
-                    int8_t offset = postbyte & 0x1f;
-                    if (offset & 0x10) {
-                        offset |= 0xe0;
-                    }
-                    
-                    ea = *reg + offset;
-                } else {
-                    switch(IdxMode(postbyte & IdxModeMask)) {
-                        case IdxMode::ConstRegNoOff   : ea = *reg; break;
-                        case IdxMode::ConstReg8Off    : ea = *reg + int8_t(load8(_pc)); _pc += 1; AddCy(1); break;
-                        case IdxMode::ConstReg16Off   : ea = *reg + int16_t(load16(_pc)); _pc += 2; AddCy(4); break;
-                        case IdxMode::AccAOffReg      : ea = *reg + int8_t(_a); AddCy(1); break;
-                        case IdxMode::AccBOffReg      : ea = *reg + int8_t(_b); AddCy(1); break;
-                        case IdxMode::AccDOffReg      : ea = *reg + int16_t(_d); AddCy(4); break;
-                        case IdxMode::Inc1Reg         : ea = *reg; (*reg) += 1; AddCy(2); break;
-                        case IdxMode::Inc2Reg         : ea = *reg; (*reg) += 2; AddCy(3); break;
-                        case IdxMode::Dec1Reg         : (*reg) -= 1; ea = *reg; AddCy(2); break;
-                        case IdxMode::Dec2Reg         : (*reg) -= 2; ea = *reg; AddCy(3); break;
-                        case IdxMode::ConstPC8Off     : ea = _pc + int8_t(load8(_pc)); _pc += 1; AddCy(1); break;
-                        case IdxMode::ConstPC16Off    : ea = _pc + int16_t(load16(_pc)); _pc += 2; AddCy(5); break;
-                        case IdxMode::Extended        : ea = next16(); AddCy(5); break;
-                    }
-                    
-                    if (postbyte & IndexedIndMask) {
-                        // indirect from ea
-                        ea = load16(ea);
+                _pc = ea;
+            }
+            break;
+        case Op::LD8:
+            _result = _right;
+            xNZ0x8();
+            break;
+        case Op::LD16:
+            _result = _right;
+            xNZ0x16();
+            break;
+        case Op::LEA:
+            _result = ea;
+            if (opcode->reg == Reg::X || opcode->reg == Reg::Y) {
+                cc().Z = _result == 0;
+            }
+            break;
+        case Op::LSR:
+            _result = _left >> 1;
+            x0Zxx8();
+            cc().C = _left & 0x01;
+            break;
+        case Op::MUL:
+            _d = _a * _b;
+            cc().Z = _d == 0;
+            cc().C = _b & 0x80;
+            break;
+        case Op::NEG:
+            _result = -_left;
+            xNZxC8();
+            cc().V = _left == 0x80;
+            break;
+        case Op::NOP:
+            break;
+        case Op::OR:
+            _result = _left | _right;
+            xNZ0x8();
+            break;
+        case Op::ORCC:
+            ccByte() |= _right;
+            break;
+        case Op::PSH:
+        case Op::PUL: {
+            // bit pattern to push or pull are in _right
+            uint16_t& stack = (opcode->reg == Reg::U) ? _u : _s;
+            if (opcode->op == Op::PSH) {
+                if (_right & 0x80) push16(stack, _pc);
+                if (_right & 0x40) push16(stack, (opcode->reg == Reg::U) ? _s : _u);
+                if (_right & 0x20) push16(stack, _y);
+                if (_right & 0x10) push16(stack, _x);
+                if (_right & 0x08) push8(stack, _dp);
+                if (_right & 0x04) push8(stack, _b);
+                if (_right & 0x02) push8(stack, _a);
+                if (_right & 0x01) push8(stack, ccByte());
+            } else {
+                if (_right & 0x01) ccByte() = pop8(stack);
+                if (_right & 0x02) _a = pop8(stack);
+                if (_right & 0x04) _b = pop8(stack);
+                if (_right & 0x08) _dp = pop8(stack);
+                if (_right & 0x10) _x = pop16(stack);
+                if (_right & 0x20) _y = pop16(stack);
+                if (_right & 0x40) {
+                    if (opcode->reg == Reg::U) {
+                        _s = pop16(stack);
+                    } else {
+                        _u = pop16(stack);
                     }
                 }
-                    
-                break;
+                if (_right & 0x80) _pc = pop16(stack);
             }
+            break;
         }
-        
-        // Get left operand
-        if (opcode->left == Left::Ld || opcode->left == Left::LdSt) {
-            if (opcode->reg == Reg::M8) {
-                _left = load8(ea);
-            } else if (opcode->reg == Reg::M16) {
-                _left = load16(ea);
+        case Op::ROL:
+            _result = _left << 1;
+            if (cc().C) {
+                _result |= 0x01;
+            }
+            xNZxx8();
+            cc().V = (((_left & 0x40) >> 6) ^ ((_left & 0x80) >> 7)) != 0;
+            cc().C = _left & 0x80;
+            break;
+        case Op::ROR:
+            _result = _left >> 1;
+            if (cc().C) {
+                _result |= 0x80;
+            }
+            xNZxx8();
+            cc().C = _left & 0x01;
+            break;
+        case Op::RTI:
+            ccByte() = pop8(_s);
+            if (cc().E) {
+                _a = pop8(_s);
+                _b = pop8(_s);
+                _dp = pop8(_s);
+                _x = pop16(_s);
+                _y = pop16(_s);
+                _u = pop16(_s);
+            }
+            _pc = pop16(_s);
+            break;
+        case Op::RTS:
+            _pc = pop16(_s);
+            _subroutineDepth -= 1;
+            if (_lastRunState != RunState::Running && _subroutineDepth == 0) {
+                _boss9->printF("\n*** step %s, stopped at addr $%04x\n\n",
+                        (_lastRunState == RunState::StepOver) ? "over" : "out", _pc);
+                // enter the monitor
+                _boss9->call(Func::mon);
+                return false;
+            }
+            break;
+        case Op::SBC:
+            _result = _left - _right - (flagC() ? 1 : 0);
+            xNZVC8();
+            break;
+        case Op::SEX:
+            // N and Z of D are the same as those of B
+            _a = (_b & 0x80) ? 0xff : 0;
+            _result = _b;
+            xNZxx8();
+            break;
+        case Op::ST8:
+            _result = _left;
+            xNZ0x8();
+            break;
+        case Op::ST16: // All done in pre and post processing
+            _result = _left;
+            xNZ0x16();
+            break;
+        case Op::SWI:
+            pushEntireState();
+            cc().I = true;
+            cc().F = true;
+            if (page == Op::Page3) {
+                _pc = load16(0xfff2);
+            } else if (page == Op::Page2) {
+                _pc = load16(0xfff4);
             } else {
-                _left = getReg(opcode->reg);
+                _pc = load16(0xfffa);
             }
+            break;
+        case Op::SYNC:
+            _wait = Wait::Sync;
+            if (!waitForInterrupt()) {
+                return false;
+            }
+            break;
+        case Op::TFR:
+            setReg(Reg(_right & 0xf), getReg(Reg(_right >> 4)));
+            break;
+        case Op::TST:
+            _result = _left - 0;
+            xNZ0x8();
+            break;
+        case Op::FIRQ:
+        case Op::IRQ:
+        case Op::NMI:
+            // Interrupts are delivered by the scheduler, not decoded
+            break;
+        case Op::RESTART:
+            // Now what?
+            break;
+    }
+    
+    // Store _result
+    if (opcode->right == Right::St8) {
+        store8(ea, _left);
+    } else if (opcode->right == Right::St16) {
+        store16(ea, _left);
+    } else if (opcode->left == Left::St || opcode->left == Left::LdSt) {
+        if (opcode->right == Right::St8 || opcode->reg == Reg::M8) {
+            store8(ea, _result);
+        } else if (opcode->right == Right::St16 || opcode->reg == Reg::M16) {
+            store16(ea, _result);
+        } else {
+            setReg(reg, _result);
         }
-        
-        // Get right operand
-        if (opcode->right == Right::Ld8) {
-            _right = load8(ea);
-        } else if (opcode->right == Right::Ld16) {
-            _right = load16(ea);
-        }
-                
-        // Perform operation
-        Op op = opcode->op;
-        
-        switch(op) {
-            case Op::ILL:
-                _error = Error::Illegal;
-                _boss9->call(Func::mon);
-                return true;
-            case Op::Page2:
-            case Op::Page3:
-                // We never want to leave execution after a Page2 or Page3.
-                // Do a continue to skip leave test.
-                AddCy(1);
-                _prevOp = op;
-                continue;
-
-            case Op::BHS:
-            case Op::BCC: if (!_cc.C) _pc += _right;                SBT; break;
-            case Op::BLO:
-            case Op::BCS: if (_cc.C) _pc += _right;                 SBT; break;
-            case Op::BEQ: if (_cc.Z) _pc += _right;                 SBT; break;
-            case Op::BGE: if (!NxorV()) _pc += _right;              SBT; break;
-            case Op::BGT: if (!(NxorV() || _cc.Z)) _pc += _right;   SBT; break;
-            case Op::BHI: if (!_cc.C && !_cc.Z) _pc += _right;      SBT; break;
-            case Op::BLE: if (NxorV() || _cc.Z) _pc += _right;      SBT; break;
-            case Op::BLS: if (_cc.C || _cc.Z) _pc += _right;        SBT; break;
-            case Op::BLT: if (NxorV()) _pc += _right;               SBT; break;
-            case Op::BMI: if (_cc.N) _pc += _right;                 SBT; break;
-            case Op::BNE: if (!_cc.Z) _pc += _right;                SBT; break;
-            case Op::BPL: if (!_cc.N) _pc += _right;                SBT; break;
-            case Op::BRA: _pc += _right;                            SBT; break;
-            case Op::BRN: break;
-            case Op::BVC: if (!_cc.V) _pc += _right;                SBT; break;
-            case Op::BVS: if (_cc.V) _pc += _right;                 SBT; break;
-            case Op::BSR:
-                push16(_s, _pc);
-                _pc += _right;
-                _subroutineDepth += 1;
-                break;
+    }
+    return true;
+}
 
-            case Op::ABX:
-                _x = _x + uint16_t(_b);
-                break;
-            case Op::ADC:
-                _result = _left + _right + (_cc.C ? 1 : 0);
-                HNZVC8();
-                break;
-            case Op::ADD8:
-                _result = _left + _right;
-                HNZVC8();
-                break;
-            case Op::ADD16:
-                _result = _left + _right;
-                xNZVC16();
-                break;
-            case Op::AND:
-                _result = _left & _right;
-                xNZ0x8();
-                break;
-            case Op::ANDCC:
-                _ccByte &= _right;
-                break;
-            case Op::ASL:
-                _result = _left << 1;
-                xNZxx8();
-                _cc.V = (((_left & 0x40) >> 6) ^ ((_left & 0x80) >> 7)) != 0;
-                _cc.C = _left & 0x80;
-                break;
-            case Op::ASR:
-                _result = _left >> 1;
-                if (_left & 0x80) {
-                    _result |= 0x80;
-                }
-                xNZxx8();
-                _cc.C = _left & 0x01;
-                break;
-            case Op::BIT:
-                _result = _left ^ _right;
-                xNZ0x8();
-                break;
-            case Op::CLR:
-                _result = 0;
-                _cc.N = false;
-                _cc.Z = true;
-                _cc.V = false;
-                _cc.C = false;
-                break;
-            case Op::CMP8:
-            case Op::SUB8:
-                _result = _left - _right;
-                xNZVC8();
-                break;
-            case Op::CMP16:
-            case Op::SUB16:
-                _result = _left - _right;
-                xNZVC16();
-                
-                // We need to do setReg here because if we're on an altPage these
-                // are actually CMP16 and not SUB16
-                if (_prevOp != Op::Page2 && _prevOp != Op::Page3 && opcode->op == Op::SUB16) {
-                    setReg(opcode->reg, _result);
-                }
-                break;
-            case Op::COM:
-                _result = ~_left;
-                xNZ018();
-                break;
-            case Op::CWAI:
-                _ccByte ^= _right;
-                _cc.E = true;
-                push16(_s, _pc);
-                push16(_s, _u);
-                push16(_s, _y);
-                push16(_s, _x);
-                push8(_s, _dp);
-                push8(_s, _b);
-                push8(_s, _a);
-                
-                // Now what?
-                break;
-            case Op::DAA: {
-                _result = _a;
-                uint8_t LSN = _result & 0x0f;
-                uint8_t MSN = (_result & 0xf0) >> 4;
-                
-                // LSN
-                if (_cc.H || LSN > 9) {
-                    _result += 6;
-                }
+void Emulator::decodeInst(uint16_t addr, DecodedInst& inst) const
+{
+    inst.addr = addr;
+    inst.operand = 0;
+    inst.page = Op::NOP;
+    
+    uint8_t opIndex = fetch8(addr++);
+    const Opcode* opcode = &(opcodeTable[opIndex]);
+    uint8_t cycles = 0;
+    
+    // A run of prefixes is handled by returning each one but the last as
+    // its own instruction. The last one is the one that takes effect.
+    Op op = opcode->op;
+    if ((op == Op::Page2 || op == Op::Page3) && fetch8(addr) != 0x10 && fetch8(addr) != 0x11) {
+        inst.page = op;
+        cycles += 1;
+        opIndex = fetch8(addr++);
+        opcode = &(opcodeTable[opIndex]);
+    }
+    
+    cycles += opcode->cycles;
+    
+    switch(opcode->adr) {
+        case Adr::None:
+        case Adr::Inherent:
+            break;
+        case Adr::Direct:
+            inst.operand = fetch8(addr);
+            addr += 1;
+            break;
+        case Adr::Immed8:
+            inst.operand = fetch8(addr);
+            addr += 1;
+            break;
+        case Adr::Extended:
+            inst.operand = fetch16(addr);
+            addr += 2;
+            break;
+        case Adr::Immed16:
+            inst.operand = fetch16(addr);
+            addr += 2;
+            break;
+        case Adr::RelL:
+            cycles += 2;
+            inst.operand = fetch16(addr);
+            addr += 2;
+            break;
+        case Adr::Rel:
+            inst.operand = int8_t(fetch8(addr));
+            addr += 1;
+            break;
+        case Adr::RelP:
+            if (inst.page == Op::Page2) {
+                cycles += 2;
+                inst.operand = fetch16(addr);
+                addr += 2;
+            } else {
+                inst.operand = int8_t(fetch8(addr));
+                addr += 1;
+            }
+            break;
+        case Adr::Indexed: {
+            uint8_t postbyte = fetch8(addr++);
+            uint8_t rr = postbyte & 0b01100000;
+            
+            if ((postbyte & 0x80) == 0) {
+                // Constant offset direct (5 bit signed)
+                cycles += 1;
                 
-                // MSN
-                if (_cc.C || (MSN > 9) || (MSN > 8 && LSN > 9)) {
-                    _result += 0x60;
+                int8_t offset = postbyte & 0x1f;
+                if (offset & 0x10) {
+                    offset |= 0xe0;
                 }
-                xNZ0C8();
-                _a = _result;
+                inst.operand = offset;
+                inst.ea = indexedEATable[rr | uint8_t(IdxMode::ConstReg8Off)];
                 break;
             }
-            case Op::DEC:
-                _result = _left - 1;
-                xNZxx8();
-                _cc.V = _left == 0x80;
-                break;
-            case Op::EOR:
-                _result = _left ^ _right;
-                xNZ0x8();
-                break;
-            case Op::EXG: {
-                uint16_t r1 = getReg(Reg(_right & 0xf));
-                uint16_t r2 = getReg(Reg(_right >> 4));
-                setReg(Reg(_right & 0xf), r2);
-                setReg(Reg(_right >> 4), r1);
-                break;
+            
+            IdxMode mode = IdxMode(postbyte & IdxModeMask);
+            switch(mode) {
+                case IdxMode::ConstRegNoOff   : break;
+                case IdxMode::ConstReg8Off    : inst.operand = int8_t(fetch8(addr)); addr += 1; cycles += 1; break;
+                case IdxMode::ConstReg16Off   : inst.operand = fetch16(addr); addr += 2; cycles += 4; break;
+                case IdxMode::AccAOffReg      : cycles += 1; break;
+                case IdxMode::AccBOffReg      : cycles += 1; break;
+                case IdxMode::AccDOffReg      : cycles += 4; break;
+                case IdxMode::Inc1Reg         : cycles += 2; break;
+                case IdxMode::Inc2Reg         : cycles += 3; break;
+                case IdxMode::Dec1Reg         : cycles += 2; break;
+                case IdxMode::Dec2Reg         : cycles += 3; break;
+                case IdxMode::ConstPC8Off     :
+                    // Relative to the end of the instruction
+                    inst.operand = addr + 1 + int8_t(fetch8(addr));
+                    addr += 1;
+                    cycles += 1;
+                    mode = IdxMode::Extended;
+                    break;
+                case IdxMode::ConstPC16Off    :
+                    inst.operand = addr + 2 + int16_t(fetch16(addr));
+                    addr += 2;
+                    cycles += 5;
+                    mode = IdxMode::Extended;
+                    break;
+                case IdxMode::Extended        : inst.operand = fetch16(addr); addr += 2; cycles += 5; break;
+                default                       : mode = IdxMode::Extended; break;
             }
-            case Op::INC:
-                _result = _left + 1;
-                xNZxx8();
-                _cc.V = _left == 0x7f;
+            
+            inst.ea = indexedEATable[rr | (postbyte & IndexedIndMask) | uint8_t(mode)];
+            break;
+        }
+    }
+
+    // The bit pattern of registers to push or pull is known here
+    if (opcode->op == Op::PSH || opcode->op == Op::PUL) {
+        cycles += countBits(inst.operand);
+    }
+
+    inst.opcode = *opcode;
+    inst.exec = execTable[execIndex(inst.page, opIndex)];
+    inst.size = addr - inst.addr;
+    inst.cycles = cycles;
+}
+
+inline const DecodedInst& Emulator::fetchInst(uint16_t addr)
+{
+#ifdef DECODE_CACHE
+    DecodedInst& inst = _decodeCache[addr & (DecodeCacheSize - 1)];
+    if (inst.addr != addr) {
+        decodeInst(addr, inst);
+        for (uint8_t i = 0; i < inst.size; ++i) {
+            setCode(addr + i);
+        }
+    }
+    return inst;
+#else
+    decodeInst(addr, _inst);
+    return _inst;
+#endif
+}
+
+bool Emulator::setEngine(Engine engine)
+{
+#ifdef DECODE_CACHE
+    if (engine == Engine::Threaded && !_blocks) {
+        _blocks = new Block[BlockCacheSize];
+    }
+    _engine = engine;
+    return true;
+#else
+    return engine == Engine::Interpreter;
+#endif
+}
+
+#ifdef DECODE_CACHE
+void Emulator::flushBlocks()
+{
+    if (!_blocks) {
+        return;
+    }
+    
+    // Setting count to 0 also stops executeBlocks from running the rest
+    // of a block which has just been overwritten
+    for (uint32_t i = 0; i < BlockCacheSize; ++i) {
+        _blocks[i].count = 0;
+    }
+}
+
+void Emulator::flushBlocks(uint16_t addr, uint16_t size)
+{
+    if (!_blocks) {
+        return;
+    }
+    
+    // Blocks aren't indexed by the bytes they cover, so check them all
+    for (uint32_t i = 0; i < BlockCacheSize; ++i) {
+        Block& block = _blocks[i];
+        if (block.count != 0 && (uint16_t(addr - block.addr) < block.size || uint16_t(block.addr - addr) < size)) {
+            block.count = 0;
+        }
+    }
+}
+
+Block* Emulator::findBlock(uint16_t addr)
+{
+    Block* block = &_blocks[addr & (BlockCacheSize - 1)];
+    if (block->count == 0 || block->addr != addr) {
+        translateBlock(addr, *block);
+    }
+    return block;
+}
+
+void Emulator::translateBlock(uint16_t addr, Block& block)
+{
+    block.addr = addr;
+    block.count = 0;
+    block.chain[0] = block.chain[1] = nullptr;
+    block.chainAddr[0] = block.chainAddr[1] = addr;
+    
+    bool end = false;
+    while (!end && block.count < MaxBlockInsts) {
+        DecodedInst& inst = block.insts[block.count++];
+        decodeInst(addr, inst);
+        for (uint8_t i = 0; i < inst.size; ++i) {
+            setCode(addr + i);
+        }
+        addr += inst.size;
+        
+        // Anything that can change the PC ends the block. JMP and JSR
+        // also end it because they might be a system call.
+        Op op = inst.opcode.op;
+        Adr adr = inst.opcode.adr;
+        end = true;
+        switch(op) {
+            case Op::BSR:
+            case Op::BRA:
+                block.chainAddr[0] = addr + inst.operand;
                 break;
             case Op::JMP:
             case Op::JSR:
-                if (ea >= SystemAddrStart) {
-                    // This is possibly a system call. Push a dummy self and 
-                    // retaddr then fixup U to keep the stack straight for args
-                    push16(_s, 0);
-                    push16(_s, 0);
-                    push16(_s, _u);
-                    _u = _s;
-                    if (!_boss9->call(Func(ea))) {
-                        pop16(_s);
-                        pop16(_s);
-                        return true;
-                    }
-                    _u = pop16(_s);
-                    pop16(_s);
-                    pop16(_s);
-                } else {
-                    if (op == Op::JSR) {
-                        push16(_s, _pc);
-                        _subroutineDepth += 1;
-                    }
-                    _pc = ea;
-                }
-                break;
-            case Op::LD8:
-                _result = _right;
-                xNZ0x8();
-                break;
-            case Op::LD16:
-                _result = _right;
-                xNZ0x16();
-                break;
-            case Op::LEA:
-                _result = ea;
-                if (opcode->reg == Reg::X || opcode->reg == Reg::Y) {
-                    _cc.Z = _result == 0;
+                if (adr == Adr::Extended && inst.operand < SystemAddrStart) {
+                    block.chainAddr[0] = inst.operand;
                 }
                 break;
-            case Op::LSR:
-                _result = _left >> 1;
-                x0Zxx8();
-                _cc.C = _left & 0x01;
-                break;
-            case Op::MUL:
-                _d = _a * _b;
-                _cc.Z = _d == 0;
-                _cc.C = _b & 0x80;
-                break;
-            case Op::NEG:
-                _result = -_left;
-                xNZxC8();
-                _cc.V = _left == 0x80;
-                break;
-            case Op::NOP:
+            case Op::RTS:
+            case Op::RTI:
+            case Op::SWI:
+            case Op::CWAI:
+            case Op::SYNC:
+            case Op::ILL:
                 break;
-            case Op::OR:
-                _result = _left | _right;
-                xNZ0x8();
+            case Op::PUL:
+                end = (inst.operand & 0x80) != 0;
                 break;
-            case Op::ORCC:
-                _ccByte |= _right;
+            case Op::TFR:
+            case Op::EXG:
+                end = Reg(inst.operand & 0x0f) == Reg::PC || Reg(inst.operand >> 4) == Reg::PC;
                 break;
-            case Op::PSH:
-            case Op::PUL: {
-                AddCy(countBits(_right));
-
-                // bit pattern to push or pull are in _right
-                uint16_t& stack = (opcode->reg == Reg::U) ? _u : _s;
-                if (opcode->op == Op::PSH) {
-                    if (_right & 0x80) push16(stack, _pc);
-                    if (_right & 0x40) push16(stack, (opcode->reg == Reg::U) ? _s : _u);
-                    if (_right & 0x20) push16(stack, _y);
-                    if (_right & 0x10) push16(stack, _x);
-                    if (_right & 0x08) push8(stack, _dp);
-                    if (_right & 0x04) push8(stack, _b);
-                    if (_right & 0x02) push8(stack, _a);
-                    if (_right & 0x01) push8(stack, _ccByte);
+            default:
+                if (adr == Adr::Rel || adr == Adr::RelL || adr == Adr::RelP) {
+                    // Conditional branch
+                    block.chainAddr[0] = addr + inst.operand;
+                    block.chainAddr[1] = addr;
                 } else {
-                    if (_right & 0x01) _ccByte = pop8(stack);
-                    if (_right & 0x02) _a = pop8(stack);
-                    if (_right & 0x04) _b = pop8(stack);
-                    if (_right & 0x08) _dp = pop8(stack);
-                    if (_right & 0x10) _x = pop16(stack);
-                    if (_right & 0x20) _y = pop16(stack);
-                    if (_right & 0x40) {
-                        if (opcode->reg == Reg::U) {
-                            _s = pop16(stack);
-                        } else {
-                            _u = pop16(stack);
-                        }
-                    }
-                    if (_right & 0x80) _pc = pop16(stack);
+                    end = false;
                 }
                 break;
-            }
-            case Op::ROL:
-                _result = _left << 1;
-                if (_cc.C) {
-                    _result |= 0x01;
+        }
+    }
+    
+    block.size = addr - block.addr;
+    
+    // A block cut off at MaxBlockInsts falls through to the next one
+    if (!end) {
+        block.chainAddr[0] = addr;
+    }
+}
+
+template<typename P>
+bool Emulator::executeBlocks()
+{
+    _countCycles = P::Cycles;
+    SliceCount slice(*this);
+    Block* block = findBlock(_pc);
+    
+    while (true) {
+        // Stop exactly at the end of the slice, even in the middle of a block,
+        // so the Threaded and Interpreter engines always end up in the same
+        // place. block->count is checked each time through in case a store
+        // flushed the blocks.
+        uint32_t count = block->count;
+        if (count > slice.left) {
+            count = slice.left;
+        }
+        
+        uint8_t i = 0;
+        for ( ; i < count && i < block->count; ++i) {
+            // An interrupt leaves the rest of the block
+            if (eventDue()) {
+                if (deadlineReached()) {
+                    slice.left -= i;
+                    return true;
                 }
-                xNZxx8();
-                _cc.V = (((_left & 0x40) >> 6) ^ ((_left & 0x80) >> 7)) != 0;
-                _cc.C = _left & 0x80;
-                break;
-            case Op::ROR:
-                _result = _left >> 1;
-                if (_cc.C) {
-                    _result |= 0x80;
+                if (serviceEvents()) {
+                    break;
                 }
-                xNZxx8();
-                _cc.C = _left & 0x01;
-                break;
-            case Op::RTI:
-                if (_cc.E) {
-                    _a = pop8(_s);
-                    _b = pop8(_s);
-                    _dp = pop8(_s);
-                    _x = pop16(_s);
-                    _y = pop16(_s);
-                    _u = pop16(_s);
+            }
+            const DecodedInst& inst = block->insts[i];
+            if constexpr (P::Trace) {
+                trace();
+            }
+            uint16_t pc = _pc;
+            _pc += inst.size;
+            if constexpr (P::Cycles) {
+                _cycles += inst.cycles;
+            }
+            
+            uint16_t ea = 0;
+            if (!inst.exec(*this, inst, ea)) {
+                slice.left -= i;
+                return true;
+            }
+            
+#ifdef TRACER
+            if constexpr (P::Trace) {
+                if (_tracer) {
+                    traceInst(inst, pc, ea);
+                }
+            }
+#endif
+        }
+        
+        slice.left -= i;
+        if (slice.left == 0) {
+            return true;
+        }
+        
+        // Follow the chain if we went where expected, otherwise look up
+        // the next block and chain to it if it's one of the expected places
+        Block* next = nullptr;
+        for (uint8_t c = 0; c < 2; ++c) {
+            if (block->chainAddr[c] == _pc) {
+                next = block->chain[c];
+                if (!next || next->count == 0 || next->addr != _pc) {
+                    next = findBlock(_pc);
+                    block->chain[c] = next;
                 }
-                _pc = pop16(_s);
                 break;
-            case Op::RTS:
-                _pc = pop16(_s);
-                _subroutineDepth -= 1;
-                if (_lastRunState != RunState::Running && _subroutineDepth == 0) {
-                    _boss9->printF("\n*** step %s, stopped at addr $%04x\n\n",
-                            (_lastRunState == RunState::StepOver) ? "over" : "out", _pc);
-                    // enter the monitor
+            }
+        }
+        if (!next) {
+            next = findBlock(_pc);
+        }
+        block = next;
+    }
+}
+#endif
+
+#ifdef PROFILER
+void Emulator::profile(const DecodedInst& inst, uint16_t pc, uint16_t s, uint32_t cycles)
+{
+    _profiler->count(pc, cycles);
+    
+    // A JSR to a system call runs natively and leaves S where it was, so
+    // only count a call if the return address was pushed. PULS PC is a
+    // return.
+    switch (inst.opcode.op) {
+        case Op::BSR:
+        case Op::JSR:
+        case Op::SWI:
+            if (_s < s) {
+                _profiler->call(_pc);
+            }
+            break;
+        case Op::RTS:
+        case Op::RTI:
+            _profiler->ret();
+            break;
+        case Op::PUL:
+            if ((inst.operand & 0x80) && inst.opcode.reg == Reg::S) {
+                _profiler->ret();
+            }
+            break;
+        default:
+            break;
+    }
+}
+#endif
+
+#ifdef TRACER
+void Emulator::traceInst(const DecodedInst& inst, uint16_t pc, uint16_t ea)
+{
+    TraceRecord& r = _tracer->next();
+    r.cycles = _cycles;
+    r.pc = pc;
+    r.ea = ea;
+    r.x = _x;
+    r.y = _y;
+    r.u = _u;
+    r.s = _s;
+    r.a = _a;
+    r.b = _b;
+    r.dp = _dp;
+    r.cc = ccValue();
+    r.size = inst.size;
+    for (uint8_t i = 0; i < inst.size; ++i) {
+        r.bytes[i] = fetch8(pc + i);
+    }
+    
+    // Only read memory directly so devices don't see extra reads
+    const uint8_t* page0 = _pageMap[ea >> 8].read;
+    const uint8_t* page1 = _pageMap[uint16_t(ea + 1) >> 8].read;
+    r.mem[0] = page0 ? page0[ea & 0xff] : 0;
+    r.mem[1] = page1 ? page1[(ea + 1) & 0xff] : 0;
+    _tracer->commit();
+}
+#endif
+
+bool Emulator::execute(RunState runState)
+{
+    // Still in SYNC or CWAI from the last slice
+    if (_wait != Wait::None && !waitForInterrupt()) {
+        return true;
+    }
+    
+    // Breakpoints and stepping need the interpreter and a policy that
+    // handles them
+    bool debugging = runState != RunState::Running || _haveBreakpoints;
+#ifdef SNAPSHOTS
+    debugging = debugging || _history;
+#endif
+    
+#ifdef PROFILER
+    // Profiling follows every instruction, so it needs the interpreter
+    if (_profiler) {
+        return debugging ? executeLoop<ProfiledPolicy>(runState) : executeLoop<WithoutBreakpoints<ProfiledPolicy>>(runState);
+    }
+#endif
+
+#ifdef DECODE_CACHE
+    if (_engine == Engine::Threaded && !debugging) {
+        switch (_policy) {
+            case Policy::Throughput:    return executeBlocks<ThroughputPolicy>();
+            case Policy::Instrumented:  return executeBlocks<InstrumentedPolicy>();
+            case Policy::Traced:        return executeBlocks<TracedPolicy>();
+        }
+    }
+#endif
+    
+    // Otherwise the breakpoint checks are left out completely
+    switch (_policy) {
+        case Policy::Throughput:
+            return debugging ? executeLoop<InstrumentedPolicy>(runState) : executeLoop<ThroughputPolicy>(runState);
+        case Policy::Instrumented:
+            return debugging ? executeLoop<InstrumentedPolicy>(runState) : executeLoop<WithoutBreakpoints<InstrumentedPolicy>>(runState);
+        case Policy::Traced:
+            return debugging ? executeLoop<TracedPolicy>(runState) : executeLoop<WithoutBreakpoints<TracedPolicy>>(runState);
+    }
+    return true;
+}
+
+template<typename P>
+bool Emulator::executeLoop(RunState runState)
+{
+    bool isStepping = P::Breakpoints && runState != RunState::Running;
+    _countCycles = P::Cycles;
+    
+    // Reads for display in the monitor don't count
+    _watchHit = false;
+    
+    SliceCount slice(*this);
+    bool firstTime = true;
+    
+    while(true) {
+        if (eventDue()) {
+            if (deadlineReached()) {
+                return true;
+            }
+            serviceEvents();
+        }
+        
+        if (P::Breakpoints && _haveBreakpoints) {
+            // if runState is not Running we need to ignore a breakpoint at the
+            // PC upon entry. Continuing and all the stepping states need to
+            // execute the first instruction they encounter
+            if (!firstTime || runState == RunState::Running) {
+                if (atBreakpoint(_pc)) {
+                    _boss9->printF("\n*** hit breakpoint at addr $%04x\n\n", _pc);
                     _boss9->call(Func::mon);
                     return true;
                 }
-                break;
-            case Op::SBC:
-                _result = _left - _right - (_cc.C ? 1 : 0);
-                xNZVC8();
-                break;
-            case Op::SEX:
-                _a = (_b & 0x80) ? 0xff : 0;
-                xNZ0x8();
-                break;
-            case Op::ST8:
-                xNZ0x8();
-                break;
-            case Op::ST16: // All done in pre and post processing
-                xNZ0x16();
-                break;
-            case Op::SWI:
-                _cc.E = true;
-                push16(_s, _pc);
-                push16(_s, _u);
-                push16(_s, _y);
-                push16(_s, _x);
-                push8(_s, _dp);
-                push8(_s, _b);
-                push8(_s, _a);
-                _cc.I = true;
-                _cc.F = true;
-                if (_prevOp == Op::Page3) {
-                    _pc = load16(0xfff2);
-                } else if (_prevOp == Op::Page2) {
-                    _pc = load16(0xfff4);
-                } else {
-                    _pc = load16(0xfffa);
-                }
-                break;
-            case Op::SYNC:
-                // Now what?
-                break;
-            case Op::TFR:
-                setReg(Reg(_right & 0xf), getReg(Reg(_right >> 4)));
-                break;
-            case Op::TST:
-                _result = _left - 0;
-                xNZ0x8();
-                break;
-            case Op::FIRQ:
-            case Op::IRQ:
-            case Op::NMI:
-            case Op::RESTART:
-                // Now what?
-                break;
+            }
+            
+            firstTime = false;
         }
         
-        // Store _result
-        if (opcode->right == Right::St8) {
-            store8(ea, _left);
-        } else if (opcode->right == Right::St16) {
-            store16(ea, _left);
-        } else if (opcode->left == Left::St || opcode->left == Left::LdSt) {
-            if (opcode->right == Right::St8 || opcode->reg == Reg::M8) {
-                store8(ea, _result);
-            } else if (opcode->right == Right::St16 || opcode->reg == Reg::M16) {
-                store16(ea, _result);
-            } else {
-                setReg(opcode->reg, _result);
+#ifdef SNAPSHOTS
+        if constexpr (P::Breakpoints) {
+            if (_history) {
+                recordHistory();
             }
         }
+#endif
+        
+        if constexpr (P::Trace) {
+            trace();
+        }
+        
+        // Everything that depends only on the instruction bytes is done
+        // by the decoder. Here we just need to run its handler.
+        const DecodedInst& inst = fetchInst(_pc);
+        
+        // The profiler needs to know where the instruction started
+        uint16_t pc = _pc;
+        uint16_t s = _s;
+        uint32_t cycles = _cycles;
+        
+        _pc += inst.size;
+        
+        if constexpr (P::Cycles) {
+            _cycles += inst.cycles;
+        }
         
-        _prevOp = opcode->op;
+        uint16_t ea = 0;
+        if (!inst.exec(*this, inst, ea)) {
+            return true;
+        }
+        
+        slice.left -= 1;
+        _prevOp = inst.opcode.op;
+        
+#ifdef PROFILER
+        if constexpr (P::Profile) {
+            profile(inst, pc, s, _cycles - cycles);
+        }
+#endif
+
+#ifdef TRACER
+        if constexpr (P::Trace) {
+            if (_tracer) {
+                traceInst(inst, pc, ea);
+            }
+        }
+#endif
+        
+        if (P::Breakpoints && _watchHit) {
+            _watchHit = false;
+            _boss9->printF("\n*** hit watchpoint at addr $%04x, stopped at addr $%04x\n\n", _watchAddr, _pc);
+            _boss9->call(Func::mon);
+            return true;
+        }
         
         if (isStepping) {
             // Step handling
@@ -914,9 +1481,587 @@ bool Emulator::execute(RunState runState)
             runState = RunState::Running;
         }
         
-        if (--instructionsToExecute == 0) {
+        if (slice.left == 0) {
+            return true;
+        }
+    }
+}
+
+void Emulator::mapDefault(uint32_t size)
+{
+    // RAM from 0, except the system area which is ROM. Anything past the
+    // end of ram is unmapped.
+    uint16_t ramPages = size / 256;
+    uint8_t systemPage = SystemAddrStart >> 8;
+    
+    unmap(0, NumPages);
+    mapRAM(0, (ramPages < systemPage) ? ramPages : systemPage, _ram);
+    if (ramPages > systemPage) {
+        mapROM(systemPage, ramPages - systemPage, _ram + SystemAddrStart);
+    }
+}
+
+void Emulator::mapRAM(uint8_t firstPage, uint16_t numPages, uint8_t* mem)
+{
+    mapPages(firstPage, numPages, mem, mem, nullptr);
+}
+
+void Emulator::mapROM(uint8_t firstPage, uint16_t numPages, const uint8_t* mem)
+{
+    mapPages(firstPage, numPages, mem, nullptr, nullptr);
+}
+
+void Emulator::mapDevice(uint8_t firstPage, uint16_t numPages, Device* device)
+{
+    mapPages(firstPage, numPages, nullptr, nullptr, device);
+}
+
+void Emulator::unmap(uint8_t firstPage, uint16_t numPages)
+{
+    mapPages(firstPage, numPages, nullptr, nullptr, nullptr);
+}
+
+void Emulator::mapPages(uint8_t firstPage, uint16_t numPages, const uint8_t* readMem, uint8_t* writeMem, Device* device)
+{
+    for (uint16_t i = 0; i < numPages && firstPage + i < NumPages; ++i) {
+        PageMapping& page = _pageMap[firstPage + i];
+        page.read = readMem ? (readMem + i * 256) : nullptr;
+        page.write = writeMem ? (writeMem + i * 256) : nullptr;
+        page.device = device;
+        updatePage(firstPage + i);
+    }
+    
+    // Code in these pages has changed
+    invalidateDecodeCache();
+}
+
+void Emulator::updatePage(uint8_t page)
+{
+    // Watched pages go through the slow path, and so do writes to pages
+    // not yet written since the last snapshot
+    bool protect = _watchWrites[page];
+#ifdef SNAPSHOTS
+    protect = protect || (_trackDirty && !_dirtyPages[page]) || _history;
+#endif
+    _readPages[page] = _watchReads[page] ? nullptr : _pageMap[page].read;
+    _writePages[page] = protect ? nullptr : _pageMap[page].write;
+}
+
+uint8_t Emulator::loadSlow(uint16_t ea)
+{
+    if (_watchReads[ea >> 8] && breakpointHit(ea, BPType::Read)) {
+        _watchHit = true;
+        _watchAddr = ea;
+    }
+    return fetch8(ea);
+}
+
+void Emulator::storeSlow(uint16_t ea, uint8_t v)
+{
+    if (_watchWrites[ea >> 8] && breakpointHit(ea, BPType::Write)) {
+        _watchHit = true;
+        _watchAddr = ea;
+    }
+    
+    const PageMapping& page = _pageMap[ea >> 8];
+    if (page.write) {
+#ifdef SNAPSHOTS
+        markDirty(ea, 1);
+        if (_history) {
+            _history->addWrite(ea, page.write[ea & 0xff], v);
+        }
+#endif
+        page.write[ea & 0xff] = v;
+        invalidateCode(ea, 1);
+    } else if (page.device) {
+        page.device->write(ea, v);
+    } else if (page.read) {
+        readOnlyAddr(ea);
+    }
+}
+
+Emulator::~Emulator()
+{
+#ifdef DECODE_CACHE
+    delete [ ] _blocks;
+#endif
+#ifdef SNAPSHOTS
+    delete _history;
+#endif
+}
+
+#ifdef SNAPSHOTS
+void Emulator::markDirty(uint16_t addr, uint32_t size)
+{
+    if (!_trackDirty || size == 0) {
+        return;
+    }
+    
+    uint32_t last = (uint32_t(addr) + size - 1) >> 8;
+    for (uint32_t page = addr >> 8; page <= last; ++page) {
+        uint8_t p = uint8_t(page);
+        if (!_dirtyPages[p]) {
+            _dirtyPages[p] = true;
+            updatePage(p);
+        }
+    }
+}
+
+void Emulator::takeSnapshot(Snapshot& snapshot)
+{
+    snapshot._d = _d;
+    snapshot._x = _x;
+    snapshot._y = _y;
+    snapshot._u = _u;
+    snapshot._s = _s;
+    snapshot._pc = _pc;
+    snapshot._dp = _dp;
+    snapshot._cc = ccValue();
+    snapshot._cycles = _cycles;
+    snapshot._prevOp = _prevOp;
+    snapshot._subroutineDepth = _subroutineDepth;
+    snapshot._breakpoints = _breakpoints;
+    memcpy(snapshot._timers, _timers, sizeof(_timers));
+    snapshot._numTimers = _numTimers;
+    snapshot._wait = uint8_t(_wait);
+    snapshot._irq = _irq;
+    snapshot._firq = _firq;
+    snapshot._nmi = _nmi;
+    snapshot._nmiPending = _nmiPending;
+    memcpy(snapshot._pageMap, _pageMap, sizeof(_pageMap));
+    
+    // Pages not written since the last snapshot are shared with it
+    for (uint16_t page = 0; page < NumPages; ++page) {
+        uint8_t* mem = _pageMap[page].write;
+        if (!mem) {
+            _basePages[page] = nullptr;
+        } else if (_dirtyPages[page] || !_basePages[page]) {
+            _basePages[page] = Snapshot::Page(new uint8_t[256]);
+            memcpy(_basePages[page].get(), mem, 256);
+        }
+        snapshot._pages[page] = _basePages[page];
+        _dirtyPages[page] = false;
+    }
+    
+    _trackDirty = true;
+    for (uint16_t page = 0; page < NumPages; ++page) {
+        updatePage(page);
+    }
+    snapshot._valid = true;
+}
+
+bool Emulator::restoreSnapshot(const Snapshot& snapshot)
+{
+    if (!snapshot._valid) {
+        return false;
+    }
+    
+    // A different memory map means nothing decoded can be trusted
+    if (memcmp(_pageMap, snapshot._pageMap, sizeof(_pageMap)) != 0) {
+        memcpy(_pageMap, snapshot._pageMap, sizeof(_pageMap));
+        invalidateDecodeCache();
+    }
+    
+    // Only pages which changed since the snapshot need to be copied
+    for (uint16_t page = 0; page < NumPages; ++page) {
+        const Snapshot::Page& saved = snapshot._pages[page];
+        if (saved && (_dirtyPages[page] || _basePages[page] != saved)) {
+            memcpy(_pageMap[page].write, saved.get(), 256);
+            invalidateDecodeCache(page << 8, 256);
+        }
+        _basePages[page] = saved;
+        _dirtyPages[page] = false;
+    }
+    
+    _d = snapshot._d;
+    _x = snapshot._x;
+    _y = snapshot._y;
+    _u = snapshot._u;
+    _s = snapshot._s;
+    _pc = snapshot._pc;
+    _dp = snapshot._dp;
+    setReg(Reg::CC, snapshot._cc);
+    _cycles = snapshot._cycles;
+    _prevOp = snapshot._prevOp;
+    _subroutineDepth = snapshot._subroutineDepth;
+    memcpy(_timers, snapshot._timers, sizeof(_timers));
+    _numTimers = snapshot._numTimers;
+    _wait = Wait(snapshot._wait);
+    _irq = snapshot._irq;
+    _firq = snapshot._firq;
+    _nmi = snapshot._nmi;
+    _nmiPending = snapshot._nmiPending;
+    _error = Error::None;
+    updateNextEvent();
+    
+    // This updates the fast page pointers too
+    _breakpoints = snapshot._breakpoints;
+    _trackDirty = true;
+    checkActiveBreakpoints();
+    return true;
+}
+
+void Emulator::startHistory()
+{
+    if (_history) {
+        return;
+    }
+    _history = new History();
+    for (uint16_t page = 0; page < NumPages; ++page) {
+        updatePage(page);
+    }
+}
+
+void Emulator::stopHistory()
+{
+    delete _history;
+    _history = nullptr;
+    for (uint16_t page = 0; page < NumPages; ++page) {
+        updatePage(page);
+    }
+}
+
+uint64_t Emulator::historySize() const
+{
+    return _history ? (_history->end() - _history->first()) : 0;
+}
+
+void Emulator::recordHistory()
+{
+    if (_history->end() % History::CheckpointInterval == 0) {
+        takeSnapshot(_history->addCheckpoint(_history->end()));
+    }
+    
+    HistoryInst& inst = _history->addInst();
+    inst.cycles = _cycles;
+    inst.pc = _pc;
+    inst.d = _d;
+    inst.x = _x;
+    inst.y = _y;
+    inst.u = _u;
+    inst.s = _s;
+    inst.dp = _dp;
+    inst.cc = ccValue();
+}
+
+void Emulator::undoInst(uint64_t i)
+{
+    // Undo the writes last to first, so a byte written twice gets the
+    // value from before both
+    for (uint64_t w = _history->writesEnd(i); w > _history->writesStart(i); --w) {
+        const HistoryWrite& write = _history->write(w - 1);
+        uint8_t* mem = _pageMap[write.addr >> 8].write;
+        if (mem) {
+            mem[write.addr & 0xff] = write.oldValue;
+            markDirty(write.addr, 1);
+            invalidateCode(write.addr, 1);
+        }
+    }
+    
+    const HistoryInst& inst = _history->inst(i);
+    _cycles = inst.cycles;
+    _pc = inst.pc;
+    _d = inst.d;
+    _x = inst.x;
+    _y = inst.y;
+    _u = inst.u;
+    _s = inst.s;
+    _dp = inst.dp;
+    setReg(Reg::CC, inst.cc);
+}
+
+// Going back at least this many instructions past a checkpoint is slower
+// than restoring it
+static constexpr uint64_t MinCheckpointSkip = 4096;
+
+uint64_t Emulator::stepBack(uint64_t count)
+{
+    if (!_history) {
+        return 0;
+    }
+    
+    uint64_t end = _history->end();
+    count = std::min(count, end - _history->first());
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t target = end - count;
+    
+    // Restore the checkpoint closest to the target if that skips enough
+    // undoing. Breakpoints set since then are kept.
+    uint64_t checkpointIndex;
+    const Snapshot* checkpoint = _history->checkpoint(target, checkpointIndex);
+    if (checkpoint && end - checkpointIndex >= MinCheckpointSkip) {
+        m8r::vector<BreakpointEntry> breakpoints = _breakpoints;
+        restoreSnapshot(*checkpoint);
+        _breakpoints = breakpoints;
+        checkActiveBreakpoints();
+        end = checkpointIndex;
+    }
+    
+    for (uint64_t i = end; i > target; --i) {
+        undoInst(i - 1);
+    }
+    
+    _history->truncate(target);
+    _wait = Wait::None;
+    updateNextEvent();
+    return count;
+}
+
+bool Emulator::reverseContinue()
+{
+    while (stepBack(1)) {
+        if (isBreakpointAddr(_pc) && breakpointHit(_pc, BPType::Exec, false)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Emulator::lastWrite(uint16_t addr, WriteInfo& info) const
+{
+    if (!_history) {
+        return false;
+    }
+    
+    uint64_t writeIndex = std::min(info.writeIndex, _history->writeEnd());
+    if (!_history->findWrite(addr, writeIndex, writeIndex)) {
+        return false;
+    }
+    
+    const HistoryWrite& write = _history->write(writeIndex);
+    uint64_t instIndex = _history->instForWrite(writeIndex);
+    const HistoryInst& inst = _history->inst(instIndex);
+    info.pc = inst.pc;
+    info.cycles = inst.cycles;
+    info.instsAgo = _history->end() - instIndex;
+    info.oldValue = write.oldValue;
+    info.newValue = write.newValue;
+    info.writeIndex = writeIndex;
+    return true;
+}
+#endif
+
+void Emulator::pushEntireState()
+{
+    cc().E = true;
+    push16(_s, _pc);
+    push16(_s, _u);
+    push16(_s, _y);
+    push16(_s, _x);
+    push8(_s, _dp);
+    push8(_s, _b);
+    push8(_s, _a);
+    push8(_s, ccValue());
+}
+
+void Emulator::clearCycles()
+{
+    // Timers are kept in absolute cycles so move them along with the count
+    for (uint8_t i = 0; i < _numTimers; ++i) {
+        _timers[i].time -= _cycles;
+    }
+    _nextEvent -= _cycles;
+    _cycleDeadline -= _cycles;
+    _cycles = 0;
+}
+
+void Emulator::setCycleDeadline(uint32_t cycles)
+{
+    _cycleDeadline = cycles;
+    _haveDeadline = true;
+    updateNextEvent();
+}
+
+void Emulator::clearCycleDeadline()
+{
+    _haveDeadline = false;
+    updateNextEvent();
+}
+
+bool Emulator::schedule(Timer* timer, uint32_t delay)
+{
+    if (_numTimers >= MaxTimers) {
+        return false;
+    }
+    insertTimer(timer, _cycles + delay);
+    updateNextEvent();
+    return true;
+}
+
+void Emulator::cancel(Timer* timer)
+{
+    for (uint8_t i = 0; i < _numTimers; ) {
+        if (_timers[i].timer == timer) {
+            removeTimer(i);
+        } else {
+            ++i;
+        }
+    }
+    updateNextEvent();
+}
+
+void Emulator::setInterrupt(Interrupt irq, bool asserted)
+{
+    switch (irq) {
+        case Interrupt::IRQ: _irq = asserted; break;
+        case Interrupt::FIRQ: _firq = asserted; break;
+        case Interrupt::NMI:
+            if (asserted && !_nmi) {
+                _nmiPending = true;
+            }
+            _nmi = asserted;
+            break;
+    }
+    updateNextEvent();
+}
+
+void Emulator::insertTimer(Timer* timer, uint32_t time)
+{
+    // Sift up from the end
+    uint8_t i = _numTimers++;
+    while (i > 0) {
+        uint8_t parent = (i - 1) / 2;
+        if (!before(time, _timers[parent].time)) {
+            break;
+        }
+        _timers[i] = _timers[parent];
+        i = parent;
+    }
+    _timers[i] = { time, timer };
+}
+
+void Emulator::removeTimer(uint8_t i)
+{
+    // Move the last entry into the hole and sift it down
+    TimerEvent event = _timers[--_numTimers];
+    while (true) {
+        uint8_t child = i * 2 + 1;
+        if (child >= _numTimers) {
+            break;
+        }
+        if (child + 1 < _numTimers && before(_timers[child + 1].time, _timers[child].time)) {
+            child += 1;
+        }
+        if (!before(_timers[child].time, event.time)) {
+            break;
+        }
+        _timers[i] = _timers[child];
+        i = child;
+    }
+    if (i < _numTimers) {
+        _timers[i] = event;
+    }
+}
+
+void Emulator::updateNextEvent()
+{
+    // A pending interrupt might be masked, and the mask can change with
+    // any instruction, so check after every instruction until it's taken
+    if (_irq || _firq || _nmiPending) {
+        _nextEvent = _cycles;
+    } else {
+        _nextEvent = _numTimers ? _timers[0].time : (_cycles + NoEventCycles);
+    }
+    
+    if (_haveDeadline && before(_cycleDeadline, _nextEvent)) {
+        _nextEvent = _cycleDeadline;
+    }
+}
+
+bool Emulator::serviceEvents()
+{
+    // Periodic timers are rescheduled from when they were due, not when
+    // they fired, so they don't drift
+    while (_numTimers && !before(_cycles, _timers[0].time)) {
+        TimerEvent event = _timers[0];
+        removeTimer(0);
+        uint32_t period = event.timer->fire(*this);
+        if (period) {
+            insertTimer(event.timer, event.time + period);
+        }
+    }
+    
+    // SYNC ends on any interrupt, even a masked one
+    if (_wait == Wait::Sync && (_irq || _firq || _nmiPending)) {
+        _wait = Wait::None;
+    }
+    
+    bool taken = takeInterrupt();
+    updateNextEvent();
+    return taken;
+}
+
+bool Emulator::takeInterrupt()
+{
+    uint16_t vector;
+    
+    // CWAI has already pushed everything
+    if (_nmiPending) {
+        _nmiPending = false;
+        if (_wait != Wait::Cwai) {
+            pushEntireState();
+            addCycles(19);
+        }
+        cc().I = true;
+        cc().F = true;
+        vector = 0xfffc;
+    } else if (_firq && !cc().F) {
+        if (_wait != Wait::Cwai) {
+            cc().E = false;
+            push16(_s, _pc);
+            push8(_s, ccValue());
+            addCycles(10);
+        }
+        cc().I = true;
+        cc().F = true;
+        vector = 0xfff6;
+    } else if (_irq && !cc().I) {
+        if (_wait != Wait::Cwai) {
+            pushEntireState();
+            addCycles(19);
+        }
+        cc().I = true;
+        vector = 0xfff8;
+    } else {
+        return false;
+    }
+    
+    _wait = Wait::None;
+    _pc = load16(vector);
+    
+#ifdef PROFILER
+    if (_profiler) {
+        _profiler->call(_pc);
+    }
+#endif
+    return true;
+}
+
+bool Emulator::waitForInterrupt()
+{
+    while (true) {
+        serviceEvents();
+        if (_wait == Wait::None) {
             return true;
         }
+        if (_numTimers == 0) {
+            return false;
+        }
+        
+        // Nothing to do until the next timer fires. If the deadline comes
+        // first, wait until then and end the slice
+        uint32_t time = _timers[0].time;
+        if (_haveDeadline && before(_cycleDeadline, time)) {
+            if (before(_cycles, _cycleDeadline)) {
+                _cycles = _cycleDeadline;
+            }
+            return false;
+        }
+        if (before(_cycles, time)) {
+            _cycles = time;
+        }
     }
 }
 
@@ -927,67 +2072,120 @@ void Emulator::readOnlyAddr(uint16_t addr)
 
 void Emulator::checkActiveBreakpoints()
 {
+    // Rebuild the address bits and watched pages from the list
     _haveBreakpoints = false;
-    for (auto it : _breakpoints) {
-        if (it.status == BPStatus::Enabled) {
-            _haveBreakpoints = true;
-            return;
+    memset(_breakpointBits, 0, sizeof(_breakpointBits));
+    memset(_watchReads, 0, sizeof(_watchReads));
+    memset(_watchWrites, 0, sizeof(_watchWrites));
+    
+    for (const auto& it : _breakpoints) {
+        if (it.status != BPStatus::Enabled) {
+            continue;
+        }
+        _haveBreakpoints = true;
+        switch (it.type) {
+            case BPType::Exec: _breakpointBits[it.addr >> 3] |= 1 << (it.addr & 0x07); break;
+            case BPType::Read: _watchReads[it.addr >> 8] = true; break;
+            case BPType::Write: _watchWrites[it.addr >> 8] = true; break;
+            case BPType::Access: _watchReads[it.addr >> 8] = _watchWrites[it.addr >> 8] = true; break;
+        }
+    }
+    
+    for (uint16_t page = 0; page < NumPages; ++page) {
+        updatePage(page);
+    }
+}
+
+bool Emulator::breakpointHit(uint16_t addr, BPType type, bool count)
+{
+    bool hit = false;
+    for (auto& it : _breakpoints) {
+        if (it.status != BPStatus::Enabled || it.addr != addr) {
+            continue;
+        }
+        if (it.type != type && !(it.type == BPType::Access && type != BPType::Exec)) {
+            continue;
+        }
+        if (it.condReg != Reg::None && getReg(it.condReg) != it.condValue) {
+            continue;
+        }
+        if (!count) {
+            return true;
+        }
+        it.hits += 1;
+        if (it.hits >= it.hitCount) {
+            hit = true;
         }
     }
+    return hit;
 }
 
-bool Emulator::breakpoint(uint8_t i, BreakpointEntry& entry) const
+bool Emulator::breakpoint(uint16_t i, BreakpointEntry& entry) const
 {
-    if (i >= NumBreakpoints || _breakpoints[i].status == BPStatus::Empty) {
+    if (i >= _breakpoints.size()) {
         return false;
     }
     entry = _breakpoints[i];
     return true;
 }
 
-bool Emulator::setBreakpoint(uint16_t addr, uint8_t& i)
+bool Emulator::setBreakpoint(uint16_t addr, uint16_t& i, BPType type)
 {
-    i = 0;
-    for (auto &it : _breakpoints) {
-        if (it.status == BPStatus::Empty) {
-            it.status = BPStatus::Enabled;
-            it.addr = addr;
-            _haveBreakpoints = true;
-            return true;
-        }
-        i += 1;
+    BreakpointEntry entry;
+    entry.addr = addr;
+    entry.status = BPStatus::Enabled;
+    entry.type = type;
+    
+    i = _breakpoints.size();
+    _breakpoints.push_back(entry);
+    checkActiveBreakpoints();
+    return true;
+}
+
+bool Emulator::setBreakpointCondition(uint16_t i, Reg reg, uint16_t value)
+{
+    if (i >= _breakpoints.size()) {
+        return false;
     }
-    return false;
+    
+    _breakpoints[i].condReg = reg;
+    _breakpoints[i].condValue = value;
+    return true;
 }
 
-bool Emulator::clearBreakpoint(uint8_t i)
+bool Emulator::setBreakpointHitCount(uint16_t i, uint32_t count)
 {
-    // Clear the passed breakpoint and move all the others past it up one
-    if (i >= NumBreakpoints || _breakpoints[i].status == BPStatus::Empty) {
+    if (i >= _breakpoints.size()) {
         return false;
     }
     
-    for ( ; i < NumBreakpoints - 1; ++i) {
-        _breakpoints[i] = _breakpoints[i + 1];
+    _breakpoints[i].hitCount = count;
+    _breakpoints[i].hits = 0;
+    return true;
+}
+
+bool Emulator::clearBreakpoint(uint16_t i)
+{
+    // Clear the passed breakpoint. The ones after it move up one
+    if (i >= _breakpoints.size()) {
+        return false;
     }
-    _breakpoints[i].status = BPStatus::Empty;
     
+    _breakpoints.erase(_breakpoints.begin() + i);
     checkActiveBreakpoints();
     return true;
 }
 
 bool Emulator::clearAllBreakpoints()
 {
-    for (auto &it : _breakpoints) {
-        it.status = BPStatus::Empty;
-    }
+    _breakpoints.clear();
     checkActiveBreakpoints();
     return true;
 }
 
-bool Emulator::disableBreakpoint(uint8_t i)
+bool Emulator::disableBreakpoint(uint16_t i)
 {
-    if (i >= NumBreakpoints || _breakpoints[i].status == BPStatus::Empty) {
+    if (i >= _breakpoints.size()) {
         return false;
     }
     
@@ -999,17 +2197,15 @@ bool Emulator::disableBreakpoint(uint8_t i)
 bool Emulator::disableAllBreakpoints()
 {
     for (auto &it : _breakpoints) {
-        if (it.status == BPStatus::Enabled) {
-            it.status = BPStatus::Disabled;
-        }
+        it.status = BPStatus::Disabled;
     }
     checkActiveBreakpoints();
     return true;
 }
 
-bool Emulator::enableBreakpoint(uint8_t i)
+bool Emulator::enableBreakpoint(uint16_t i)
 {
-    if (i >= NumBreakpoints || _breakpoints[i].status == BPStatus::Empty) {
+    if (i >= _breakpoints.size()) {
         return false;
     }
     
@@ -1021,9 +2217,7 @@ bool Emulator::enableBreakpoint(uint8_t i)
 bool Emulator::enableAllBreakpoints()
 {
     for (auto &it : _breakpoints) {
-        if (it.status == BPStatus::Disabled) {
-            it.status = BPStatus::Enabled;
-        }
+        it.status = BPStatus::Enabled;
     }
     checkActiveBreakpoints();
     return true;
@@ -1031,5 +2225,4 @@ bool Emulator::enableAllBreakpoints()
 
 // TODO:
 //
-// - Handle SYNC and CWAI waiting for interrupt
-// - Handle firing of IRQ, FIRQ, NMI and RESTART
+// - Handle RESTART
@@ -18,20 +18,55 @@
 #include <cstdint>
 #include <cstring>
 
+#ifndef ARDUINO
+#include <memory>
+#endif
+
+#include "containers.h"
 #include "srec.h"
 
-#define COMPUTE_CYCLES
-//#define TRACE
+// Compute condition codes only when they're read rather than after every
+// operation. With the opcode handlers specialized the eager flag updates
+// are already cheap and this is slower on branch heavy code, so it's off.
+//#define LAZY_FLAGS
 
-#ifdef TRACE
-static constexpr uint32_t TraceBufferSize = 10;
+// The decode cache keeps decoded instructions keyed by PC so loops don't
+// re-decode the same bytes each time through. It takes about 136KB of RAM
+// so it's not used on Arduino.
+#ifndef ARDUINO
+#define DECODE_CACHE
 #endif
 
+// The profiler needs the standard library and about 1MB of RAM, the
+// binary tracer and batch runner need threads, snapshots need shared_ptr,
+// the input log needs files, the loader maps files with mmap and the
+// assembler links with lwasm (lwtools/lwasm/liblwasm.a), so none of them
+// are used on Arduino
+#ifndef ARDUINO
+#define PROFILER
+#define TRACER
+#define SNAPSHOTS
+#define BATCH
+#define INPUT_LOG
+#define MAPPED_FILES
+#define ASSEMBLER
+#endif
+
+static constexpr uint32_t TraceBufferSize = 10;
+
 namespace mc6809 {
 
 static constexpr uint16_t SystemAddrStart = 0xFC00;
 static constexpr uint32_t InstructionsToExecutePerContinue = 100000;
-static constexpr uint8_t NumBreakpoints = 4;
+static constexpr uint32_t MinInstructionsPerContinue = 1000;
+static constexpr uint32_t MaxInstructionsPerContinue = 10000000;
+static constexpr uint8_t MaxInstSize = 5; // Page prefix, opcode, postbyte and 16 bit offset
+
+#ifdef DECODE_CACHE
+static constexpr uint32_t DecodeCacheSize = 4096; // Must be a power of 2
+static constexpr uint32_t BlockCacheSize = 1024; // Must be a power of 2
+static constexpr uint8_t MaxBlockInsts = 16;
+#endif
 
 // Opcode table
 
@@ -144,9 +179,7 @@ struct Opcode
     Left left : 3;
     Right right : 3;
     Adr adr : 4;
-#ifdef COMPUTE_CYCLES
     uint8_t cycles : 5;
-#endif
 };
 
 // Cycle Counts
@@ -168,7 +201,6 @@ struct Opcode
 // + All Page2 and Page3 opcodes take 1 extra cycle
 //
 
-#ifdef COMPUTE_CYCLES
 // bit counter for PSH/PUL cycle counting
 static inline uint8_t countBits(uint8_t v)
 {
@@ -179,14 +211,63 @@ static inline uint8_t countBits(uint8_t v)
     return b;
 }
 
-// Adds cycles to total
-#define AddCy(cycles) _cycles += cycles
-
 // Used to add cycles to Opcode list
 #define CY(t) t
-#else
-#define AddCy(cycles)
-#define CY(t)
+
+class Emulator;
+struct DecodedInst;
+
+// Handlers for a decoded instruction. The EA handler computes the effective
+// address for indexed modes. The exec handler computes the effective address
+// for all other modes, then does the load, operation and store. It returns
+// the effective address in ea and returns false if execution should stop
+// and go back to the caller of execute().
+using EAFunc = uint16_t (*)(Emulator&, const DecodedInst&);
+using ExecFunc = bool (*)(Emulator&, const DecodedInst&, uint16_t& ea);
+
+// Decoded instruction
+//
+// Everything about an instruction that can be determined from the bytes
+// at its address. opcode is the table entry after any Page2 or Page3
+// prefix, which is stored in page. operand holds the immediate value, the
+// sign extended relative offset, the low byte of a direct address, the
+// extended address or the offset of an indexed address. cycles is the
+// total count, including prefix, long branch and indexed mode extras.
+//
+// The indexed postbyte selects one of the EA handlers, so the register,
+// mode and indirection are resolved when decoding. ea is unused for other
+// modes. The PC relative and
+// extended indirect forms use the address in operand. Unused modes use an
+// address of 0.
+struct DecodedInst
+{
+    EAFunc ea = nullptr;
+    ExecFunc exec = nullptr;
+    uint16_t addr = 0;
+    uint16_t operand = 0;
+    Opcode opcode;
+    uint8_t size = 0;
+    uint8_t cycles = 0;
+    Op page = Op::NOP;
+};
+
+#ifdef DECODE_CACHE
+// Block of decoded instructions for the Threaded engine
+//
+// A straight line run of instructions starting at addr. It ends with the
+// first instruction that can change the PC, or after MaxBlockInsts. For
+// direct branches and jumps chainAddr holds the possible next addresses
+// (taken and fall through) and chain the block last run for each, so
+// running the next block doesn't need a lookup.
+struct Block
+{
+    uint16_t addr = 0;
+    uint8_t size = 0; // Bytes covered by insts
+    uint8_t count = 0; // 0 if this block is empty
+    uint16_t chainAddr[2] = { 0, 0 };
+    Block* chain[2] = { nullptr, nullptr };
+    DecodedInst insts[MaxBlockInsts];
+};
 #endif
 
 struct CC
@@ -201,8 +282,70 @@ struct CC
     bool E : 1; // Entire       : All registers stacked from last interrupt
 };
 
+// Flag ops, one for each of the ways an operation can update the HNZVC flags.
+// Each name has a letter for each flag it updates, 0 or 1 for a flag
+// set to that value and x for a flag it leaves unchanged.
+enum class FlagOp : uint8_t {
+    None, HNZVC8, xNZVC8, xNZVC16, xNZ018, x0ZxC8, x0Zxx8,
+    xNZVx8, xNZ0x8, xNZ0x16, xNZ0C8, xNZxC8, xNZxx8
+};
+
+// Bit mask in CC of the flags updated by op
+static constexpr uint8_t flagMask(FlagOp op)
+{
+    switch(op) {
+        case FlagOp::None:      return 0;
+        case FlagOp::HNZVC8:    return 0x2f;
+        case FlagOp::xNZVC8:
+        case FlagOp::xNZVC16:
+        case FlagOp::xNZ018:
+        case FlagOp::xNZ0C8:    return 0x0f;
+        case FlagOp::x0ZxC8:    return 0x0d;
+        case FlagOp::x0Zxx8:
+        case FlagOp::xNZxx8:    return 0x0c;
+        case FlagOp::xNZVx8:
+        case FlagOp::xNZ0x8:
+        case FlagOp::xNZ0x16:   return 0x0e;
+        case FlagOp::xNZxC8:    return 0x0d;
+    }
+    return 0;
+}
+
 enum class BPStatus { Empty, Enabled, Disabled };
 
+// Execution policies
+//
+// The execute loops are built once for each policy, so whatever a policy
+// turns off costs nothing. Throughput runs as fast as possible. It doesn't
+// count cycles, so timers only fire while waiting in SYNC or CWAI.
+// Instrumented counts cycles and handles breakpoints and stepping. Traced
+// also fills the trace buffer and writes to the Tracer if one is set.
+// Breakpoints and stepping use Instrumented when Throughput is selected.
+// When a Profiler is set Profiled is used whatever the policy.
+enum class Policy { Throughput, Instrumented, Traced };
+
+template<bool cycles, bool trace, bool breakpoints, bool profile = false>
+struct ExecPolicy
+{
+    static constexpr bool Cycles = cycles;
+    static constexpr bool Trace = trace;
+    static constexpr bool Breakpoints = breakpoints;
+    static constexpr bool Profile = profile;
+};
+
+using ThroughputPolicy = ExecPolicy<false, false, false>;
+using InstrumentedPolicy = ExecPolicy<true, false, true>;
+using TracedPolicy = ExecPolicy<true, true, true>;
+using ProfiledPolicy = ExecPolicy<true, false, true, true>;
+
+// Used when no breakpoints are set and we're not stepping
+template<typename P> using WithoutBreakpoints = ExecPolicy<P::Cycles, P::Trace, false, P::Profile>;
+
+// Interpreter runs one instruction at a time. Threaded runs blocks of
+// decoded instructions back to back. Breakpoints and stepping always use
+// the Interpreter. Threaded is only available with DECODE_CACHE.
+enum class Engine { Interpreter, Threaded };
+
 enum class RunState {
     Loading,
     Cmd,
@@ -213,18 +356,137 @@ enum class RunState {
     StepOver,
 };
 
+// Memory mapped device
+//
+// Attached to one or more pages with Emulator::mapDevice. Every load and
+// store to those pages calls read or write with the full address.
+class Device
+{
+  public:
+    virtual ~Device() { }
+    virtual uint8_t read(uint16_t addr) = 0;
+    virtual void write(uint16_t addr, uint8_t v) = 0;
+};
+
+static constexpr uint16_t NumPages = 256; // 256 byte pages in the memory map
+
+enum class Interrupt { IRQ, FIRQ, NMI };
+
+// Timed event for the scheduler
+//
+// fire is called when the cycle count reaches the time it was scheduled
+// for. Return the number of cycles until it should fire again, or 0 if
+// it's done.
+class Timer
+{
+  public:
+    virtual ~Timer() { }
+    virtual uint32_t fire(Emulator&) = 0;
+};
+
+static constexpr uint8_t MaxTimers = 8;
+static constexpr uint32_t NoEventCycles = 0x40000000; // How far ahead to look when nothing is scheduled
+
+struct TimerEvent
+{
+    uint32_t time;
+    Timer* timer;
+};
+
+// Breakpoints stop before the instruction at addr runs. Watchpoints stop
+// after an instruction reads or writes addr. Either can have a condition,
+// a register which must equal condValue, and a hit count so it only stops
+// on that hit and after.
+enum class BPType { Exec, Read, Write, Access };
+
 struct BreakpointEntry
 {
-    uint16_t addr;
+    uint16_t addr = 0;
     BPStatus status = BPStatus::Empty;
+    BPType type = BPType::Exec;
+    Reg condReg = Reg::None;
+    uint16_t condValue = 0;
+    uint32_t hitCount = 0;
+    uint32_t hits = 0;
 };
 
+// What is mapped at a page. The fast path uses _readPages and _writePages,
+// which are copies of read and write unless the page is being watched.
+struct PageMapping
+{
+    const uint8_t* read = nullptr;
+    uint8_t* write = nullptr;
+    Device* device = nullptr;
+};
+
+#ifdef SNAPSHOTS
+// Complete machine state: registers, cycles, scheduled events, interrupt
+// lines, breakpoints, the memory map and the contents of every RAM page.
+// RAM pages are shared with other snapshots until they're written, so
+// taking a snapshot only copies the pages written since the last one was
+// taken or restored and restoring only copies the pages that differ.
+// Devices and timers keep their own state, which isn't saved.
+class Snapshot
+{
+public:
+    bool valid() const { return _valid; }
+    uint32_t cycles() const { return _cycles; }
+    
+private:
+    friend class Emulator;
+    
+    using Page = std::shared_ptr<uint8_t[]>;
+
+    bool _valid = false;
+    uint16_t _d = 0;
+    uint16_t _x = 0;
+    uint16_t _y = 0;
+    uint16_t _u = 0;
+    uint16_t _s = 0;
+    uint16_t _pc = 0;
+    uint8_t _dp = 0;
+    uint8_t _cc = 0;
+    uint32_t _cycles = 0;
+    Op _prevOp = Op::NOP;
+    uint32_t _subroutineDepth = 0;
+    m8r::vector<BreakpointEntry> _breakpoints;
+    TimerEvent _timers[MaxTimers];
+    uint8_t _numTimers = 0;
+    uint8_t _wait = 0;
+    bool _irq = false;
+    bool _firq = false;
+    bool _nmi = false;
+    bool _nmiPending = false;
+    PageMapping _pageMap[NumPages];
+    Page _pages[NumPages]; // nullptr for pages which aren't RAM
+};
+#endif
+
 class BOSS9Base;
+class Profiler;
+class Tracer;
+class History;
+
+#ifdef SNAPSHOTS
+// A write found in the execution history
+struct WriteInfo
+{
+    uint16_t pc; // Instruction which made the write
+    uint32_t cycles; // Cycles before that instruction ran
+    uint64_t instsAgo; // Number of instructions back from the current one
+    uint8_t oldValue;
+    uint8_t newValue;
+    
+    // Index of the write found, where the search for the one before it
+    // starts. The default starts from the end of the history
+    uint64_t writeIndex = ~uint64_t(0);
+};
+#endif
 
 class SRecordInfo : public SRecordParser
 {
   public:
-    SRecordInfo(uint8_t* ram, BOSS9Base* boss9) : _ram(ram), _boss9(boss9) { }
+    SRecordInfo(uint8_t* ram, uint32_t ramSize, BOSS9Base* boss9) : _ram(ram), _ramSize(ramSize), _boss9(boss9) { }
     void init()
     {
         SRecordParser::init();
@@ -250,23 +512,13 @@ class SRecordInfo : public SRecordParser
         return true;
     }
     
-    virtual bool Data(const SRecordData *sRecData)
-    {
-        // FIXME: Need to handle ranges, which means we need to pass in the ram size
-        
-        // If the start addr has not been set, set it to the start of the first record.
-        // The StartAddress function can change this at the end
-        if (!_startAddrSet) {
-            _startAddr = sRecData->m_addr;
-        }
-        memcpy(_ram + sRecData->m_addr, sRecData->m_data, sRecData->m_dataLen);
-        return true;
-    }
+    virtual bool Data(const SRecordData *sRecData);
     
     virtual void ParseError(unsigned linenum, const char *fmt, va_list args);
     
   private:
     uint8_t* _ram = nullptr;
+    uint32_t _ramSize = 0;
     uint16_t _startAddr = 0;
     bool _startAddrSet = false;
     
@@ -281,20 +533,27 @@ public:
         Illegal,
     };
     
-    Emulator(uint8_t* ram, BOSS9Base* boss9) : sRecInfo(ram, boss9)
+    Emulator(uint8_t* ram, uint32_t size, BOSS9Base* boss9) : sRecInfo(ram, size, boss9)
     {
         _ram = ram;
+        _ramSize = size;
         _boss9 = boss9;
         
-#ifdef TRACE
         memset(_traceBuffer, 0, sizeof(_traceBuffer));
+        memset(_breakpointBits, 0, sizeof(_breakpointBits));
+        memset(_watchReads, 0, sizeof(_watchReads));
+        memset(_watchWrites, 0, sizeof(_watchWrites));
+#ifdef SNAPSHOTS
+        memset(_dirtyPages, 0, sizeof(_dirtyPages));
 #endif
+        mapDefault(size);
     }
     
-    ~Emulator() { }
+    ~Emulator();
     
-    // Assumes data is in s19 format
-    // Returns the start addr of the program
+    // Load s19 data a line at a time, for the monitor and the ldLine
+    // system call. loadEnd returns the start addr of the program. Whole
+    // images are loaded faster with Loader
     void loadStart();
     bool loadLine(const char* data, bool& finished);
     uint16_t loadEnd();
@@ -302,37 +561,150 @@ public:
     void setStack(uint16_t stack) { _s = stack; }
     
     bool execute(RunState);
+    
+    // Returns false if engine is not available
+    bool setEngine(Engine);
+    Engine engine() const { return _engine; }
+    
+    void setPolicy(Policy policy)
+    {
+        _policy = policy;
+        _countCycles = policy != Policy::Throughput;
+    }
+    Policy policy() const { return _policy; }
+    
+    // Most instructions execute() runs before returning to the host
+    void setSliceInsts(uint32_t insts) { _sliceInsts = insts; }
+    uint32_t sliceInsts() const { return _sliceInsts; }
+    
+    // execute() also returns once cycles reaches the deadline. It's kept
+    // with the scheduled events so it costs nothing per instruction.
+    // Without cycle counting (Policy::Throughput) it is never reached.
+    void setCycleDeadline(uint32_t cycles);
+    void clearCycleDeadline();
+    bool haveCycleDeadline() const { return _haveDeadline; }
+    uint32_t cycleDeadline() const { return _cycleDeadline; }
+    bool deadlineReached() const { return _haveDeadline && !before(_cycles, _cycleDeadline); }
+    
+#ifdef PROFILER
+    // Pass nullptr to stop profiling. The profiler is not owned
+    void setProfiler(Profiler* profiler) { _profiler = profiler; }
+    Profiler* profiler() const { return _profiler; }
+#endif
+
+#ifdef TRACER
+    // Records are written while running the Traced policy. Pass nullptr
+    // to stop. The tracer is not owned
+    void setTracer(Tracer* tracer) { _tracer = tracer; }
+    Tracer* tracer() const { return _tracer; }
+#endif
+
+#ifdef SNAPSHOTS
+    void takeSnapshot(Snapshot&);
+    
+    // Returns false if the snapshot was never taken
+    bool restoreSnapshot(const Snapshot&);
+    
+    // Reverse execution. While recording, the registers before each
+    // instruction and the old value of each RAM byte written are kept so
+    // instructions can be undone. Writes to devices can't be undone.
+    // Recording uses the interpreter and sends all writes through the
+    // slow path.
+    void startHistory();
+    void stopHistory();
+    bool recordingHistory() const { return _history != nullptr; }
+    
+    // Number of instructions which can be stepped back
+    uint64_t historySize() const;
+    
+    // Returns the number of instructions actually stepped back, which is
+    // less than count if the start of the history is reached
+    uint64_t stepBack(uint64_t count = 1);
+    
+    // Step back to the previous enabled breakpoint whose condition is met.
+    // Hit counts are ignored. Returns false if the start of the history
+    // was reached first
+    bool reverseContinue();
+    
+    // Find the last write to addr before info.writeIndex. Pass the same
+    // WriteInfo again to get the write before that, so walking back
+    // through the writes goes through the history once. Returns false if
+    // there are no more writes to addr in the history
+    bool lastWrite(uint16_t addr, WriteInfo&) const;
+#endif
 
     uint8_t* getAddr(uint16_t ea) { return _ram + ea; }
+    uint32_t ramSize() const { return _ramSize; }
     
-    // Breakpoint support
-    bool breakpoint(uint8_t i, BreakpointEntry& entry) const;
-    bool setBreakpoint(uint16_t addr, uint8_t& i);
-    bool clearBreakpoint(uint8_t i);
+    // Memory map. mem points at the first byte of firstPage. Remapping
+    // discards all decoded instructions, so bank switching should map
+    // whole pages rather than copying memory.
+    void mapRAM(uint8_t firstPage, uint16_t numPages, uint8_t* mem);
+    void mapROM(uint8_t firstPage, uint16_t numPages, const uint8_t* mem);
+    void mapDevice(uint8_t firstPage, uint16_t numPages, Device*);
+    void unmap(uint8_t firstPage, uint16_t numPages);
+    
+    // Anything that changes ram without going through store8 or store16
+    // must call one of these so stale decoded instructions are discarded
+    void invalidateDecodeCache();
+    void invalidateDecodeCache(uint16_t addr, uint16_t size);
+    
+    // EA and exec handlers, selected by the decoder. These are public so the
+    // handler tables can be built outside the class
+    template<uint8_t postbyte> static uint16_t indexedEA(Emulator&, const DecodedInst&);
+    template<uint16_t code> static bool exec(Emulator&, const DecodedInst&, uint16_t& ea);
+    template<uint16_t code> bool execOp(const DecodedInst&, uint16_t& ea);
+    
+    // Breakpoint support. Breakpoints and watchpoints are in one list, so
+    // they share index numbers
+    uint16_t numBreakpoints() const { return _breakpoints.size(); }
+    bool breakpoint(uint16_t i, BreakpointEntry& entry) const;
+    bool setBreakpoint(uint16_t addr, uint16_t& i, BPType = BPType::Exec);
+    bool setBreakpointCondition(uint16_t i, Reg, uint16_t value);
+    bool setBreakpointHitCount(uint16_t i, uint32_t count);
+    bool clearBreakpoint(uint16_t i);
     bool clearAllBreakpoints();
-    bool disableBreakpoint(uint8_t i);
+    bool disableBreakpoint(uint16_t i);
     bool disableAllBreakpoints();
-    bool enableBreakpoint(uint8_t i);
+    bool enableBreakpoint(uint16_t i);
     bool enableAllBreakpoints();
     
+    // Only addresses with a bit set in _breakpointBits need the list searched
     bool atBreakpoint(uint16_t addr)
     {
-        if (!_haveBreakpoints) {
-            return false;
-        }
-        for (auto it : _breakpoints) {
-            if (it.status == BPStatus::Enabled && it.addr == addr) {
-                return true;
-            }
-        }
-        return false;
+        return isBreakpointAddr(addr) && breakpointHit(addr, BPType::Exec);
     }
 
     Error error() const { return _error; }
     void resetError() { _error = Error::None; }
 
     uint32_t cycles() const { return _cycles; }
-    void clearCycles() { _cycles = 0; }
+    void clearCycles();
+    
+    // Charge for work done natively, like a system call. Nothing is
+    // charged unless the loop running counts cycles, which it can with
+    // Policy::Throughput when debugging, recording or profiling
+    void addCycles(uint32_t cycles)
+    {
+        if (_countCycles) {
+            _cycles += cycles;
+        }
+    }
+    
+    // Instructions run so far. They're counted even when cycles aren't
+    uint64_t instructions() const { return _instructions; }
+    
+    // Scheduler
+    //
+    // Timers fire delay cycles from now. IRQ and FIRQ are level triggered
+    // so they stay asserted until released. NMI is taken once each time it
+    // goes from released to asserted. SYNC and CWAI skip ahead to the next
+    // timer rather than running idle cycles. If nothing is scheduled they
+    // end the run slice and wait for the host to assert an interrupt.
+    bool schedule(Timer*, uint32_t delay); // Returns false if there are already MaxTimers
+    void cancel(Timer*);
+    void setInterrupt(Interrupt, bool asserted);
+    bool waitingForInterrupt() const { return _wait != Wait::None; }
     
     uint16_t getReg(Reg reg) const
     {
@@ -345,13 +717,9 @@ public:
             case Reg::Y:    return _y;
             case Reg::U:    return _u;
             case Reg::S:    return _s;
-            case Reg::CC:   return _ccByte;
+            case Reg::CC:   return ccValue();
             case Reg::PC:   return _pc;
             case Reg::DP:   return _dp;
-            case Reg::DDU:  return (_prevOp == Op::Page2) ? _d : ((_prevOp == Op::Page3) ? _u : _d);
-            case Reg::XYS:  return (_prevOp == Op::Page2) ? _y : ((_prevOp == Op::Page3) ? _s : _x);
-            case Reg::XY:   return (_prevOp == Op::Page2) ? _y : ((_prevOp == Op::Page3) ?  0 : _x);
-            case Reg::US:   return (_prevOp == Op::Page2) ? _s : ((_prevOp == Op::Page3) ?  0 : _u);
         }
     }
 
@@ -366,13 +734,9 @@ public:
             case Reg::Y:    _y = v; break;
             case Reg::U:    _u = v; break;
             case Reg::S:    _s = v; break;
-            case Reg::CC:   _ccByte = v; break;
+            case Reg::CC:   ccByte() = v; break;
             case Reg::PC:   _pc = v; break;
             case Reg::DP:   _dp = v; break;
-            case Reg::DDU:  if (_prevOp == Op::Page2) _d = v; else if (_prevOp == Op::Page3) _u = v; else _d = v; break;
-            case Reg::XYS:  if (_prevOp == Op::Page2) _y = v; else if (_prevOp == Op::Page3) _s = v; else _x = v; break;
-            case Reg::XY:   if (_prevOp == Op::Page2) _y = v; else if (_prevOp != Op::Page3) _x = v; break;
-            case Reg::US:   if (_prevOp == Op::Page2) _s = v; else if (_prevOp != Op::Page3) _u = v; break;
         }
     }
 
@@ -383,9 +747,10 @@ public:
 
     static const Opcode* opcode(uint8_t i);
 
+    // Arg of a system call, offset bytes from the top of the stack
     uint16_t getArg(int32_t offset, uint8_t size)
     {
-        uint16_t addr = getReg(Reg::U) + 6 + offset;
+        uint16_t addr = _s + offset;
         uint16_t v = load8(addr);
         if (size == 2) {
             v = (v << 8) + load8(addr + 1);
@@ -393,133 +758,411 @@ public:
         return v;
     }
 
-    uint8_t load8(uint16_t ea) const
+    // RAM and ROM pages are accessed directly. Everything else goes
+    // through loadSlow or storeSlow
+    uint8_t load8(uint16_t ea)
     {
-        return _ram[ea];
+        const uint8_t* page = _readPages[ea >> 8];
+        return page ? page[ea & 0xff] : loadSlow(ea);
     }
     
-    uint16_t load16(uint16_t ea) const
+    uint16_t load16(uint16_t ea)
     {
-        return (uint16_t(_ram[ea]) << 8) | uint16_t(_ram[ea + 1]);
+        const uint8_t* page = _readPages[ea >> 8];
+        if (page && (ea & 0xff) != 0xff) {
+            return (uint16_t(page[ea & 0xff]) << 8) | uint16_t(page[(ea & 0xff) + 1]);
+        }
+        return (uint16_t(load8(ea)) << 8) | uint16_t(load8(ea + 1));
     }
-    
+
+    // Bytes from ea to the end of its page, when they can be read directly.
+    // Returns nullptr for devices and watched pages, which must go through
+    // load8
+    const uint8_t* readSpan(uint16_t ea, uint16_t& size) const
+    {
+        const uint8_t* page = _readPages[ea >> 8];
+        size = 0x100 - (ea & 0xff);
+        return page ? page + (ea & 0xff) : nullptr;
+    }
+
     void store8(uint16_t ea, uint8_t v)
     {
-        if (ea >= SystemAddrStart) {
-            readOnlyAddr(ea);
+        uint8_t* page = _writePages[ea >> 8];
+        if (page) {
+            page[ea & 0xff] = v;
+            invalidateCode(ea, 1);
         } else {
-            _ram[ea] = v;
+            storeSlow(ea, v);
         }
     }
     
     void store16(uint16_t ea, uint16_t v)
     {
-        if (ea >= SystemAddrStart) {
-            readOnlyAddr(ea);
+        uint8_t* page = _writePages[ea >> 8];
+        if (page && (ea & 0xff) != 0xff) {
+            page[ea & 0xff] = v >> 8;
+            page[(ea & 0xff) + 1] = v;
+            invalidateCode(ea, 2);
         } else {
-            _ram[ea] = v >> 8;
-            _ram[ea + 1] = v;
+            store8(ea, v >> 8);
+            store8(ea + 1, v);
         }
     }
     
+    // Read without triggering watchpoints, for decoding and display
+    uint8_t fetch8(uint16_t ea) const
+    {
+        const PageMapping& page = _pageMap[ea >> 8];
+        if (page.read) {
+            return page.read[ea & 0xff];
+        }
+        return page.device ? page.device->read(ea) : 0;
+    }
+    
+    uint16_t fetch16(uint16_t ea) const
+    {
+        return (uint16_t(fetch8(ea)) << 8) | uint16_t(fetch8(ea + 1));
+    }
+    
   private:
+    uint8_t loadSlow(uint16_t ea);
+    void storeSlow(uint16_t ea, uint8_t v);
+    void updatePage(uint8_t page);
+    
+#ifdef SNAPSHOTS
+    // Note the pages covering addr to addr + size - 1 differ from _basePages
+    void markDirty(uint16_t addr, uint32_t size);
+    
+    // Add the state before the instruction at _pc to the history
+    void recordHistory();
+    
+    // Put back the state before history instruction i
+    void undoInst(uint64_t i);
+#endif
+    
+    void mapDefault(uint32_t size);
+    void mapPages(uint8_t firstPage, uint16_t numPages, const uint8_t* readMem, uint8_t* writeMem, Device*);
+    
     void push8(uint16_t& s, uint8_t v)
     {
-        _ram[--s] = v;
+        store8(--s, v);
     }
     
     void push16(uint16_t& s, uint16_t v)
     {
-        _ram[--s] = v;
-        _ram[--s] = v >> 8;
+        s -= 2;
+        store16(s, v);
+    }
+    
+    // Push everything for SWI, CWAI and interrupts. E is set first so it
+    // is saved with CC.
+    void pushEntireState();
+    
+    // Scheduler support
+    bool eventDue() const { return int32_t(_cycles - _nextEvent) >= 0; }
+    static bool before(uint32_t a, uint32_t b) { return int32_t(a - b) < 0; }
+    void insertTimer(Timer*, uint32_t time);
+    void removeTimer(uint8_t i);
+    void updateNextEvent();
+    bool serviceEvents(); // Returns true if an interrupt was taken
+    bool takeInterrupt();
+    bool waitForInterrupt(); // Returns false if nothing ended the wait before the next event or deadline
+    
+    // Discard any decoded instructions overlapping the size bytes at addr.
+    // Most writes are to bytes which are not part of a decoded instruction,
+    // so check that first.
+    void invalidateCode(uint16_t addr, uint16_t size)
+    {
+#ifdef DECODE_CACHE
+        uint16_t last = addr + size - 1;
+        if (isCode(addr) || isCode(last)) {
+            invalidateDecodeCache(addr, size);
+        }
+#endif
     }
     
+#ifdef DECODE_CACHE
+    bool isCode(uint16_t addr) const { return (_codeBytes[addr >> 3] & (1 << (addr & 0x07))) != 0; }
+    void setCode(uint16_t addr) { _codeBytes[addr >> 3] |= 1 << (addr & 0x07); }
+    void clearCode(uint16_t addr) { _codeBytes[addr >> 3] &= ~(1 << (addr & 0x07)); }
+#endif
+
+    // Return the decoded instruction at addr, from the cache if possible
+    const DecodedInst& fetchInst(uint16_t addr);
+    void decodeInst(uint16_t addr, DecodedInst&) const;
+    
+    template<typename P> bool executeLoop(RunState);
+    
+    // Instructions left in the current slice. The number run is added to
+    // _instructions when the slice returns, however it returns, so there's
+    // no store per instruction
+    struct SliceCount
+    {
+        SliceCount(Emulator& emu) : emu(emu), slice(emu._sliceInsts), left(slice) { }
+        ~SliceCount() { emu._instructions += slice - left; }
+        
+        Emulator& emu;
+        uint32_t slice;
+        uint32_t left;
+    };
+    
+#ifdef PROFILER
+    // Count an executed instruction and follow calls and returns
+    void profile(const DecodedInst&, uint16_t pc, uint16_t s, uint32_t cycles);
+#endif
+
+#ifdef TRACER
+    // Write a record of the instruction just executed to the Tracer
+    void traceInst(const DecodedInst&, uint16_t pc, uint16_t ea);
+#endif
+    
+    void trace()
+    {
+        _traceBuffer[_traceBufferIndex++] = _pc;
+        if (_traceBufferIndex >= TraceBufferSize) {
+            _traceBufferIndex = 0;
+        }
+    }
+    
+#ifdef DECODE_CACHE
+    // Threaded engine
+    template<typename P> bool executeBlocks();
+    Block* findBlock(uint16_t addr);
+    void translateBlock(uint16_t addr, Block&);
+    void flushBlocks();
+    void flushBlocks(uint16_t addr, uint16_t size);
+#endif
+    
     uint8_t pop8(uint16_t& s)
     {
-        return _ram[s++];
+        return load8(s++);
     }
     
     uint16_t pop16(uint16_t& s)
     {
-        uint16_t r = _ram[s++];
-        r <<= 8;
-        r |= _ram[s++];
+        uint16_t r = load16(s);
+        s += 2;
         return r;
     }
     
     uint8_t next8()
     {
-        uint8_t v = _ram[_pc];
+        uint8_t v = load8(_pc);
         _pc += 1;
         return v;
     }
     
     uint16_t next16()
     {
-        uint16_t v = (uint16_t(_ram[_pc]) << 8) | uint16_t(_ram[_pc + 1]);
+        uint16_t v = load16(_pc);
         _pc += 2;
         return v;
     }
     
     // Update the HNZVC condition codes
-    void HNZVC8()  { updateH(); xNZVC8(); }
-    void xNZVC8()  { updateNZ8(); updateV8(); updateC8(); }
-    void xNZVC16() { updateNZ16(); updateV16(); updateC16(); }
-    void xNZ018()  { updateNZ8(); _cc.V = false; _cc.C = true; }
-    void x0ZxC8()  { updateNZ8(); _cc.N = false; updateC8(); }
-    void x0Zxx8()  { updateNZ8(); _cc.N = false; }
-    void xNZVx8()  { updateNZ8(); updateV8(); }
-    void xNZ0x8()  { updateNZ8(); _cc.V = false; }
-    void xNZ0x16() { updateNZ16(); _cc.V = false; }
-    void xNZ0C8()  { updateNZ8(); _cc.V = false; updateC8(); }
-    void xNZxC8()  { updateNZ8(); updateC8(); }
-    void xNZxx8()  { updateNZ8(); }
+    void HNZVC8()  { setFlags(FlagOp::HNZVC8); }
+    void xNZVC8()  { setFlags(FlagOp::xNZVC8); }
+    void xNZVC16() { setFlags(FlagOp::xNZVC16); }
+    void xNZ018()  { setFlags(FlagOp::xNZ018); }
+    void x0ZxC8()  { setFlags(FlagOp::x0ZxC8); }
+    void x0Zxx8()  { setFlags(FlagOp::x0Zxx8); }
+    void xNZVx8()  { setFlags(FlagOp::xNZVx8); }
+    void xNZ0x8()  { setFlags(FlagOp::xNZ0x8); }
+    void xNZ0x16() { setFlags(FlagOp::xNZ0x16); }
+    void xNZ0C8()  { setFlags(FlagOp::xNZ0C8); }
+    void xNZxC8()  { setFlags(FlagOp::xNZxC8); }
+    void xNZxx8()  { setFlags(FlagOp::xNZxx8); }
+    
+    bool NxorV() const { return flagN() != flagV(); }
+    
+    // Read a single flag. With LAZY_FLAGS this is computed from the pending
+    // flag op if it updates that flag, so branches don't compute all of CC.
+    bool flagC() const
+    {
+#ifdef LAZY_FLAGS
+        switch(_flagOp) {
+            case FlagOp::HNZVC8:
+            case FlagOp::xNZVC8:
+            case FlagOp::x0ZxC8:
+            case FlagOp::xNZ0C8:
+            case FlagOp::xNZxC8:    return (_flagResult & 0x100) != 0;
+            case FlagOp::xNZVC16:   return (_flagResult & 0x10000) != 0;
+            case FlagOp::xNZ018:    return true;
+            default:                break;
+        }
+#endif
+        return _cc.C;
+    }
+    
+    bool flagZ() const
+    {
+#ifdef LAZY_FLAGS
+        switch(_flagOp) {
+            case FlagOp::None:      break;
+            case FlagOp::xNZVC16:
+            case FlagOp::xNZ0x16:   return uint16_t(_flagResult) == 0;
+            default:                return uint8_t(_flagResult) == 0;
+        }
+#endif
+        return _cc.Z;
+    }
+    
+    bool flagN() const
+    {
+#ifdef LAZY_FLAGS
+        switch(_flagOp) {
+            case FlagOp::None:      break;
+            case FlagOp::x0ZxC8:
+            case FlagOp::x0Zxx8:    return false;
+            case FlagOp::xNZVC16:
+            case FlagOp::xNZ0x16:   return (_flagResult & 0x8000) != 0;
+            default:                return (_flagResult & 0x80) != 0;
+        }
+#endif
+        return _cc.N;
+    }
+    
+    bool flagV() const
+    {
+#ifdef LAZY_FLAGS
+        uint32_t v = _flagLeft ^ _flagRight ^ _flagResult ^ (_flagResult >> 1);
+        switch(_flagOp) {
+            case FlagOp::HNZVC8:
+            case FlagOp::xNZVC8:
+            case FlagOp::xNZVx8:    return (v & 0x80) != 0;
+            case FlagOp::xNZVC16:   return (v & 0x8000) != 0;
+            case FlagOp::xNZ018:
+            case FlagOp::xNZ0x8:
+            case FlagOp::xNZ0x16:
+            case FlagOp::xNZ0C8:    return false;
+            default:                break;
+        }
+#endif
+        return _cc.V;
+    }
+    
+    // With LAZY_FLAGS the flag op and its operands are saved and the
+    // flags are computed when CC is read, or when the next flag op
+    // doesn't replace all the flags of the pending one.
+    void setFlags(FlagOp op)
+    {
+#ifdef LAZY_FLAGS
+        if (flagMask(_flagOp) & ~flagMask(op)) {
+            updateCC();
+        }
+        _flagOp = op;
+        _flagLeft = _left;
+        _flagRight = _right;
+        _flagResult = _result;
+#else
+        computeFlags(op, _cc, _left, _right, _result);
+#endif
+    }
+    
+    // All reads and writes of CC in the emulator go through these so
+    // pending flags are computed first
+    CC& cc() { updateCC(); return _cc; }
+    uint8_t& ccByte() { updateCC(); return _ccByte; }
+    
+    void updateCC()
+    {
+#ifdef LAZY_FLAGS
+        if (_flagOp != FlagOp::None) {
+            computeFlags(_flagOp, _cc, _flagLeft, _flagRight, _flagResult);
+            _flagOp = FlagOp::None;
+        }
+#endif
+    }
     
-    bool NxorV() { return (_cc.N ^ _cc.V) != 0; }
+    // Value of CC with any pending flags, without changing state
+    uint8_t ccValue() const
+    {
+#ifdef LAZY_FLAGS
+        union {
+            CC cc;
+            uint8_t byte;
+        } value;
+        value.byte = _ccByte;
+        computeFlags(_flagOp, value.cc, _flagLeft, _flagRight, _flagResult);
+        return value.byte;
+#else
+        return _ccByte;
+#endif
+    }
+    
+    static void computeFlags(FlagOp op, CC& cc, uint32_t left, uint32_t right, uint32_t result)
+    {
+        switch(op) {
+            case FlagOp::None:      break;
+            case FlagOp::HNZVC8:    updateH(cc, left, right, result); updateNZ8(cc, result); updateV8(cc, left, right, result); updateC8(cc, result); break;
+            case FlagOp::xNZVC8:    updateNZ8(cc, result); updateV8(cc, left, right, result); updateC8(cc, result); break;
+            case FlagOp::xNZVC16:   updateNZ16(cc, result); updateV16(cc, left, right, result); updateC16(cc, result); break;
+            case FlagOp::xNZ018:    updateNZ8(cc, result); cc.V = false; cc.C = true; break;
+            case FlagOp::x0ZxC8:    updateNZ8(cc, result); cc.N = false; updateC8(cc, result); break;
+            case FlagOp::x0Zxx8:    updateNZ8(cc, result); cc.N = false; break;
+            case FlagOp::xNZVx8:    updateNZ8(cc, result); updateV8(cc, left, right, result); break;
+            case FlagOp::xNZ0x8:    updateNZ8(cc, result); cc.V = false; break;
+            case FlagOp::xNZ0x16:   updateNZ16(cc, result); cc.V = false; break;
+            case FlagOp::xNZ0C8:    updateNZ8(cc, result); cc.V = false; updateC8(cc, result); break;
+            case FlagOp::xNZxC8:    updateNZ8(cc, result); updateC8(cc, result); break;
+            case FlagOp::xNZxx8:    updateNZ8(cc, result); break;
+        }
+    }
     
-    void updateH()
+    static void updateH(CC& cc, uint32_t left, uint32_t right, uint32_t result)
     {
-        _cc.H = ((_left ^ _right ^ _result) & 0x10) != 0;
+        cc.H = ((left ^ right ^ result) & 0x10) != 0;
     }
     
-    void updateNZ8()
+    static void updateNZ8(CC& cc, uint32_t result)
     {
-        _cc.Z = uint8_t(_result) == 0;
-        _cc.N = (_result & 0x80) != 0;
+        cc.Z = uint8_t(result) == 0;
+        cc.N = (result & 0x80) != 0;
     }
     
-    void updateNZ16()
+    static void updateNZ16(CC& cc, uint32_t result)
     {
-        _cc.Z = uint16_t(_result) == 0;
-        _cc.N = (_result & 0x8000) != 0;
+        cc.Z = uint16_t(result) == 0;
+        cc.N = (result & 0x8000) != 0;
     }
     
-    void updateC8()
+    static void updateC8(CC& cc, uint32_t result)
     {
-        _cc.C = (_result & 0x100) != 0;
+        cc.C = (result & 0x100) != 0;
     }
     
-    void updateC16()
+    static void updateC16(CC& cc, uint32_t result)
     {
-        _cc.C = (_result & 0x10000) != 0;
+        cc.C = (result & 0x10000) != 0;
     }
     
-    void updateV8()
+    static void updateV8(CC& cc, uint32_t left, uint32_t right, uint32_t result)
     {
-        _cc.V = ((_left ^ _right ^ _result ^ (_result >> 1)) & 0x80) != 0;
+        cc.V = ((left ^ right ^ result ^ (result >> 1)) & 0x80) != 0;
     }
     
-    void updateV16()
+    static void updateV16(CC& cc, uint32_t left, uint32_t right, uint32_t result)
     {
-        _cc.V = ((_left ^ _right ^ _result ^ (_result >> 1)) & 0x8000) != 0;
+        cc.V = ((left ^ right ^ result ^ (result >> 1)) & 0x8000) != 0;
     }
     
     void readOnlyAddr(uint16_t addr);
     
     void checkActiveBreakpoints();
+    bool isBreakpointAddr(uint16_t addr) const { return (_breakpointBits[addr >> 3] & (1 << (addr & 0x07))) != 0; }
+    bool breakpointHit(uint16_t addr, BPType, bool count = true);
 
     
     uint8_t* _ram;
+    uint32_t _ramSize;
+    
+    // Memory map, one entry per page. A nullptr in _readPages or _writePages
+    // sends the access to the slow path, which checks watchpoints, then
+    // calls the page's device, reports a write to ROM or ignores an
+    // unmapped page
+    const uint8_t* _readPages[NumPages];
+    uint8_t* _writePages[NumPages];
+    PageMapping _pageMap[NumPages];
     
     union {
         struct { uint8_t _b; uint8_t _a; };
@@ -542,6 +1185,14 @@ public:
     uint32_t _left = 0;
     uint32_t _right = 0;
     uint32_t _result = 0;
+    
+#ifdef LAZY_FLAGS
+    // Pending flag op and the operands it uses
+    FlagOp _flagOp = FlagOp::None;
+    uint32_t _flagLeft = 0;
+    uint32_t _flagRight = 0;
+    uint32_t _flagResult = 0;
+#endif
     Op _prevOp = Op::NOP;
     
     BOSS9Base* _boss9 = nullptr;
@@ -552,17 +1203,69 @@ public:
     Error _error = Error::None;
 
     // Breakpoint support
-    BreakpointEntry _breakpoints[NumBreakpoints];
-    bool _haveBreakpoints = false;
+    m8r::vector<BreakpointEntry> _breakpoints;
+    bool _haveBreakpoints = false; // Any enabled breakpoints or watchpoints
+    uint8_t _breakpointBits[65536 / 8]; // One bit per address with an enabled breakpoint
+    bool _watchReads[NumPages]; // Pages with an enabled read watchpoint
+    bool _watchWrites[NumPages]; // Pages with an enabled write watchpoint
+    bool _watchHit = false;
+    uint16_t _watchAddr = 0;
     uint32_t _subroutineDepth = 0; // Determines when we've returned from subroutine for Step Over and Step Out
     RunState _lastRunState = RunState::Running;
     
-    #ifdef TRACE
+    Engine _engine = Engine::Interpreter;
+    Policy _policy = Policy::Instrumented;
+    
+    // P::Cycles of the last execute loop run, for addCycles
+    bool _countCycles = true;
+    
+#ifdef PROFILER
+    Profiler* _profiler = nullptr;
+#endif
+
+#ifdef TRACER
+    Tracer* _tracer = nullptr;
+#endif
+
+#ifdef SNAPSHOTS
+    // Once a snapshot is taken, RAM pages are write protected until they
+    // are first written, so storeSlow can note which pages changed without
+    // slowing down the fast path
+    bool _trackDirty = false;
+    bool _dirtyPages[NumPages];
+    Snapshot::Page _basePages[NumPages]; // Contents of RAM when the last snapshot was taken or restored
+    History* _history = nullptr; // While recording
+#endif
+    
+#ifdef DECODE_CACHE
+    DecodedInst _decodeCache[DecodeCacheSize];
+    uint8_t _codeBytes[65536 / 8]; // One bit per byte which is part of a decoded instruction
+    Block* _blocks = nullptr; // Allocated when the Threaded engine is selected
+#else
+    DecodedInst _inst;
+#endif
+
     uint16_t _traceBuffer[TraceBufferSize];
     uint32_t _traceBufferIndex = 0;
-    #endif
     
-    uint32_t _cycles;
+    uint32_t _cycles = 0;
+    uint64_t _instructions = 0;
+    
+    enum class Wait { None, Sync, Cwai };
+    
+    TimerEvent _timers[MaxTimers]; // Min heap ordered by time
+    uint8_t _numTimers = 0;
+    uint32_t _nextEvent = NoEventCycles;
+    
+    uint32_t _sliceInsts = InstructionsToExecutePerContinue;
+    uint32_t _cycleDeadline = 0;
+    bool _haveDeadline = false;
+    
+    bool _irq = false;
+    bool _firq = false;
+    bool _nmi = false;
+    bool _nmiPending = false;
+    Wait _wait = Wait::None;
 };
 
 }
@@ -0,0 +1,230 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Profiler.cpp
+//  Guest program profiler
+//
+//  Created by Chris Marrin on 5/30/24.
+//
+
+#include "Profiler.h"
+
+#ifdef PROFILER
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+
+using namespace mc6809;
+
+// In an lwasm listing the source line starts this many columns after the
+// "):" that precedes the line number
+static constexpr size_t ListingSourceOffset = 16;
+
+Profiler::Profiler()
+{
+    start(0);
+}
+
+void Profiler::start(uint16_t entry)
+{
+    std::stable_sort(_symbols.begin(), _symbols.end(),
+                     [](const Symbol& a, const Symbol& b) { return a.addr < b.addr; });
+
+    _counts.assign(65536, 0);
+    _cycles.assign(65536, 0);
+    _nodes.clear();
+    _nodes.push_back({ 0, entry, 0, 0 });
+    _children.clear();
+    _node = 0;
+    _extraDepth = 0;
+}
+
+void Profiler::call(uint16_t addr)
+{
+    if (_extraDepth || _nodes[_node].depth >= MaxDepth) {
+        _extraDepth += 1;
+        return;
+    }
+
+    uint64_t key = (uint64_t(_node) << 16) | addr;
+    auto it = _children.find(key);
+    if (it != _children.end()) {
+        _node = it->second;
+        return;
+    }
+
+    uint32_t child = uint32_t(_nodes.size());
+    _nodes.push_back({ _node, addr, uint16_t(_nodes[_node].depth + 1), 0 });
+    _children[key] = child;
+    _node = child;
+}
+
+bool Profiler::loadSymbols(const char* filename)
+{
+    std::ifstream f(filename);
+    if (!f.is_open()) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(f, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+
+        // Listing lines with a label look like:
+        //
+        //      0200 860A             (   HelloWorld.asm):00009         main    lda #NumPrints
+        //
+        // Lines without an address in the first column are equates or
+        // comments, which aren't code.
+        size_t colon = line.find("):");
+        if (colon != std::string::npos) {
+            if (line.size() < 5 || !isxdigit(line[0]) || line[4] != ' ') {
+                continue;
+            }
+            size_t src = colon + ListingSourceOffset;
+            if (src >= line.size() || isspace(line[src]) || line[src] == '*' || line[src] == ';') {
+                continue;
+            }
+            size_t end = line.find_first_of(" \t:", src);
+            uint16_t addr = uint16_t(strtoul(line.substr(0, 4).c_str(), nullptr, 16));
+            addSymbol(addr, line.substr(src, end - src));
+            continue;
+        }
+
+        // Symbol dump lines look like "main EQU $0200"
+        std::istringstream stream(line);
+        std::string name, equ, value;
+        if (!(stream >> name >> equ >> value) || (equ != "EQU" && equ != "equ")) {
+            continue;
+        }
+        if (value[0] == '$') {
+            value.erase(0, 1);
+        }
+        addSymbol(uint16_t(strtoul(value.c_str(), nullptr, 16)), name);
+    }
+    return true;
+}
+
+void Profiler::addSymbol(uint16_t addr, const std::string& name)
+{
+    // Local labels (1, 2, ...) and ones lwasm marks with @ or $ aren't useful
+    if (name.empty() || isdigit(name[0]) || name.find_first_of("@$?") != std::string::npos) {
+        return;
+    }
+    _symbols.push_back({ addr, name });
+}
+
+const Profiler::Symbol* Profiler::findSymbol(uint16_t addr) const
+{
+    auto it = std::upper_bound(_symbols.begin(), _symbols.end(), addr,
+                               [](uint16_t a, const Symbol& s) { return a < s.addr; });
+    if (it == _symbols.begin()) {
+        return nullptr;
+    }
+
+    // More than one label at an address uses the first
+    --it;
+    while (it != _symbols.begin() && (it - 1)->addr == it->addr) {
+        --it;
+    }
+    return &*it;
+}
+
+std::string Profiler::addrToString(uint16_t addr) const
+{
+    char buf[32];
+    const Symbol* sym = findSymbol(addr);
+    if (!sym) {
+        snprintf(buf, sizeof(buf), "$%04x", addr);
+        return buf;
+    }
+    if (sym->addr == addr) {
+        return sym->name;
+    }
+    snprintf(buf, sizeof(buf), "+$%x", addr - sym->addr);
+    return sym->name + buf;
+}
+
+void Profiler::writeReport(FILE* f, uint32_t maxEntries) const
+{
+    struct Entry
+    {
+        uint16_t addr;
+        uint64_t counts;
+        uint64_t cycles;
+    };
+
+    uint64_t totalCounts = 0;
+    uint64_t totalCycles = 0;
+    std::vector<Entry> addrs;
+    std::vector<Entry> funcs;
+
+    for (uint32_t addr = 0; addr < 65536; ++addr) {
+        if (_counts[addr] == 0) {
+            continue;
+        }
+        totalCounts += _counts[addr];
+        totalCycles += _cycles[addr];
+        addrs.push_back({ uint16_t(addr), _counts[addr], _cycles[addr] });
+
+        // Addresses before the first symbol go in their own bucket
+        const Symbol* sym = findSymbol(addr);
+        uint16_t funcAddr = sym ? sym->addr : 0;
+        if (funcs.empty() || funcs.back().addr != funcAddr) {
+            funcs.push_back({ funcAddr, 0, 0 });
+        }
+        funcs.back().counts += _counts[addr];
+        funcs.back().cycles += _cycles[addr];
+    }
+
+    auto byCycles = [](const Entry& a, const Entry& b) { return a.cycles > b.cycles; };
+    std::stable_sort(addrs.begin(), addrs.end(), byCycles);
+    std::stable_sort(funcs.begin(), funcs.end(), byCycles);
+
+    double percent = totalCycles ? 100.0 / double(totalCycles) : 0;
+
+    fprintf(f, "Profile: %llu instructions, %llu cycles\n\n",
+            (unsigned long long) totalCounts, (unsigned long long) totalCycles);
+
+    fprintf(f, "By function:\n");
+    fprintf(f, "%14s %7s %14s  %s\n", "cycles", "%", "instructions", "function");
+    for (uint32_t i = 0; i < funcs.size() && i < maxEntries; ++i) {
+        const Entry& e = funcs[i];
+        fprintf(f, "%14llu %6.2f%% %14llu  %s\n", (unsigned long long) e.cycles, double(e.cycles) * percent,
+                (unsigned long long) e.counts, addrToString(e.addr).c_str());
+    }
+
+    fprintf(f, "\nBy address:\n");
+    fprintf(f, "%14s %7s %14s  %s\n", "cycles", "%", "instructions", "address");
+    for (uint32_t i = 0; i < addrs.size() && i < maxEntries; ++i) {
+        const Entry& e = addrs[i];
+        fprintf(f, "%14llu %6.2f%% %14llu  $%04x %s\n", (unsigned long long) e.cycles, double(e.cycles) * percent,
+                (unsigned long long) e.counts, e.addr, addrToString(e.addr).c_str());
+    }
+}
+
+void Profiler::writeFolded(FILE* f) const
+{
+    // Parents are always created before their children, so each path can
+    // be built from its parent's
+    std::vector<std::string> paths(_nodes.size());
+    for (uint32_t i = 0; i < _nodes.size(); ++i) {
+        const Node& node = _nodes[i];
+        paths[i] = (i == 0) ? addrToString(node.addr) : (paths[node.parent] + ";" + addrToString(node.addr));
+        if (node.cycles) {
+            fprintf(f, "%s %llu\n", paths[i].c_str(), (unsigned long long) node.cycles);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,117 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Profiler.h
+//  Guest program profiler
+//
+//  Created by Chris Marrin on 5/30/24.
+//
+
+#pragma once
+
+#include "MC6809.h"
+
+#ifdef PROFILER
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mc6809 {
+
+// Profiler counts instructions and cycles for every address the guest
+// program executes. It also follows JSR, BSR, SWI and interrupts into
+// subroutines and RTS, RTI and PULS PC out of them, keeping a tree of
+// every call path seen and the cycles spent in each. Symbols from an
+// lwasm listing or symbol dump give the addresses names.
+//
+// The emulator calls count(), call() and ret() for each instruction
+// when a profiler is set. Profiling always counts cycles and uses the
+// interpreter.
+class Profiler
+{
+public:
+    Profiler();
+
+    // Clear all counts. entry is the function at the root of all call paths
+    void start(uint16_t entry);
+
+    // Load symbols from an lwasm listing (-l) or symbol dump (--symbol-dump).
+    // Returns false if the file can't be opened
+    bool loadSymbols(const char* filename);
+
+    // Add a symbol, such as one from the Assembler. Symbols are sorted
+    // when profiling starts
+    void addSymbol(uint16_t addr, const std::string& name);
+
+    void count(uint16_t pc, uint32_t cycles)
+    {
+        _counts[pc] += 1;
+        _cycles[pc] += cycles;
+        _nodes[_node].cycles += cycles;
+    }
+
+    void call(uint16_t addr);
+
+    void ret()
+    {
+        if (_extraDepth) {
+            _extraDepth -= 1;
+        } else if (_node != 0) {
+            _node = _nodes[_node].parent;
+        }
+    }
+
+    // Hot spots by function and by address, highest cycles first
+    void writeReport(FILE*, uint32_t maxEntries = 20) const;
+
+    // One line per call path in the folded format used by flamegraph.pl
+    // and speedscope: "main;sub1;sub2 cycles"
+    void writeFolded(FILE*) const;
+
+private:
+    static constexpr uint32_t MaxDepth = 64; // Deeper calls are counted in the caller
+
+    struct Symbol
+    {
+        uint16_t addr;
+        std::string name;
+    };
+
+    struct Node
+    {
+        uint32_t parent;
+        uint16_t addr;
+        uint16_t depth;
+        uint64_t cycles;
+    };
+
+    // Symbol at or before addr, or nullptr if none
+    const Symbol* findSymbol(uint16_t addr) const;
+
+    // Name of the symbol containing addr, with an offset if it's not the
+    // start of the symbol, or the address if there is no symbol
+    std::string addrToString(uint16_t addr) const;
+
+    std::vector<uint32_t> _counts;
+    std::vector<uint64_t> _cycles;
+    std::vector<Symbol> _symbols; // Sorted by addr
+
+    // Call tree. Node 0 is the entry function. Children are found by
+    // (parent << 16) | addr
+    std::vector<Node> _nodes;
+    std::unordered_map<uint64_t, uint32_t> _children;
+    uint32_t _node = 0;
+    uint32_t _extraDepth = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,221 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Tracer.cpp
+//  Binary execution trace
+//
+//  Created by Chris Marrin on 6/2/24.
+//
+
+#include "Tracer.h"
+
+#ifdef TRACER
+
+#include "DisplayInst.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace mc6809;
+
+static const char TraceMagic[8] = { '6', '8', '0', '9', 'T', 'R', 'C', '1' };
+
+Tracer::Tracer(uint32_t capacity)
+    : _capacity(capacity)
+{
+    _buffer = new TraceRecord[_capacity];
+}
+
+Tracer::~Tracer()
+{
+    close();
+    delete [ ] _buffer;
+}
+
+bool Tracer::open(const char* filename)
+{
+    close();
+
+    _fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0) {
+        return false;
+    }
+
+    if (!mapChunk(0)) {
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    // Records start after the header, which is filled in by close()
+    _fileOffset = sizeof(TraceHeader);
+    _head = 0;
+    _tail = 0;
+    _stalls = 0;
+    _stop = false;
+    _thread = std::thread(&Tracer::drain, this);
+    return true;
+}
+
+void Tracer::close()
+{
+    if (_fd < 0) {
+        return;
+    }
+
+    _stop = true;
+    _thread.join();
+
+    if (_chunk) {
+        munmap(_chunk, ChunkSize);
+        _chunk = nullptr;
+    }
+
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TraceMagic, sizeof(header.magic));
+    header.recordSize = sizeof(TraceRecord);
+    header.count = (_fileOffset - sizeof(TraceHeader)) / sizeof(TraceRecord);
+    header.stalls = _stalls;
+    pwrite(_fd, &header, sizeof(header), 0);
+
+    // The last chunk is only partly used
+    ftruncate(_fd, _fileOffset);
+    ::close(_fd);
+    _fd = -1;
+}
+
+bool Tracer::mapChunk(size_t offset)
+{
+    if (_chunk) {
+        munmap(_chunk, ChunkSize);
+        _chunk = nullptr;
+    }
+
+    if (ftruncate(_fd, offset + ChunkSize) != 0) {
+        return false;
+    }
+
+    void* mem = mmap(nullptr, ChunkSize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, offset);
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+
+    _chunk = reinterpret_cast<uint8_t*>(mem);
+    _chunkOffset = offset;
+    return true;
+}
+
+bool Tracer::write(const TraceRecord* records, uint32_t count)
+{
+    // ChunkSize is a multiple of the record size and records start one
+    // record in, so a record never straddles chunks
+    while (count) {
+        if (_fileOffset >= _chunkOffset + ChunkSize && !mapChunk(_chunkOffset + ChunkSize)) {
+            return false;
+        }
+        size_t offset = _fileOffset - _chunkOffset;
+        uint32_t n = uint32_t(std::min<size_t>(count, (ChunkSize - offset) / sizeof(TraceRecord)));
+        memcpy(_chunk + offset, records, n * sizeof(TraceRecord));
+        _fileOffset += n * sizeof(TraceRecord);
+        records += n;
+        count -= n;
+    }
+    return true;
+}
+
+void Tracer::drain()
+{
+    bool ok = true;
+
+    while (true) {
+        // Read _stop first so records committed before it was set are
+        // always written
+        bool stop = _stop.load(std::memory_order_acquire);
+        uint64_t tail = _tail.load(std::memory_order_relaxed);
+        uint64_t head = _head.load(std::memory_order_acquire);
+
+        if (head == tail) {
+            if (stop) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        // Write up to the end of the ring, the rest goes next time around
+        uint32_t index = uint32_t(tail & (_capacity - 1));
+        uint32_t count = uint32_t(std::min<uint64_t>(head - tail, _capacity - index));
+
+        // If the file can't be written keep consuming so the emulator
+        // doesn't stall forever
+        if (ok) {
+            ok = write(_buffer + index, count);
+        }
+        _tail.store(tail + count, std::memory_order_release);
+    }
+}
+
+bool Tracer::decode(const char* filename, FILE* out)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        return false;
+    }
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+            memcmp(header.magic, TraceMagic, sizeof(header.magic)) != 0 ||
+            header.recordSize != sizeof(TraceRecord)) {
+        fclose(f);
+        return false;
+    }
+
+    // DisplayInst reads the instruction from an emulator's memory, so
+    // put each one in a scratch emulator
+    uint8_t* ram = new uint8_t[65536];
+    memset(ram, 0, 65536);
+    Emulator* emu = new Emulator(ram, 65536, nullptr);
+
+    fprintf(out, "%llu instructions", (unsigned long long) header.count);
+    if (header.stalls) {
+        fprintf(out, ", emulator waited on a full trace buffer %llu times", (unsigned long long) header.stalls);
+    }
+    fprintf(out, "\n");
+
+    TraceRecord r;
+    m8r::string s;
+    for (uint64_t i = 0; i < header.count && fread(&r, sizeof(r), 1, f) == 1; ++i) {
+        for (uint8_t b = 0; b < r.size && b < MaxInstSize; ++b) {
+            ram[uint16_t(r.pc + b)] = r.bytes[b];
+        }
+        DisplayInst::instToString(*emu, s, r.pc);
+        s = s.trim();
+
+        fprintf(out, "%10u %-32s A=%02x B=%02x X=%04x Y=%04x U=%04x S=%04x DP=%02x CC=%02x",
+                r.cycles, s.c_str(), r.a, r.b, r.x, r.y, r.u, r.s, r.dp, r.cc);
+
+        // Show memory for instructions that access it
+        uint8_t opIndex = (r.size > 1 && (r.bytes[0] == 0x10 || r.bytes[0] == 0x11)) ? r.bytes[1] : r.bytes[0];
+        Adr adr = Emulator::opcode(opIndex)->adr;
+        if (adr == Adr::Direct || adr == Adr::Extended || adr == Adr::Indexed) {
+            fprintf(out, " [$%04x]=%02x%02x", r.ea, r.mem[0], r.mem[1]);
+        }
+        fprintf(out, "\n");
+    }
+
+    delete emu;
+    delete [ ] ram;
+    fclose(f);
+    return true;
+}
+
+#endif
@@ -0,0 +1,127 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  Tracer.h
+//  Binary execution trace
+//
+//  Created by Chris Marrin on 6/2/24.
+//
+
+#pragma once
+
+#include "MC6809.h"
+
+#ifdef TRACER
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+namespace mc6809 {
+
+// One executed instruction. Registers and cycles are the values after the
+// instruction ran. For instructions that access memory ea is the effective
+// address and mem holds the 2 bytes there afterward, so stores show the
+// value written.
+struct TraceRecord
+{
+    uint32_t cycles;
+    uint16_t pc;
+    uint16_t ea;
+    uint16_t x, y, u, s;
+    uint8_t a, b, dp, cc;
+    uint8_t bytes[MaxInstSize];
+    uint8_t size;
+    uint8_t mem[2];
+    uint8_t unused[4];
+};
+
+static_assert(sizeof(TraceRecord) == 32, "TraceRecord must be 32 bytes");
+
+// The trace file is this header followed by count TraceRecords
+struct TraceHeader
+{
+    char magic[8];
+    uint32_t recordSize;
+    uint32_t unused;
+    uint64_t count;
+    uint64_t stalls;
+};
+
+static_assert(sizeof(TraceHeader) == 32, "TraceHeader must be 32 bytes");
+
+// Tracer writes TraceRecords to a file. The emulator fills records in a
+// ring buffer and a background thread copies them to the memory mapped
+// file, so tracing only costs the emulator the time to fill in a record.
+// There is one producer and one consumer so the ring needs no locks. If
+// the ring fills the emulator waits for the thread to catch up, so no
+// records are lost.
+//
+// The emulator writes records while running the Traced policy with a
+// tracer set.
+class Tracer
+{
+public:
+    static constexpr uint32_t DefaultCapacity = 1 << 18; // Records, must be a power of 2
+
+    Tracer(uint32_t capacity = DefaultCapacity);
+    ~Tracer();
+
+    // Create the file and start the thread. Returns false if the file
+    // can't be created.
+    bool open(const char* filename);
+
+    // Write any remaining records, finish the header and close the file
+    void close();
+
+    bool isOpen() const { return _fd >= 0; }
+
+    // Return the next record to fill in, then call commit()
+    TraceRecord& next()
+    {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        while (head - _tail.load(std::memory_order_acquire) >= _capacity) {
+            _stalls += 1;
+            std::this_thread::yield();
+        }
+        return _buffer[head & (_capacity - 1)];
+    }
+
+    void commit() { _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    uint64_t count() const { return _head.load(std::memory_order_relaxed); }
+
+    // Print the records in filename as text, using DisplayInst to show
+    // each instruction. Returns false if the file can't be read.
+    static bool decode(const char* filename, FILE* out);
+
+private:
+    static constexpr size_t ChunkSize = 16 * 1024 * 1024; // Bytes of file mapped at a time
+
+    void drain();
+    bool write(const TraceRecord*, uint32_t count);
+    bool mapChunk(size_t offset);
+
+    TraceRecord* _buffer = nullptr;
+    uint32_t _capacity;
+    std::atomic<uint64_t> _head { 0 }; // Next record the emulator fills
+    std::atomic<uint64_t> _tail { 0 }; // Next record the thread writes
+    std::atomic<bool> _stop { false };
+    uint64_t _stalls = 0;
+
+    std::thread _thread;
+    int _fd = -1;
+    uint8_t* _chunk = nullptr; // Mapped part of the file
+    size_t _chunkOffset = 0; // File offset of _chunk
+    size_t _fileOffset = 0; // Where the next record goes
+};
+
+}
+
+#endif
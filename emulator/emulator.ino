@@ -7,6 +7,7 @@
 #include <Arduino.h>
 
 #include "BOSS9.h"
+#include "Loader.h"
 
 // Test data (see test/HelloWorld.asm)
 //        *  calling monitor c function
@@ -71,17 +72,7 @@ char simpleTest[ ] =
 
 static constexpr bool StartInMonitor = true;
 static constexpr uint32_t MemorySize = 32768;
-
-char* findNextLine(char* s)
-{
-    while (*s != '\n' && *s != '\0') {
-        ++s;
-    }
-    if (*s != '\0') {
-        s++;
-    }
-    return s;
-}
+static constexpr uint32_t ConsoleCheckTime = 10000; // us between checks for ESC
 
 class ESPBOSS9 : public mc6809::BOSS9<MemorySize>
 {
@@ -101,24 +92,15 @@ class ESPBOSS9 : public mc6809::BOSS9<MemorySize>
 
         uint16_t startAddr = 0;
         emulator().setStack(0x6000);
-
-        char* fileString = simpleTest;
-        
-        emulator().loadStart();
-        while (true) {
-            bool finished;
-            if (!emulator().loadLine(fileString, finished)) {
-                Serial.println("Unable to load file\n");
-                break;
-            }
-
-            fileString = findNextLine(fileString);
-            if (*fileString == '\0') {
-                break;
-            }
+        setSliceTime(ConsoleCheckTime);
+
+        mc6809::Loader loader(emulator());
+        if (loader.load(simpleTest, sizeof(simpleTest))) {
+            startAddr = loader.startAddr();
+        } else {
+            Serial.print("Unable to load file: ");
+            Serial.println(loader.error());
         }
-    
-        startAddr = emulator().loadEnd();
 
         startExecution(startAddr, StartInMonitor);
     }
@@ -134,6 +116,11 @@ class ESPBOSS9 : public mc6809::BOSS9<MemorySize>
         Serial.write(c);
     }
 
+    virtual void write(const char* buf, uint32_t size) const override
+    {
+        Serial.write(reinterpret_cast<const uint8_t*>(buf), size);
+    }
+
     virtual int getc() override
     {
         int c = Serial.read();
@@ -287,7 +287,10 @@ bool SRecordParser::ParseLine( unsigned lineNum, const char *line )
          sRecData.m_dataLen = lineLen - sRecData.m_addrLen - 1;
          memcpy( sRecData.m_data, x, sRecData.m_dataLen );
 
-         ParsedData( &sRecData );
+         if ( !ParsedData( &sRecData ))
+         {
+            return false;
+         }
          break;
       }
 
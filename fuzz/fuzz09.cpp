@@ -0,0 +1,800 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  fuzz09.cpp
+//  Differential test of the mc6809 Emulator against the sbc09 engine
+//
+//  Created by Chris Marrin on 6/14/24.
+//
+
+// fuzz09 runs the Emulator and interpr() from sbc09/engine.c in lockstep,
+// comparing the registers and RAM after every instruction.
+//
+// With no files it runs random straight-line programs. Each is made of
+// documented instructions with random operands and postbytes, run from a
+// random machine state. Branches have an offset of 0 and there are no
+// jumps, calls or returns, so every instruction runs once unless the
+// program writes over its own code. When the cores differ the program is
+// shrunk to the fewest instructions which still show it and printed along
+// with the starting state.
+//
+// With s19 files it runs each of them. BOSS9 calls are made by the
+// Emulator and the engine is given the result.
+//
+// The sbc09 engine ignores writes to $8000-$ffff, so that's ROM in the
+// Emulator too and only RAM below it is compared. Accumulator loads from
+// the engine's IO page ($e000) read memory like any other address.
+//
+// Usage: fuzz09 -n programs -l length -s seed -m steps -c ccmask -v [filename ...]
+//
+//          -n:         number of random programs, default 100000
+//          -l:         instructions in each random program, default 32
+//          -s:         random seed, default 1
+//          -m:         most instructions to run from a file, default 10000000
+//          -c:         CC bits to leave out of the compare, in hex. Bits
+//                      which are undefined or the engine is known to get
+//                      wrong are always left out
+//          -v:         show every mismatch rather than one per opcode
+//          filename:   s19 files to run instead of random programs
+
+#include "BOSS9.h"
+#include "DisplayInst.h"
+#include "Loader.h"
+
+#include <csetjmp>
+#include <cstdio>
+#include <random>
+#include <set>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#define engine extern
+#include "../sbc09/v09.h"
+
+// Called by interpr()
+void do_trace(void);
+void do_escape(void);
+int do_input(int);
+void do_output(int, int);
+}
+
+using namespace mc6809;
+
+static constexpr uint32_t RomStart = 0x8000;
+static constexpr uint16_t ProgramStart = 0x0100;
+static constexpr uint16_t StackStart = 0x7e00;
+static constexpr uint8_t CCHalfCarry = 0x20;
+static constexpr uint8_t CCOverflow = 0x02;
+static constexpr uint8_t DaaOpcode = 0x19;
+static constexpr uint8_t SwiOpcode = 0x3f;
+static constexpr uint8_t RtiOpcode = 0x3b;
+
+class FuzzBOSS9 : public BOSS9<65536>
+{
+  public:
+    std::string& output() { return _output; }
+
+  protected:
+    virtual void putc(char c) const override { _output += c; }
+    virtual int getc() override { return 0; }
+    virtual bool handleRunLoop() override { return true; }
+
+  private:
+    mutable std::string _output;
+};
+
+struct State
+{
+    uint16_t pc, x, y, u, s;
+    uint8_t a, b, dp, cc;
+};
+
+// Result of a lockstep run
+struct Mismatch
+{
+    bool found = false;
+    uint64_t step = 0;
+    bool stopped = false; // At an instruction which isn't tested
+    uint16_t pc = 0; // Instruction which caused it
+    std::string diff;
+};
+
+static FuzzBOSS9* boss9;
+static jmp_buf done;
+static uint64_t steps;
+static uint64_t maxSteps;
+static bool firstTrace;
+static bool resync;
+static uint8_t lastPage;
+static uint8_t lastOp;
+static bool needSync;
+static bool needSyncCC;
+static uint16_t lastPC;
+static uint8_t ccIgnore;
+static Mismatch mismatch;
+
+// Known differences, by page (0, 1 or 2 for $10 or $11) and opcode
+static uint8_t ccUndefined[3][256];
+static bool engineWrong[3][256];
+
+static bool documented[3][256];
+
+// Instructions to test. Everything but SYNC and CWAI on the first page and
+// just the documented ones on the others
+static void initOpcodes()
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        Op op = Emulator::opcode(i)->op;
+        documented[0][i] = op != Op::ILL && op != Op::Page2 && op != Op::Page3 && op != Op::SYNC && op != Op::CWAI;
+    }
+    for (uint8_t op = 0x21; op <= 0x2f; ++op) {
+        documented[1][op] = true;
+    }
+    for (uint8_t op : { 0x3f, 0x83, 0x8c, 0x8e, 0x93, 0x9c, 0x9e, 0x9f, 0xa3, 0xac, 0xae, 0xaf,
+                        0xb3, 0xbc, 0xbe, 0xbf, 0xce, 0xde, 0xdf, 0xee, 0xef, 0xfe, 0xff }) {
+        documented[1][op] = true;
+    }
+    for (uint8_t op : { 0x3f, 0x83, 0x8c, 0x93, 0x9c, 0xa3, 0xac, 0xb3, 0xbc }) {
+        documented[2][op] = true;
+    }
+}
+
+// Indexed postbytes the 6809 defines
+static bool validPostbyte(uint8_t pb)
+{
+    if (!(pb & 0x80)) {
+        return true;
+    }
+    uint8_t mode = pb & 0x0f;
+    bool indirect = pb & 0x10;
+    return !(mode == 0x07 || mode == 0x0a || mode == 0x0e ||
+             (mode == 0x0f && (!indirect || (pb & 0x60))) ||
+             (indirect && (mode == 0x00 || mode == 0x02)));
+}
+
+// TFR and EXG between registers of the same size
+static bool validRegPair(uint8_t pb)
+{
+    uint8_t src = pb >> 4;
+    uint8_t dst = pb & 0x0f;
+    return (src <= 5 && dst <= 5) || (src >= 8 && src <= 11 && dst >= 8 && dst <= 11);
+}
+
+// Returns false for an instruction the cores aren't compared on
+static bool tested(uint16_t pc, uint8_t page, uint8_t op)
+{
+    if (!documented[page][op]) {
+        return false;
+    }
+    while (mem[pc] == 0x10 || mem[pc] == 0x11) {
+        pc += 1;
+    }
+    uint8_t pb = mem[uint16_t(pc + 1)];
+    const Opcode* opcode = Emulator::opcode(op);
+    if (opcode->adr == Adr::Indexed) {
+        return validPostbyte(pb);
+    }
+    if (opcode->op == Op::TFR || opcode->op == Op::EXG) {
+        return validRegPair(pb);
+    }
+    return true;
+}
+
+static void initKnownDifferences()
+{
+    // The 6809 leaves H undefined after these. The sbc09 engine sets it
+    // for shifts, NEG and CMP/SUB, the Emulator leaves it alone
+    static const uint8_t halfCarry[ ] = {
+        0x00, 0x04, 0x07, 0x08, 0x40, 0x44, 0x47, 0x48, 0x50, 0x54, 0x57, 0x58,
+        0x60, 0x64, 0x67, 0x68, 0x70, 0x74, 0x77, 0x78,
+        0x80, 0x81, 0x82, 0x90, 0x91, 0x92, 0xa0, 0xa1, 0xa2, 0xb0, 0xb1, 0xb2,
+        0xc0, 0xc1, 0xc2, 0xd0, 0xd1, 0xd2, 0xe0, 0xe1, 0xe2, 0xf0, 0xf1, 0xf2,
+    };
+    for (uint8_t op : halfCarry) {
+        ccUndefined[0][op] |= CCHalfCarry;
+    }
+
+    // TST should clear V but the engine leaves it alone
+    for (uint8_t op : { 0x0d, 0x4d, 0x5d, 0x6d, 0x7d }) {
+        ccUndefined[0][op] |= CCOverflow;
+    }
+
+    // The engine's DAA adds the correction twice when H is set and
+    // doesn't set N or Z, so the Emulator is taken to be right
+    engineWrong[0][DaaOpcode] = true;
+
+    // The engine's SWI sets E after it pushes CC rather than before, and
+    // its RTI looks at E before it pulls CC rather than after
+    for (uint8_t page = 0; page < 3; ++page) {
+        engineWrong[page][SwiOpcode] = true;
+    }
+    engineWrong[0][RtiOpcode] = true;
+}
+
+static State emulatorState(Emulator& emu)
+{
+    return { emu.getReg(Reg::PC), emu.getReg(Reg::X), emu.getReg(Reg::Y), emu.getReg(Reg::U), emu.getReg(Reg::S),
+             uint8_t(emu.getReg(Reg::A)), uint8_t(emu.getReg(Reg::B)), uint8_t(emu.getReg(Reg::DP)), uint8_t(emu.getReg(Reg::CC)) };
+}
+
+static State engineState()
+{
+    return { pcreg, xreg, yreg, ureg, sreg, *areg, *breg, dpreg, ccreg };
+}
+
+static void setEmulatorState(Emulator& emu, const State& st)
+{
+    emu.setReg(Reg::PC, st.pc);
+    emu.setReg(Reg::X, st.x);
+    emu.setReg(Reg::Y, st.y);
+    emu.setReg(Reg::U, st.u);
+    emu.setReg(Reg::S, st.s);
+    emu.setReg(Reg::A, st.a);
+    emu.setReg(Reg::B, st.b);
+    emu.setReg(Reg::DP, st.dp);
+    emu.setReg(Reg::CC, st.cc);
+}
+
+static void setEngineState(const State& st)
+{
+    pcreg = st.pc;
+    xreg = st.x;
+    yreg = st.y;
+    ureg = st.u;
+    sreg = st.s;
+    *areg = st.a;
+    *breg = st.b;
+    dpreg = st.dp;
+    ccreg = st.cc;
+}
+
+static std::string stateToString(const State& st)
+{
+    char buf[100];
+    snprintf(buf, sizeof(buf), "PC=%04x A=%02x B=%02x X=%04x Y=%04x U=%04x S=%04x DP=%02x CC=%02x",
+             st.pc, st.a, st.b, st.x, st.y, st.u, st.s, st.dp, st.cc);
+    return buf;
+}
+
+// Page (0, 1 or 2 for $10 or $11) and opcode of the instruction at addr
+static void instOpcode(const uint8_t* memory, uint16_t addr, uint8_t& page, uint8_t& op)
+{
+    page = 0;
+    while (memory[addr] == 0x10 || memory[addr] == 0x11) {
+        page = memory[addr] - 0x0f;
+        addr += 1;
+    }
+    op = memory[addr];
+}
+
+static std::string compare(Emulator& emu, uint8_t cc)
+{
+    State e = emulatorState(emu);
+    State v = engineState();
+    std::string diff;
+
+    if (e.pc != v.pc || e.x != v.x || e.y != v.y || e.u != v.u || e.s != v.s ||
+            e.a != v.a || e.b != v.b || e.dp != v.dp || ((e.cc ^ v.cc) & ~cc) != 0) {
+        diff += "  emulator: " + stateToString(e) + "\n";
+        diff += "  sbc09:    " + stateToString(v) + "\n";
+    } else if (e.cc != v.cc) {
+        // Only bits which aren't compared differ. Give the engine the
+        // Emulator's so they don't show up in a later instruction
+        needSyncCC = true;
+        escape = 1;
+    }
+
+    const uint8_t* ram = emu.getAddr(0);
+    if (memcmp(ram, mem, RomStart) == 0) {
+        return diff;
+    }
+    for (uint32_t addr = 0; addr < RomStart; ++addr) {
+        if (ram[addr] != mem[addr]) {
+            char buf[60];
+            snprintf(buf, sizeof(buf), "  [$%04x] emulator=%02x sbc09=%02x\n", addr, ram[addr], mem[addr]);
+            diff += buf;
+            if (diff.size() > 1000) {
+                break;
+            }
+        }
+    }
+    return diff;
+}
+
+// The engine doesn't wrap a 16 bit access at $ffff around to $0000, it
+// goes past the end of mem. Returns true if the instruction at pc uses
+// $ffff as an address or a pointer
+static bool touchesTop(uint16_t pc)
+{
+    while (mem[pc] == 0x10 || mem[pc] == 0x11) {
+        pc += 1;
+    }
+
+    uint16_t ea;
+    switch (Emulator::opcode(mem[pc])->adr) {
+        default:
+            return false;
+        case Adr::Direct:
+            ea = uint16_t(dpreg << 8 | mem[uint16_t(pc + 1)]);
+            break;
+        case Adr::Extended:
+            ea = uint16_t(mem[uint16_t(pc + 1)] << 8 | mem[uint16_t(pc + 2)]);
+            break;
+        case Adr::Indexed: {
+            uint8_t pb = mem[uint16_t(pc + 1)];
+            uint16_t regs[ ] = { xreg, yreg, ureg, sreg };
+            uint16_t reg = regs[(pb >> 5) & 0x03];
+            uint8_t off8 = mem[uint16_t(pc + 2)];
+            uint16_t off16 = uint16_t(off8 << 8 | mem[uint16_t(pc + 3)]);
+
+            if (!(pb & 0x80)) {
+                return uint16_t(reg + ((pb & 0x10) ? (pb | 0xffe0) : (pb & 0x0f))) == 0xffff;
+            }
+            switch (pb & 0x0f) {
+                default:  ea = reg; break;
+                case 0x2: ea = reg - 1; break;
+                case 0x3: ea = reg - 2; break;
+                case 0x5: ea = reg + int8_t(*breg); break;
+                case 0x6: ea = reg + int8_t(*areg); break;
+                case 0x8: ea = reg + int8_t(off8); break;
+                case 0x9: ea = reg + off16; break;
+                case 0xb: ea = reg + uint16_t(*areg << 8 | *breg); break;
+                case 0xc: ea = pc + 3 + int8_t(off8); break;
+                case 0xd: ea = pc + 4 + off16; break;
+                case 0xf: ea = off16; break;
+            }
+            if ((pb & 0x10) && ea != 0xffff) {
+                ea = uint16_t(mem[ea] << 8 | mem[uint16_t(ea + 1)]);
+            }
+            break;
+        }
+    }
+    return ea == 0xffff;
+}
+
+// Look at the instruction the engine is about to run
+static void nextInstruction()
+{
+    if (steps >= maxSteps) {
+        longjmp(done, 1);
+    }
+
+    instOpcode(mem, pcreg, lastPage, lastOp);
+    if (!tested(pcreg, lastPage, lastOp)) {
+        // Random programs can write these over their own code. The cores
+        // don't agree on them, or in the case of SYNC and CWAI the engine
+        // waits forever, since nothing interrupts it
+        mismatch.stopped = true;
+        longjmp(done, 1);
+    }
+
+    lastPC = pcreg;
+    resync = engineWrong[lastPage][lastOp] || touchesTop(pcreg);
+}
+
+// interpr() calls this before every instruction because tracing is on.
+// At that point the engine has run one more instruction than the
+// Emulator, so run it there and compare.
+void do_trace(void)
+{
+    Emulator& emu = boss9->emulator();
+
+    if (!firstTrace) {
+        emu.execute(RunState::Running);
+        steps += 1;
+
+        if (boss9->exited() || boss9->inMonitor() || emu.error() != Emulator::Error::None) {
+            longjmp(done, 1);
+        }
+
+        // A JSR into the BOSS9 call area makes the call in the Emulator
+        // but the engine just goes there, so make the engine match it. Do
+        // the same after an instruction the engine gets wrong
+        bool syscall = lastPage == 0 && Emulator::opcode(lastOp)->op == Op::JSR && pcreg >= SystemAddrStart;
+        if (resync || syscall) {
+            needSync = true;
+            escape = 1;
+        } else {
+            std::string diff = compare(emu, ccIgnore | ccUndefined[lastPage][lastOp]);
+            if (!diff.empty()) {
+                mismatch.found = true;
+                mismatch.step = steps;
+                mismatch.pc = lastPC;
+                mismatch.diff = diff;
+                longjmp(done, 1);
+            }
+        }
+    }
+    firstTrace = false;
+
+    // After a sync the engine starts from where the Emulator is
+    if (!needSync) {
+        nextInstruction();
+    }
+}
+
+// Called after do_trace sets escape, with the engine's registers saved.
+// They're loaded again after it returns
+void do_escape(void)
+{
+    escape = 0;
+    if (needSyncCC) {
+        needSyncCC = false;
+        ccreg = uint8_t(boss9->emulator().getReg(Reg::CC));
+    }
+    if (needSync) {
+        needSync = false;
+        Emulator& emu = boss9->emulator();
+        setEngineState(emulatorState(emu));
+        memcpy(mem, emu.getAddr(0), RomStart);
+        nextInstruction();
+    }
+}
+
+int do_input(int addr)
+{
+    return mem[IOPAGE + addr];
+}
+
+void do_output(int, int)
+{
+    // Like any write above $8000 it's ignored
+}
+
+static void reset(const uint8_t* memory, const State& st)
+{
+    Emulator& emu = boss9->emulator();
+    memcpy(emu.getAddr(0), memory, 65536);
+    emu.invalidateDecodeCache();
+    emu.resetError();
+    boss9->startExecution(st.pc);
+    setEmulatorState(emu, st);
+    boss9->output().clear();
+
+    memcpy(mem, memory, 65536);
+    setEngineState(st);
+}
+
+static Mismatch lockstep(uint64_t limit)
+{
+    mismatch = Mismatch();
+    steps = 0;
+    maxSteps = limit;
+    firstTrace = true;
+    needSync = false;
+    needSyncCC = false;
+
+    tracing = 1;
+    attention = 1;
+    tracelo = 0;
+    tracehi = 0xffff;
+    escape = 0;
+    irq = 0;
+
+    boss9->emulator().setSliceInsts(1);
+
+    if (setjmp(done) == 0) {
+        interpr();
+    }
+    return mismatch;
+}
+
+// Random programs
+
+using Inst = std::vector<uint8_t>;
+
+class Generator
+{
+  public:
+    Generator(uint32_t seed) : _rand(seed)
+    {
+        // Everything tested except what changes the flow
+        for (uint32_t page = 0; page < 3; ++page) {
+            for (uint32_t i = 0; i < 256; ++i) {
+                Op op = Emulator::opcode(i)->op;
+                if (!documented[page][i] || op == Op::JMP || op == Op::JSR ||
+                        op == Op::RTS || op == Op::RTI || op == Op::SWI) {
+                    continue;
+                }
+                if (page == 0) {
+                    _ops.push_back({ uint8_t(i) });
+                } else {
+                    _ops.push_back({ uint8_t(0x0f + page), uint8_t(i) });
+                }
+            }
+        }
+    }
+
+    uint8_t byte() { return uint8_t(_rand()); }
+    uint16_t word() { return uint16_t(_rand()); }
+
+    Inst inst()
+    {
+        Inst inst = _ops[_rand() % _ops.size()];
+        uint8_t op = inst.back();
+        const Opcode* opcode = Emulator::opcode(op);
+
+        switch (opcode->adr) {
+            case Adr::None:
+            case Adr::Inherent:
+                break;
+            case Adr::Direct:
+            case Adr::Immed8:
+                inst.push_back(byte());
+                break;
+            case Adr::Immed16:
+            case Adr::Extended:
+                inst.push_back(byte());
+                inst.push_back(byte());
+                break;
+            case Adr::Rel:
+                inst.push_back(0);
+                break;
+            case Adr::RelL:
+                inst.push_back(0);
+                inst.push_back(0);
+                break;
+            case Adr::RelP:
+                inst.push_back(0);
+                if (inst.size() > 2) {
+                    inst.push_back(0);
+                }
+                break;
+            case Adr::Indexed:
+                postbyte(inst);
+                break;
+        }
+
+        switch (opcode->op) {
+            default:
+                break;
+            case Op::PUL:
+                // Pulling PC would change the flow
+                inst[1] &= 0x7f;
+                break;
+            case Op::TFR:
+            case Op::EXG:
+                inst[1] = regPair(opcode->op == Op::EXG);
+                break;
+        }
+        return inst;
+    }
+
+  private:
+    // A defined postbyte and any offset bytes it needs
+    void postbyte(Inst& inst)
+    {
+        uint8_t pb;
+        do {
+            pb = byte();
+        } while (!validPostbyte(pb));
+
+        inst.push_back(pb);
+        if (!(pb & 0x80)) {
+            return;
+        }
+
+        uint8_t mode = pb & 0x0f;
+        if (mode == 0x08 || mode == 0x0c) {
+            inst.push_back(byte());
+        } else if (mode == 0x09 || mode == 0x0d || mode == 0x0f) {
+            inst.push_back(byte());
+            inst.push_back(byte());
+        }
+    }
+
+    // Registers of the same size, not including PC as a destination
+    uint8_t regPair(bool exchange)
+    {
+        static const uint8_t regs16[ ] = { 0, 1, 2, 3, 4, 5 };
+        static const uint8_t regs8[ ] = { 8, 9, 10, 11 };
+        while (true) {
+            bool wide = _rand() & 1;
+            uint8_t src = wide ? regs16[_rand() % 6] : regs8[_rand() % 4];
+            uint8_t dst = wide ? regs16[_rand() % 6] : regs8[_rand() % 4];
+            if (dst != 5 && (!exchange || src != 5)) {
+                return uint8_t(src << 4 | dst);
+            }
+        }
+    }
+
+    std::mt19937 _rand;
+    std::vector<Inst> _ops;
+};
+
+static bool runProgram(const std::vector<Inst>& program, const uint8_t* memory, const State& st, Mismatch& result)
+{
+    std::vector<uint8_t> image(memory, memory + 65536);
+    uint16_t addr = ProgramStart;
+    for (const Inst& inst : program) {
+        for (uint8_t b : inst) {
+            image[addr++] = b;
+        }
+    }
+
+    reset(image.data(), st);
+    result = lockstep(program.size());
+    return result.found;
+}
+
+// Take out instructions one at a time, keeping each removal that still
+// shows a mismatch
+static std::vector<Inst> shrink(std::vector<Inst> program, const uint8_t* memory, const State& st, Mismatch& result)
+{
+    program.resize(result.step);
+
+    bool removed = true;
+    while (removed) {
+        removed = false;
+        for (size_t i = 0; i < program.size() && program.size() > 1; ++i) {
+            std::vector<Inst> smaller = program;
+            smaller.erase(smaller.begin() + i);
+            Mismatch m;
+            if (runProgram(smaller, memory, st, m)) {
+                smaller.resize(m.step);
+                program = smaller;
+                result = m;
+                removed = true;
+                --i;
+            }
+        }
+    }
+
+    // Leave the Emulator's memory holding the program for the listing
+    Mismatch m;
+    runProgram(program, memory, st, m);
+    return program;
+}
+
+static void showProgram(const std::vector<Inst>& program, const State& st, const Mismatch& m)
+{
+    m8r::string s;
+    DisplayInst::instToString(boss9->emulator(), s, m.pc);
+    printf("Mismatch after %llu instructions at %s\n", (unsigned long long) m.step, s.trim().c_str());
+    printf("  starting with %s\n", stateToString(st).c_str());
+
+    uint16_t addr = ProgramStart;
+    for (const Inst& inst : program) {
+        DisplayInst::instToString(boss9->emulator(), s, addr);
+        printf("    %s %s\n", (addr == m.pc) ? ">" : " ", s.trim().c_str());
+        addr += inst.size();
+    }
+    printf("%s\n", m.diff.c_str());
+}
+
+static int fuzz(uint32_t count, uint32_t length, uint32_t seed, bool verbose)
+{
+    Generator gen(seed);
+    std::vector<uint8_t> memory(65536);
+    std::set<std::pair<uint8_t, uint8_t>> seen;
+    uint32_t failures = 0;
+    uint64_t total = 0;
+
+    for (uint32_t n = 0; n < count; ++n) {
+        for (auto& it : memory) {
+            it = gen.byte();
+        }
+
+        State st { ProgramStart, gen.word(), gen.word(), gen.word(), uint16_t(StackStart - (gen.word() & 0x0fff)),
+                   gen.byte(), gen.byte(), gen.byte(), gen.byte() };
+
+        std::vector<Inst> program;
+        for (uint32_t i = 0; i < length; ++i) {
+            program.push_back(gen.inst());
+        }
+
+        Mismatch m;
+        bool failed = runProgram(program, memory.data(), st, m);
+        total += steps;
+        if (!failed) {
+            continue;
+        }
+
+        failures += 1;
+
+        // One report per opcode unless asked for all of them
+        uint8_t page, op;
+        instOpcode(boss9->emulator().getAddr(0), m.pc, page, op);
+        if (!verbose && !seen.insert({ page, op }).second) {
+            continue;
+        }
+
+        std::vector<Inst> smallest = shrink(program, memory.data(), st, m);
+        showProgram(smallest, st, m);
+    }
+
+    printf("%d programs, %llu instructions, %d mismatches", count, (unsigned long long) total, failures);
+    if (!verbose) {
+        printf(" in %d opcodes", uint32_t(seen.size()));
+    }
+    printf("\n");
+    return failures ? 1 : 0;
+}
+
+static int runFile(const char* filename, uint64_t limit)
+{
+    Emulator& emu = boss9->emulator();
+    memset(emu.getAddr(0), 0, 65536);
+    Loader loader(emu);
+    if (!loader.loadFile(filename)) {
+        printf("Can't load '%s': %s\n", filename, loader.error());
+        return 1;
+    }
+    uint16_t startAddr = loader.startAddr();
+
+    std::vector<uint8_t> memory(emu.getAddr(0), emu.getAddr(0) + 65536);
+    State st { startAddr, 0, 0, 0, StackStart, 0, 0, 0, 0 };
+
+    reset(memory.data(), st);
+    Mismatch m = lockstep(limit);
+
+    if (m.found) {
+        m8r::string s;
+        DisplayInst::instToString(emu, s, m.pc);
+        printf("%s: mismatch after %llu instructions at %s\n%s\n", filename,
+               (unsigned long long) m.step, s.trim().c_str(), m.diff.c_str());
+        return 1;
+    }
+
+    printf("%s: %llu instructions match", filename, (unsigned long long) steps);
+    if (boss9->exited()) {
+        printf(", exited with code %d", boss9->exitCode());
+    } else if (m.stopped) {
+        printf(", stopped at an untested instruction at $%04x", pcreg);
+    }
+    printf("\n");
+    return 0;
+}
+
+int main(int argc, char * const argv[])
+{
+    uint32_t count = 100000;
+    uint32_t length = 32;
+    uint32_t seed = 1;
+    uint64_t limit = 10000000;
+    bool verbose = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:l:s:m:c:v")) != -1) {
+        switch (c) {
+            case 'n': count = uint32_t(atoi(optarg)); break;
+            case 'l': length = uint32_t(atoi(optarg)); break;
+            case 's': seed = uint32_t(atoi(optarg)); break;
+            case 'm': limit = strtoull(optarg, nullptr, 10); break;
+            case 'c': ccIgnore = uint8_t(strtoul(optarg, nullptr, 16)); break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n programs] [-l length] [-s seed] [-m steps] [-c ccmask] [-v] [filename ...]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    initOpcodes();
+    initKnownDifferences();
+
+    // BOSS9 holds 64KB of RAM
+    boss9 = new FuzzBOSS9();
+    Emulator& emu = boss9->emulator();
+    emu.mapRAM(0, RomStart >> 8, emu.getAddr(0));
+    emu.mapROM(RomStart >> 8, (65536 - RomStart) >> 8, emu.getAddr(RomStart));
+
+    int result = 0;
+    if (optind >= argc) {
+        result = fuzz(count, length, seed, verbose);
+    } else {
+        for (int i = optind; i < argc; ++i) {
+            result |= runFile(argv[i], limit);
+        }
+    }
+
+    delete boss9;
+    return result;
+}
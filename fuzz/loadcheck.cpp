@@ -0,0 +1,138 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of the MC6809 Simulator
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2024, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+//
+//  loadcheck.cpp
+//  Check that program images can't be loaded outside of RAM
+//
+//  Created by Chris Marrin on 6/26/24.
+//
+
+// loadcheck loads records which end past the top of RAM, including ones
+// whose 32 bit address plus size wraps around to a small number, through
+// Loader and through the line at a time loader used by the monitor. Each
+// has to be rejected. A record which ends exactly at the top of RAM has
+// to load. make check builds it with AddressSanitizer, so a write past
+// RAM stops it even if the load isn't rejected.
+//
+// Usage: loadcheck
+//
+// Returns 1 if any check fails.
+
+#include "BOSS9.h"
+#include "Loader.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace mc6809;
+
+class CheckBOSS9 : public BOSS9<65536>
+{
+  protected:
+    virtual void putc(char c) const override { }
+    virtual int getc() override { return 0; }
+    virtual bool handleRunLoop() override { return true; }
+};
+
+static void appendHex(std::string& s, uint8_t value)
+{
+    static const char* digits = "0123456789ABCDEF";
+    s += digits[value >> 4];
+    s += digits[value & 0x0f];
+}
+
+// An S1 (addrSize 2) or S3 (addrSize 4) record of size bytes of $12 at addr
+static std::string sRecord(char type, uint32_t addr, uint8_t addrSize, uint8_t size)
+{
+    std::vector<uint8_t> bytes;
+    bytes.push_back(uint8_t(addrSize + size + 1));
+    for (int i = addrSize - 1; i >= 0; --i) {
+        bytes.push_back(uint8_t(addr >> (i * 8)));
+    }
+    bytes.insert(bytes.end(), size, 0x12);
+
+    std::string s = std::string("S") + type;
+    uint8_t sum = 0;
+    for (uint8_t b : bytes) {
+        appendHex(s, b);
+        sum += b;
+    }
+    appendHex(s, uint8_t(~sum));
+    return s + "\n";
+}
+
+// An Intel hex record with the given type, address and data
+static std::string hexRecord(uint8_t type, uint16_t addr, const std::vector<uint8_t>& data)
+{
+    std::vector<uint8_t> bytes { uint8_t(data.size()), uint8_t(addr >> 8), uint8_t(addr), type };
+    bytes.insert(bytes.end(), data.begin(), data.end());
+
+    std::string s = ":";
+    uint8_t sum = 0;
+    for (uint8_t b : bytes) {
+        appendHex(s, b);
+        sum += b;
+    }
+    appendHex(s, uint8_t(-sum));
+    return s + "\n";
+}
+
+static uint32_t failures = 0;
+
+static void checkLoader(const char* name, const std::string& image, bool shouldLoad)
+{
+    CheckBOSS9 boss9;
+    Loader loader(boss9.emulator());
+    bool loaded = loader.load(image.data(), image.size());
+    if (loaded != shouldLoad) {
+        printf("FAIL %s: %s\n", name, loaded ? "loaded" : loader.error());
+        failures += 1;
+    } else {
+        printf("ok   %s%s%s\n", name, loaded ? "" : ": ", loaded ? "" : loader.error());
+    }
+}
+
+static void checkLoadLine(const char* name, const std::string& line, bool shouldLoad)
+{
+    CheckBOSS9 boss9;
+    Emulator& emu = boss9.emulator();
+    bool finished = false;
+    emu.loadStart();
+    bool loaded = emu.loadLine(line.c_str(), finished);
+    if (loaded != shouldLoad) {
+        printf("FAIL %s: %s\n", name, loaded ? "loaded" : "rejected");
+        failures += 1;
+    } else {
+        printf("ok   %s\n", name);
+    }
+}
+
+int main()
+{
+    std::string end = "S9030000FC\n";
+
+    checkLoader("S1 record ending at the top of RAM", sRecord('1', 0xfff0, 2, 16) + end, true);
+    checkLoader("S1 record past the top of RAM", sRecord('1', 0xfff8, 2, 16) + end, false);
+    checkLoader("S3 record wrapping the address space", sRecord('3', 0xfffffff0, 4, 32) + end, false);
+    checkLoader("S3 record above RAM", sRecord('3', 0x10000, 4, 16) + end, false);
+
+    std::string hexEnd = hexRecord(0x01, 0, { });
+    std::vector<uint8_t> data(32, 0x12);
+    checkLoader("Intel hex record wrapping the address space",
+                hexRecord(0x04, 0, { 0xff, 0xff }) + hexRecord(0x00, 0xfff0, data) + hexEnd, false);
+    checkLoader("Intel hex record past a segment base",
+                hexRecord(0x02, 0, { 0xff, 0xff }) + hexRecord(0x00, 0xfff0, data) + hexEnd, false);
+
+    checkLoadLine("ldLine S1 record ending at the top of RAM", sRecord('1', 0xfff0, 2, 16), true);
+    checkLoadLine("ldLine S3 record wrapping the address space", sRecord('3', 0xfffffff0, 4, 32), false);
+
+    printf("%u failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -34,6 +34,7 @@ input_stack_entry *input_stack_pop(asmstate_t *as, int magic, int (*fn)(input_st
 
 void input_init(asmstate_t *as);
 void input_openstring(asmstate_t *as, char *s, char *str);
+void input_pushpath(asmstate_t *as, char *fn);
 void input_open(asmstate_t *as, char *s);
 char *input_readline(asmstate_t *as);
 char *input_curspec(asmstate_t *as);
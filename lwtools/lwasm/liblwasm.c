@@ -0,0 +1,191 @@
+/*
+liblwasm.c
+
+Copyright © 2024 Chris Marrin
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+This runs the same passes as main() on a source buffer and hands the
+results to the caller instead of doing output, listing and symbol dump.
+*/
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <lw_alloc.h>
+#include <lw_error.h>
+#include <lw_expr.h>
+#include <lw_stringlist.h>
+
+#include "lwasm.h"
+#include "input.h"
+#include "liblwasm.h"
+
+void do_pass1(asmstate_t *as);
+void do_pass2(asmstate_t *as);
+void do_pass3(asmstate_t *as);
+void do_pass4(asmstate_t *as);
+void do_pass5(asmstate_t *as);
+void do_pass6(asmstate_t *as);
+void do_pass7(asmstate_t *as);
+lw_expr_t lwasm_evaluate_special(int t, void *ptr, void *priv);
+lw_expr_t lwasm_evaluate_var(char *var, void *priv);
+lw_expr_t lwasm_parse_term(char **p, void *priv);
+void lwasm_dividezero(void *priv);
+
+static void (*lib_passes[])(asmstate_t *as) = {
+	do_pass1, do_pass2, do_pass3, do_pass4, do_pass5, do_pass6, do_pass7, NULL
+};
+
+/* lw_error() exits, so get back to lwasm_lib_assemble() instead */
+static jmp_buf lib_fatal_jmp;
+static char lib_fatal_message[256];
+
+static void lib_fatal(const char *fmt, va_list args)
+{
+	int l;
+
+	vsnprintf(lib_fatal_message, sizeof(lib_fatal_message), fmt, args);
+	l = strlen(lib_fatal_message);
+	if (l > 0 && lib_fatal_message[l - 1] == '\n')
+		lib_fatal_message[l - 1] = '\0';
+	longjmp(lib_fatal_jmp, 1);
+}
+
+static void lib_report_errors(asmstate_t *as, const lwasm_lib_options_t *opts)
+{
+	line_t *cl;
+	lwasm_error_t *e;
+	char *s;
+
+	for (cl = as -> line_head; cl; cl = cl -> next)
+	{
+		if (!(cl -> err) && !(cl -> warn))
+			continue;
+
+		// trim "include:" as lwasm_show_errors() does
+		s = cl -> linespec;
+		if ((strlen(s) > 8) && (s[7] == ':')) s += 8;
+		while (*s == ' ') s++;
+
+		for (e = cl -> err; e; e = e -> next)
+			opts -> error(opts -> ctx, s, cl -> lineno, 0, e -> mess);
+		for (e = cl -> warn; e; e = e -> next)
+			opts -> error(opts -> ctx, s, cl -> lineno, 1, e -> mess);
+	}
+}
+
+static void lib_report_symbols(asmstate_t *as, struct symtabe *se, const lwasm_lib_options_t *opts)
+{
+	struct symtabe *s;
+
+	if (!se)
+		return;
+
+	lib_report_symbols(as, se -> left, opts);
+
+	for (s = se; s; s = s -> nextver)
+	{
+		// skip local labels and SET variables, like the symbol dump
+		if ((s -> flags & (symbol_flag_nolist | symbol_flag_set)) || s -> context >= 0)
+			continue;
+
+		lwasm_reduce_expr(as, s -> value);
+		if (lw_expr_istype(s -> value, lw_expr_type_int))
+			opts -> symbol(opts -> ctx, s -> symbol, lw_expr_intval(s -> value));
+	}
+
+	lib_report_symbols(as, se -> right, opts);
+}
+
+int lwasm_lib_assemble(const lwasm_lib_options_t *opts, int *execaddr)
+{
+	asmstate_t *as;
+	line_t *cl;
+	char *source;
+	int passnum;
+	int i;
+
+	*execaddr = -1;
+
+	lw_expr_set_special_handler(lwasm_evaluate_special);
+	lw_expr_set_var_handler(lwasm_evaluate_var);
+	lw_expr_set_term_parser(lwasm_parse_term);
+	lw_expr_setdivzero(lwasm_dividezero);
+
+	/* initialize assembler state the same as main() */
+	as = lw_alloc(sizeof(asmstate_t));
+	memset(as, 0, sizeof(asmstate_t));
+	as -> include_list = lw_stringlist_create();
+	as -> input_files = lw_stringlist_create();
+	as -> nextcontext = 1;
+	as -> exprwidth = 16;
+	as -> tabwidth = 8;
+	as -> pragmas = PRAGMA_FORWARDREFMAX;
+	as -> output_format = OUTPUT_SREC;
+	as -> execaddr = -1;
+
+	for (i = 0; opts -> include_dirs && opts -> include_dirs[i]; i++)
+		lw_stringlist_addstring(as -> include_list, (char *)(opts -> include_dirs[i]));
+
+	lw_error_setfunc(lib_fatal);
+	if (setjmp(lib_fatal_jmp))
+	{
+		lw_error_setfunc(NULL);
+		lib_report_errors(as, opts);
+		opts -> error(opts -> ctx, opts -> name, 0, 0, lib_fatal_message);
+		return as -> errorcount + 1;
+	}
+
+	input_init(as);
+
+	/* the source directory is the "current file" directory for includes */
+	source = lw_alloc(opts -> size + 1);
+	memcpy(source, opts -> source, opts -> size);
+	source[opts -> size] = '\0';
+	input_pushpath(as, (char *)(opts -> name));
+	input_openstring(as, (char *)(opts -> name), source);
+	lw_free(source);
+
+	for (passnum = 0; lib_passes[passnum]; passnum++)
+	{
+		as -> passno = passnum;
+		(lib_passes[passnum])(as);
+		if (as -> errorcount > 0)
+			break;
+	}
+	lw_error_setfunc(NULL);
+
+	lib_report_errors(as, opts);
+	if (as -> errorcount > 0)
+		return as -> errorcount;
+
+	for (cl = as -> line_head; cl; cl = cl -> next)
+	{
+		if (cl -> outputl > 0)
+			opts -> emit(opts -> ctx, lw_expr_intval(cl -> addr), cl -> output, cl -> outputl);
+	}
+
+	if (opts -> symbol)
+		lib_report_symbols(as, as -> symtab.head, opts);
+
+	*execaddr = as -> execaddr;
+	return 0;
+}
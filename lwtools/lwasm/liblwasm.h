@@ -0,0 +1,69 @@
+/*
+liblwasm.h
+
+Copyright © 2024 Chris Marrin
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+Interface for running the assembler inside another program. The source is
+given in memory and the code, symbols and errors are passed back through
+functions rather than written to files. Build it with "make liblwasm",
+which makes lwasm/liblwasm.a with lwlib included.
+
+The assembler keeps some of its state in globals, so only one assembly can
+run at a time. Memory used by the assembly isn't freed.
+*/
+
+#ifndef ___liblwasm_h_seen___
+#define ___liblwasm_h_seen___
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lwasm_lib_options_s
+{
+	const char *name;					// name of the source, for errors; includes are found relative to it
+	const char *source;					// source text
+	int size;							// size of the source text
+	const char * const *include_dirs;	// NULL terminated list of include directories (-I), or NULL
+	void *ctx;							// passed to the functions below
+
+	// called with the code from each line, in order
+	void (*emit)(void *ctx, int addr, const unsigned char *data, int size);
+
+	// called for each global label and EQU with a known value, or NULL
+	void (*symbol)(void *ctx, const char *name, int value);
+
+	// called for each error and warning. line is 0 for errors which
+	// stopped the assembly, like a missing include file
+	void (*error)(void *ctx, const char *file, int line, int warning, const char *message);
+} lwasm_lib_options_t;
+
+/*
+Assemble as if with "-f srec". Nothing is emitted if there are errors.
+Returns the number of errors and sets execaddr to the address given with
+END, or -1 if there isn't one.
+*/
+int lwasm_lib_assemble(const lwasm_lib_options_t *opts, int *execaddr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ___liblwasm_h_seen___ */
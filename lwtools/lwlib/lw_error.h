@@ -22,7 +22,13 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #ifndef ___lw_error_h_seen___
 #define ___lw_error_h_seen___
 
+#include <stdarg.h>
+
 void lw_error(const char *fmt, ...);
-void lw_error_setfunc(void (*f)(const char *fmt, ...));
+/*
+f is called with the format and arguments given to lw_error. It can
+longjmp() out of the error; if it returns the program exits.
+*/
+void lw_error_setfunc(void (*f)(const char *fmt, va_list args));
 
 #endif /* ___lw_error_h_seen___ */
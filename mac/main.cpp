@@ -5,15 +5,23 @@
 //  Created by Chris Marrin on 4/23/24.
 //
 
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <vector>
 #include <unistd.h>
 #include <sys/ioctl.h>
 
+#include "Assembler.h"
 #include "BOSS9.h"
+#include "Batch.h"
 #include "Format.h"
+#include "InputLog.h"
+#include "Loader.h"
+#include "Profiler.h"
+#include "Tracer.h"
 
 // Test data
 char simpleTest[ ] =
@@ -26,6 +34,7 @@ char simpleTest[ ] =
 ;
 
 static constexpr uint32_t MemorySize = 65536;
+static constexpr uint32_t ConsoleCheckTime = 10000; // us between checks for ESC
 
 class MacBOSS9 : public mc6809::BOSS9<MemorySize>
 {
@@ -40,9 +49,13 @@ class MacBOSS9 : public mc6809::BOSS9<MemorySize>
   protected:
     virtual void putc(char c) const override
     {
-        // Throttle character output so console doesn't get swamped
-        usleep(100);
-        fputc(c, stdout);
+        write(&c, 1);
+    }
+    
+    virtual void write(const char* buf, uint32_t size) const override
+    {
+        fwrite(buf, 1, size, stdout);
+        fflush(stdout);
     }
     
     virtual int getc() override
@@ -66,22 +79,132 @@ class MacBOSS9 : public mc6809::BOSS9<MemorySize>
     uint32_t _cursor = 0;
 };
 
-char* findNextLine(char* s)
+static std::string readFile(const std::string& filename, bool& ok)
+{
+    std::ifstream f(filename, std::ios::binary);
+    std::stringstream stream;
+    stream << f.rdbuf();
+    ok = f.is_open();
+    return stream.str();
+}
+
+// Run every image with every input file, or once each with no input if
+// there are none. Output from each run goes to <image>.out, or to
+// <image>-<input>.out if there are inputs.
+static int runBatch(mc6809::BatchRunner& runner, char* const images[], int count, const std::vector<std::string>& inputFiles)
 {
-    while (*s != '\n' && *s != '\0') {
-        ++s;
+    std::vector<mc6809::BatchJob> jobs;
+    std::vector<std::string> inputs;
+    std::vector<std::string> inputNames;
+    
+    for (const auto& it : inputFiles) {
+        bool ok;
+        inputs.push_back(readFile(it, ok));
+        if (!ok) {
+            std::cout << "Can't open input '" << it << "'\n";
+            return -1;
+        }
+        std::string name = it.substr(it.find_last_of('/') + 1);
+        inputNames.push_back(name.substr(0, name.find_last_of('.')));
     }
-    if (*s != '\0') {
-        s++;
+    
+    for (int i = 0; i < count; ++i) {
+        std::string filename = images[i];
+        bool ok;
+        std::string image = readFile(filename, ok);
+        if (!ok) {
+            std::cout << "Can't open '" << filename << "'\n";
+            return -1;
+        }
+        std::string path = filename.substr(0, filename.find_last_of('.'));
+        
+        // Assemble .asm files here rather than with lwasm
+        if (filename.substr(filename.find_last_of('.') + 1) == "asm") {
+            mc6809::Assembler assembler;
+            assembler.addIncludeDir("emulator");
+            std::string source = image;
+            if (!assembler.assemble(image, filename.c_str(), source.data(), source.size())) {
+                std::cout << assembler.errors() << "Assembly of '" << filename << "' failed\n";
+                return -1;
+            }
+        }
+        
+        if (inputs.empty()) {
+            jobs.push_back({ path, image, "" });
+        }
+        for (size_t j = 0; j < inputs.size(); ++j) {
+            jobs.push_back({ path + "-" + inputNames[j], image, inputs[j] });
+        }
     }
-    return s;
+    
+    std::cout << "Running " << jobs.size() << " programs on " << runner.threads() << " threads\n";
+    
+    auto start = std::chrono::steady_clock::now();
+    std::vector<mc6809::BatchResult> results = runner.run(jobs);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    uint32_t failed = 0;
+    uint64_t cycles = 0;
+    for (const auto& it : results) {
+        std::string outName = it.name + ".out";
+        std::ofstream out(outName);
+        out << it.output;
+        
+        fmt::printf("%-40s %-10s code=%-4d cycles=%-12llu %.3fs\n", it.name.c_str(),
+                    mc6809::BatchRunner::statusToString(it.status), it.exitCode,
+                    (unsigned long long) it.cycles, it.seconds);
+        
+        if (it.status != mc6809::BatchStatus::Exited || it.exitCode != 0) {
+            failed += 1;
+        }
+        cycles += it.cycles;
+    }
+    
+    fmt::printf("%d of %d failed, %llu cycles in %.3fs\n", failed, uint32_t(results.size()),
+                (unsigned long long) cycles, seconds);
+    return failed ? 1 : 0;
 }
 
 //
-// Usage: emulator -m [filename]
+// Usage: emulator -m -t -f -s MHz -o cps -a addr -p -x tracefile -r|-R inputlog [filename]
+//        emulator -d tracefile
+//        emulator -b -t -f -a addr -j threads -c cycles -i inputfile ... filename ...
 //
 //          -m:         stop in monitor on entry
-//          filename:   s19 file to load. If none given a simple test progam is loaded
+//          -t:         use the threaded block engine
+//          -f:         fastest execution, without cycle counting
+//          -s:         pace execution to a clock rate in MHz, such as 1, 1.5
+//                      or 2. Without it the program runs as fast as it can
+//          -o:         limit console output to this many chars per second,
+//                      like a serial terminal. Without it output is as fast
+//                      as the program makes it
+//          -a:         load and start raw binaries (lwasm -f raw or -f abs)
+//                      at this address, such as 0x200. Other formats have
+//                      their own addresses
+//          -p:         profile the program. Symbols come from the assembler
+//                      for .asm and .clvr files, otherwise from the lwasm
+//                      listing <filename>.lst if there is one. The
+//                      report is written to <filename>.prof and the call
+//                      paths to <filename>.folded for flamegraph.pl
+//          -x:         write a binary trace of every instruction to tracefile.
+//                      This uses the Traced policy
+//          -d:         print the binary trace in tracefile as text and exit
+//          -r:         record the program's console input to inputlog
+//          -R:         replay the program's console input from inputlog
+//                      instead of the console, and exit when the program does
+//          -b:         run each program in its own emulator, without the
+//                      console, using a thread per core. Each gets console
+//                      input from each -i file in turn. Output is written to
+//                      a .out file per run and the exit code and cycles of
+//                      each are printed. Returns 1 if any didn't exit with 0
+//          -j:         number of threads for -b
+//          -c:         stop each -b run after this many cycles, default 1000000000.
+//                      With -f cycles aren't counted, so it's instructions
+//          -i:         input file for -b, can be given more than once
+//          filename:   program to load, as s-records, Intel hex, DECB, Dragon
+//                      or raw binary. .asm files are assembled in memory with
+//                      lwasm's passes and .clvr files are compiled with clvr
+//                      first. If none given a simple test progam is loaded
 int main(int argc, char * const argv[])
 {
     // For now we're going to assume 64KB of RAM and that there will
@@ -91,35 +214,114 @@ int main(int argc, char * const argv[])
     //
     // We'll figure out the rest later.
     
-    system("stty raw");
-    
     MacBOSS9 boss9;
     
     boss9.emulator().setStack(0xe000);
+    boss9.setSliceTime(ConsoleCheckTime);
     
     uint16_t startAddr = 0;
     bool startInMonitor = false;
+    bool profile = false;
+    const char* traceFile = nullptr;
+    const char* recordFile = nullptr;
+    const char* replayFile = nullptr;
+    uint16_t rawAddr = 0;
+    bool rawAddrSet = false;
+    bool batch = false;
+    uint32_t threads = 0;
+    uint64_t maxCycles = mc6809::BatchRunner::DefaultMaxCycles;
+    std::vector<std::string> inputFiles;
     int c;
         
-    while ((c = getopt(argc, argv, "m")) != -1) {
+    while ((c = getopt(argc, argv, "mtfs:o:a:px:d:r:R:bj:c:i:")) != -1) {
         switch (c) {
             case 'm':
                 startInMonitor = true;
                 break;
+            case 't':
+                boss9.emulator().setEngine(mc6809::Engine::Threaded);
+                break;
+            case 'f':
+                boss9.emulator().setPolicy(mc6809::Policy::Throughput);
+                break;
+            case 's':
+                boss9.setClockRate(uint32_t(atof(optarg) * 1000000));
+                break;
+            case 'o':
+                boss9.setOutputRate(uint32_t(atoi(optarg)));
+                break;
+            case 'a':
+                rawAddr = uint16_t(strtoul(optarg, nullptr, 0));
+                rawAddrSet = true;
+                break;
+            case 'b':
+                batch = true;
+                break;
+            case 'j':
+                threads = uint32_t(atoi(optarg));
+                break;
+            case 'c':
+                maxCycles = strtoull(optarg, nullptr, 10);
+                break;
+            case 'i':
+                inputFiles.push_back(optarg);
+                break;
+            case 'p':
+                profile = true;
+                break;
+            case 'x':
+                traceFile = optarg;
+                break;
+            case 'r':
+                recordFile = optarg;
+                break;
+            case 'R':
+                replayFile = optarg;
+                break;
+            case 'd':
+                if (!mc6809::Tracer::decode(optarg, stdout)) {
+                    fprintf(stderr, "Can't read trace file '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                exit(EXIT_SUCCESS);
             default: /* '?' */
-                fprintf(stderr, "Usage: %s [-m] [filename]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-m] [-t] [-f] [-s MHz] [-o cps] [-a addr] [-p] [-x tracefile] [-r|-R inputlog] [filename]\n", argv[0]);
+                fprintf(stderr, "       %s -d tracefile\n", argv[0]);
+                fprintf(stderr, "       %s -b [-t] [-f] [-a addr] [-j threads] [-c cycles] [-i inputfile]... filename...\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
     
-    char* fileString = nullptr;
-    bool isFileStringAllocated = false;
-    uint32_t size = 0;
+    if (batch) {
+        if (optind >= argc) {
+            fprintf(stderr, "-b needs at least one program\n");
+            exit(EXIT_FAILURE);
+        }
+        mc6809::BatchRunner runner(threads);
+        runner.setEngine(boss9.emulator().engine());
+        runner.setPolicy(boss9.emulator().policy());
+        runner.setMaxCycles(maxCycles);
+        if (rawAddrSet) {
+            runner.setRawAddr(rawAddr);
+        }
+        return runBatch(runner, argv + optind, argc - optind, inputFiles);
+    }
+    
+    system("stty raw");
+    
+    mc6809::Loader loader(boss9.emulator());
+    if (rawAddrSet) {
+        loader.setRawAddr(rawAddr);
+    }
+    mc6809::Assembler assembler;
+    assembler.addIncludeDir("emulator");
+    bool loaded;
+    bool assembled = false;
+    std::string basePath = "simpleTest";
     
     if (optind >= argc) {
         // use sample
-        fileString = simpleTest;
-        size = sizeof(simpleTest);
+        loaded = loader.load(simpleTest, sizeof(simpleTest));
     } else {
         std::string filename = argv[optind];
 
@@ -133,6 +335,7 @@ int main(int argc, char * const argv[])
         // Are we compiling?
         std::string path = filename.substr(0, filename.find_last_of('.'));
         std::string suffix = filename.substr(filename.find_last_of(".") + 1);
+        basePath = path;
         
         if (suffix == "clvr") {
             // Compile the clover file
@@ -149,66 +352,129 @@ int main(int argc, char * const argv[])
             }
             
             // Successful compile the .asm file is in the same dir, assemble it
-            cmd = "/usr/local/bin/lwasm -I emulator -f srec -o";
-            cmd += path;
-            cmd += ".s19 -l";
-            cmd += path;
-            cmd += ".lst ";
-            cmd += path;
-            cmd += ".asm";
-            retval = std::system(cmd.c_str());
-            if (WIFEXITED(retval) == 0) {
-                std::cout << "Assembly of '" << path << ".asm' abnormally terminated, exiting\n";
+            filename = path + ".asm";
+            suffix = "asm";
+        }
+
+        if (suffix == "asm") {
+            // Assemble straight into memory rather than running lwasm and
+            // loading the .s19 it writes
+            bool ok;
+            std::string source = readFile(filename, ok);
+            if (!ok) {
+                std::cout << "Can't open '" << filename << "'\n";
                 return -1;
             }
-            if (WEXITSTATUS(retval) != 0) {
-                std::cout << "Assembly of '" << path << ".asm' failed, exiting\n";
+            assembled = assembler.assemble(boss9.emulator(), filename.c_str(), source.data(), source.size());
+            std::cout << assembler.errors();
+            if (!assembled) {
+                std::cout << "Assembly of '" << filename << "' failed, exiting\n";
+                return -1;
             }
-            
-            filename = path + ".s19";
-        }
-
-        std::ifstream f(filename);
-        if (f.is_open()) {
-            size = uint32_t(std::filesystem::file_size(filename));
-            fileString = new char[size + 1];
-            f.read(fileString, size);
-            fileString[size] = '\0';
-            f.close();
+            loaded = true;
         } else {
-            std::cout << "Unable to open '" << filename << "'\n";
-            return -1;
+            loaded = loader.loadFile(filename.c_str());
         }
     }
     
-    boss9.emulator().loadStart();
-    while (true) {
-        bool finished;
-        if (!boss9.emulator().loadLine(fileString, finished)) {
-            std::cout << "Unable to load file\n";
-            return -1;
+    if (!loaded) {
+        std::cout << "Unable to load file: " << loader.error() << "\n";
+        return -1;
+    }
+    
+    startAddr = assembled ? assembler.startAddr() : loader.startAddr();
+
+    mc6809::Profiler profiler;
+    if (profile) {
+        std::string listing = basePath + ".lst";
+        if (assembled) {
+            for (const auto& it : assembler.symbols()) {
+                profiler.addSymbol(it.value, it.name);
+            }
+        } else if (!profiler.loadSymbols(listing.c_str())) {
+            std::cout << "No listing '" << listing << "', profiling without symbols\n";
         }
+        profiler.start(startAddr);
+        boss9.emulator().setProfiler(&profiler);
+    }
 
-        fileString = findNextLine(fileString);
-        if (*fileString == '\0') {
-            break;
+    mc6809::Tracer tracer;
+    if (traceFile) {
+        if (!tracer.open(traceFile)) {
+            std::cout << "Can't create trace file '" << traceFile << "'\n";
+            return -1;
         }
+        boss9.emulator().setPolicy(mc6809::Policy::Traced);
+        boss9.emulator().setTracer(&tracer);
     }
-    
-    startAddr = boss9.emulator().loadEnd();
-    
-    if (isFileStringAllocated) {
-        delete [ ] fileString;
+
+    mc6809::InputLog inputLog;
+    if (recordFile || replayFile) {
+        bool ok = recordFile ? inputLog.record(recordFile) : inputLog.replay(replayFile);
+        if (!ok) {
+            std::cout << "Can't open input log '" << (recordFile ? recordFile : replayFile) << "'\n";
+            return -1;
+        }
+        boss9.setInputLog(&inputLog);
     }
 
     boss9.startExecution(startAddr, startInMonitor);
     
-    while (boss9.continueExecution()) { }
+    while (boss9.continueExecution()) {
+        if (replayFile && boss9.exited()) {
+            break;
+        }
+        
+        // Nothing is scheduled to end a SYNC or CWAI, so don't spin
+        if (boss9.emulator().waitingForInterrupt()) {
+            usleep(1000);
+        }
+    }
+    boss9.flushOutput();
     
     if (boss9.emulator().error() != mc6809::Emulator::Error::None) {
         fmt::printf("*** finished with error: %d\n", int32_t(boss9.emulator().error()));
     } else {
         fmt::printf("    finished successfully\n");
     }
+    
+    if (recordFile) {
+        std::cout << "    " << inputLog.count() << " input chars recorded to " << recordFile << "\n";
+    } else if (replayFile) {
+        if (inputLog.diverged()) {
+            fmt::printf("*** replay diverged from the recording at cycle %u\n", inputLog.divergedCycles());
+        } else if (!inputLog.finished()) {
+            fmt::printf("*** program finished before replaying all the input\n");
+        }
+    }
+    boss9.setInputLog(nullptr);
+    inputLog.close();
+    
+    if (traceFile) {
+        boss9.emulator().setTracer(nullptr);
+        uint64_t count = tracer.count();
+        tracer.close();
+        std::cout << "    " << count << " instructions traced to " << traceFile << "\n";
+    }
+    
+    if (profile) {
+        std::string reportName = basePath + ".prof";
+        std::string foldedName = basePath + ".folded";
+        FILE* report = fopen(reportName.c_str(), "w");
+        FILE* folded = fopen(foldedName.c_str(), "w");
+        if (report && folded) {
+            profiler.writeReport(report);
+            profiler.writeFolded(folded);
+            fmt::printf("    profile written to %s and %s\n", reportName.c_str(), foldedName.c_str());
+        } else {
+            fmt::printf("*** unable to write profile\n");
+        }
+        if (report) {
+            fclose(report);
+        }
+        if (folded) {
+            fclose(folded);
+        }
+    }
     return 0;
 }
@@ -1078,7 +1078,14 @@ VERBT	FCC	/LET/
 
 INTEEE RTS  ; Do nothing for now
 
-TSTBRK  BSR GETCHR   ; Maybe does the same?
+TSTBRK  JSR peekc    ; Only read a char if one is waiting
+        TSTA
+        BEQ TSTB05
+        BSR GETCHR
+        CMPA #ETX
+        BNE TSTB05
+        JMP BREAK
+TSTB05  RTS
 
 GETCHR  JSR getc     ; Need to loop until get char
         TSTA
@@ -0,0 +1,43 @@
+*  6809 Benchmark program from sbc09/bench09.asm
+*  Sums a table of bytes 65536 times, printing 'a' at the
+*  start and 'b' at the end, then exits with 0. Exits with 1
+*  after printing 'e' if a sum is wrong.
+
+    include BOSS9.inc
+
+	org $200
+
+main	lda #'a'
+	jsr putc
+
+	ldy #0
+loop	ldx #data
+	lda #(enddata-data)
+	clrb
+loop2	addb ,x+
+	deca
+	bne loop2
+	cmpb #210
+	lbne error
+	leay -1,y
+	bne loop
+
+	lda #'b'
+	jsr putc
+	lda #newline
+	jsr putc
+	clra
+	jsr exit
+
+error	lda #'e'
+	jsr putc
+	lda #newline
+	jsr putc
+	lda #1
+	jsr exit
+
+data 	fcb 1,2,3,4,5,6,7,8,9,10
+	fcb 11,12,13,14,15,16,17,18,19,20
+enddata
+
+	end main